@@ -9,4 +9,26 @@
 
 typedef short bool;
 
+// A machine cell (register, stack item, address). Building with -DCELL32
+// gives the 32-bit variant of the machine.
+#ifdef CELL32
+typedef unsigned int Cell;
+typedef int SCell;
+typedef unsigned long long DCell;   // double cell
+typedef long long SDCell;
+#define CELL_BYTES 4
+#define CELL_FMT "%08X"
+#else
+typedef unsigned short Cell;
+typedef short SCell;
+typedef unsigned int DCell;
+typedef int SDCell;
+#define CELL_BYTES 2
+#define CELL_FMT "%04X"
+#endif
+
+#define CELL_BITS (CELL_BYTES * 8)
+#define CELL_MASK ((Cell)~0)
+#define CELL_SIGN ((Cell)1 << (CELL_BITS - 1))
+
 #endif
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+
+#include "fakeforth.h"
+#include "simulator.h"
+
+
+// The library API is a thin layer over the simulator: it keeps the common.h
+// types and the Simulator structure out of the host's way, turns the VM's
+// state after a run into an FF_xx result, and applies the instruction limit.
+// Its helpers are static, and the Makefile makes the simulator's functions
+// local to the library, to keep them out of the host's namespace.
+
+struct FFVM
+{
+    Simulator *sim;
+    unsigned long limit;    // 0 for none
+};
+
+
+static void discard_output(void *context, const char *str, size_t len)
+{
+}
+
+
+static int run_result(Simulator *sim)
+{
+    // SIM_ERR_xx codes are the FF_ERR_xx ones negated
+    if (sim->halted)
+    {
+        return (sim->error == SIM_OK) ? FF_EXITED : -sim->error;
+    }
+
+    return sim->preempted ? FF_BUDGET : FF_OK;
+}
+
+
+static void start_run(FFVM *vm)
+{
+    vm->sim->budget = (vm->limit == 0) ? SIM_NO_LIMIT : vm->limit;
+}
+
+
+int ff_create(FFVM **vm, const void *image, size_t size)
+{
+    int error;
+    Simulator *sim = sim_load(image, size, &error);
+    if (sim == NULL)
+    {
+        *vm = NULL;
+        return -error;
+    }
+
+    // No input until there is a read callback or ff_eval, and no output
+    SimIO io = { discard_output, NULL, NULL };
+    sim_set_io(sim, &io);
+    sim->host_input = TRUE;
+
+    *vm = malloc(sizeof(FFVM));
+    (*vm)->sim = sim;
+    (*vm)->limit = 0;
+    return FF_OK;
+}
+
+
+FFVM *ff_clone(FFVM *vm)
+{
+    FFVM *clone = malloc(sizeof(FFVM));
+    clone->sim = sim_clone(vm->sim);
+    clone->limit = vm->limit;
+    return clone;
+}
+
+
+void ff_destroy(FFVM *vm)
+{
+    sim_free(vm->sim);
+    free(vm);
+}
+
+
+void ff_set_io(FFVM *vm, const FFIO *io)
+{
+    SimIO sim_io = { io->write, io->read, io->context };
+    if (sim_io.write == NULL)
+    {
+        sim_io.write = discard_output;
+    }
+    sim_set_io(vm->sim, &sim_io);
+    vm->sim->host_input = (io->read == NULL);
+}
+
+
+void ff_set_limit(FFVM *vm, unsigned long instructions)
+{
+    vm->limit = instructions;
+}
+
+
+int ff_run(FFVM *vm)
+{
+    Simulator *sim = vm->sim;
+    sim->host_input = (sim->io.read == NULL);
+    sim->waiting = FALSE;
+    sim->wait_channel = NULL;
+    start_run(vm);
+    sim_run(sim);
+    return run_result(sim);
+}
+
+
+int ff_eval(FFVM *vm, const char *src, size_t len)
+{
+    start_run(vm);
+    sim_eval(vm->sim, src, len, NULL);
+    return run_result(vm->sim);
+}
+
+
+int ff_call(FFVM *vm, FFCell xt, const FFCell *args, int nargs, FFCell *results, int nresults)
+{
+    Simulator *sim = vm->sim;
+    Cell entry;
+    if (!sim->halted && !sim_lookup_symbol(sim, "call_entry", &entry))
+    {
+        return FF_ERR_NO_ENTRY;
+    }
+
+    Cell *cell_args = malloc((nargs + nresults + 1) * sizeof(Cell));
+    Cell *cell_results = cell_args + nargs;
+    for (int i = 0; i < nargs; i++)
+    {
+        cell_args[i] = args[i];
+    }
+
+    start_run(vm);
+    bool ok = sim_call(sim, xt, cell_args, nargs, cell_results, nresults);
+    if (ok)
+    {
+        for (int i = 0; i < nresults; i++)
+        {
+            results[i] = cell_results[i];
+        }
+    }
+    free(cell_args);
+
+    if (!ok && !sim->halted && !sim->preempted)
+    {
+        return FF_ERR_WAIT;
+    }
+
+    return run_result(sim);
+}
+
+
+const char *ff_error_message(FFVM *vm)
+{
+    return vm->sim->error_message;
+}
+
+
+int ff_exit_code(FFVM *vm)
+{
+    return vm->sim->exit_code;
+}
+
+
+void ff_push(FFVM *vm, FFCell value)
+{
+    sim_push(vm->sim, value);
+}
+
+
+int ff_pop(FFVM *vm, FFCell *value)
+{
+    Cell cell;
+    if (!sim_pop(vm->sim, &cell))
+    {
+        return FF_ERR_EMPTY;
+    }
+
+    *value = cell;
+    return FF_OK;
+}
+
+
+int ff_depth(FFVM *vm)
+{
+    return vm->sim->data_depth;
+}
+
+
+size_t ff_memory_size(void)
+{
+    return MEMSIZE;
+}
+
+
+int ff_cell_bytes(void)
+{
+    return CELL_BYTES;
+}
+
+
+FFCell ff_read_cell(FFVM *vm, FFCell addr)
+{
+    return sim_read_word(vm->sim, addr);
+}
+
+
+void ff_write_cell(FFVM *vm, FFCell addr, FFCell value)
+{
+    sim_write_word(vm->sim, addr, value);
+}
+
+
+void ff_read(FFVM *vm, FFCell addr, void *buf, size_t len)
+{
+    unsigned char *bytes = buf;
+    for (size_t i = 0; i < len; i++)
+    {
+        bytes[i] = vm->sim->memory[(addr + i) & MEMMASK];
+    }
+}
+
+
+void ff_write(FFVM *vm, FFCell addr, const void *buf, size_t len)
+{
+    const unsigned char *bytes = buf;
+    for (size_t i = 0; i < len; i++)
+    {
+        vm->sim->memory[(addr + i) & MEMMASK] = bytes[i];
+    }
+}
+
+
+int ff_lookup(FFVM *vm, const char *name, FFCell *addr)
+{
+    Cell cell;
+    if (!sim_lookup_symbol(vm->sim, (char *)name, &cell))
+    {
+        return FF_ERR_NO_SYMBOL;
+    }
+
+    *addr = cell;
+    return FF_OK;
+}
@@ -0,0 +1,121 @@
+#ifndef FAKEFORTH_H
+#define FAKEFORTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libfakeforth - the FakeForth VM as a library, for embedding in C programs.
+//
+// A VM is created from an object file (ff.fo) already in memory, and runs
+// Forth fed to it by ff_eval or pulled through a read callback. Output goes
+// to a write callback. Runs can be limited to a number of instructions, and
+// the host can call Forth words directly with ff_call.
+//
+// The library has no global state, and nothing is printed: what went wrong
+// comes back as an FF_ERR_xx code, with a message from ff_error_message.
+// Different VMs can be used from different threads at once; a VM itself must
+// only be used by one thread at a time. Link with -lpthread.
+//
+//     FFVM *vm;
+//     if (ff_create(&vm, image, image_size) != FF_OK) ...
+//     ff_set_io(vm, &(FFIO){ .write = my_write, .context = my_state });
+//     ff_eval(vm, ": SQUARE DUP * ;\n", 17);
+//     ff_eval(vm, "' SQUARE\n", 9);
+//     FFCell xt, arg = 12, result;
+//     ff_pop(vm, &xt);
+//     ff_call(vm, xt, &arg, 1, &result, 1);    // result = 144
+//     ff_destroy(vm);
+
+typedef struct FFVM FFVM;
+
+// A VM cell: 16 bits, or 32 with a CELL32 build; higher bits are dropped
+// going into the VM
+typedef uint32_t FFCell;
+
+// Host I/O. write gets the VM's output. read fills buf with up to size bytes
+// of input and returns the number read, 0 at end of input, or -1 if there is
+// none yet; ff_run then returns FF_OK, and can be called again once there
+// is. Input can come in any size of chunk: a line only goes to the
+// interpreter once its newline or the end of input has been read. write may
+// be called from threads running the VM's cores.
+typedef struct FFIO
+{
+    void (*write)(void *context, const char *str, size_t len);
+    long (*read)(void *context, char *buf, size_t size);
+    void *context;
+} FFIO;
+
+// What ff_run, ff_eval and ff_call came back with
+#define FF_OK           0       // needs more input, or (ff_call) the word returned
+#define FF_BUDGET       1       // used up the instruction limit; ff_run goes on
+#define FF_EXITED       2       // the program exited (BYE); see ff_exit_code
+
+// Errors. The VM has halted unless noted, and ff_error_message says why.
+#define FF_ERR_LOAD     (-1)    // the image could not be loaded (ff_create only)
+#define FF_ERR_STACK    (-2)    // stack underflow
+#define FF_ERR_ILLEGAL  (-3)    // illegal instruction
+#define FF_ERR_DIVIDE   (-4)    // division by zero
+#define FF_ERR_ALIGN    (-5)    // unaligned atomic access
+#define FF_ERR_SERVICE  (-6)    // unknown system service
+#define FF_ERR_LIMIT    (-7)    // out of tasks, cores or channels
+#define FF_ERR_ID       (-8)    // no such task, core or channel
+#define FF_ERR_IO       (-9)    // block file or input error
+#define FF_ERR_TASKS    (-10)   // every task has stopped
+#define FF_ERR_HLT      (-11)   // executed HLT
+#define FF_ERR_BRK      (-12)   // executed BRK
+#define FF_ERR_NO_ENTRY (-13)   // ff_call: the image has no call_entry (the VM has not halted)
+#define FF_ERR_WAIT     (-14)   // ff_call: the word waited for input
+#define FF_ERR_EMPTY    (-15)   // ff_pop: the data stack is empty (the VM has not halted)
+#define FF_ERR_NO_SYMBOL (-16)  // ff_lookup: no such label (the VM has not halted)
+
+// Create a VM from an object file image of size bytes, which is copied. It
+// starts at the image's entry point the first time it runs, with no input,
+// and discards its output until ff_set_io is called.
+int ff_create(FFVM **vm, const void *image, size_t size);
+
+// A copy of vm as it is now, sharing its image, so vm has to outlive it. It
+// has the same callbacks and limit, and no files, cores or channels.
+FFVM *ff_clone(FFVM *vm);
+
+void ff_destroy(FFVM *vm);
+
+// Use io's callbacks; a NULL write discards output, and a NULL read leaves
+// ff_eval as the only source of input
+void ff_set_io(FFVM *vm, const FFIO *io);
+
+// Instructions each ff_run, ff_eval or ff_call may execute; 0 for no limit
+void ff_set_limit(FFVM *vm, unsigned long instructions);
+
+// Run on input from the read callback until it needs more than there is
+int ff_run(FFVM *vm);
+
+// Run with src as input until the VM has consumed it and waits for more
+int ff_eval(FFVM *vm, const char *src, size_t len);
+
+// Call the word xt with nargs arguments on the data stack (args[0] deepest),
+// and take nresults results off it (results[0] deepest). On FF_OK the VM
+// carries on afterwards as if nothing had happened. Any other result leaves
+// the VM inside the word, and it should be destroyed.
+int ff_call(FFVM *vm, FFCell xt, const FFCell *args, int nargs, FFCell *results, int nresults);
+
+// Why the VM halted, or "" if it has not; and the code it exited with
+const char *ff_error_message(FFVM *vm);
+int ff_exit_code(FFVM *vm);
+
+// The data stack
+void ff_push(FFVM *vm, FFCell value);
+int ff_pop(FFVM *vm, FFCell *value);
+int ff_depth(FFVM *vm);
+
+// VM memory. Addresses wrap at the end of memory; cells are big-endian.
+size_t ff_memory_size(void);
+int ff_cell_bytes(void);
+FFCell ff_read_cell(FFVM *vm, FFCell addr);
+void ff_write_cell(FFVM *vm, FFCell addr, FFCell value);
+void ff_read(FFVM *vm, FFCell addr, void *buf, size_t len);
+void ff_write(FFVM *vm, FFCell addr, const void *buf, size_t len);
+
+// Address of a label in the image, such as var_HERE; FF_OK if it was found
+int ff_lookup(FFVM *vm, const char *name, FFCell *addr);
+
+#endif
@@ -5,12 +5,71 @@
         .set F_HIDDEN, $20
         .set F_LENMASK, $1F     ; mask to get just the length (low order bits)
         .set F_LENHIDMASK, $3F  ; F_LENMASK | F_HIDDEN
+        .set DICT_HASHMASK, $FF ; DICT_BUCKETS - 1 (see forth.h)
+        .set TIB_SIZE, $100     ; size of the terminal input buffer
+        .set WORD_SIZE, $20     ; size of word_buffer
+
+        ; Host services for SYS (see simulator.h)
+        .set SYS_EMIT, $1
+        .set SYS_KEY, $2
+        .set SYS_WRITE, $3
+        .set SYS_READ, $4
+        .set SYS_PUTN, $5
+        .set SYS_PSTACK, $6
+        .set SYS_PRSTACK, $7
+        .set SYS_CLOCK, $8
+        .set SYS_EXIT, $9
+        .set SYS_OPEN, $A
+        .set SYS_CREATE, $B
+        .set SYS_CLOSE, $C
+        .set SYS_FREAD, $D
+        .set SYS_FWRITE, $E
+        .set SYS_FSIZE, $F
+        .set SYS_FTELL, $10
+        .set SYS_FSEEK, $11
+        .set SYS_BLOCK, $12
+        .set SYS_BUFFER, $13
+        .set SYS_UPDATE, $14
+        .set SYS_SAVEBUFS, $15
+        .set SYS_EMPTYBUFS, $16
+        .set SYS_BLKPOOL, $17
+        .set SYS_KEYQ, $18
+        .set SYS_TASK, $19
+        .set SYS_ACTIVATE, $1A
+        .set SYS_STOP, $1B
+        .set SYS_TIMER, $1C
+        .set SYS_SPAWN, $1D
+        .set SYS_JOIN, $1E
+        .set SYS_CHANNEL, $1F
+        .set SYS_SEND, $20
+        .set SYS_RECEIVE, $21
+        .set SYS_CLOSECHAN, $22
+        .set SYS_RETURN, $23
+
+        ; File access methods
+        .set FAM_RO, $0
+        .set FAM_WO, $1
+        .set FAM_RW, $2
+
+
+; ------------------
+; NEXT - move to the next instruction of the high level word. Expanded
+; inline at the end of each primitive to save the jump to next.
+; ------------------
+        .macro NEXT
+        LDW CA, (IP)
+        ADD IP, CELL
+        JMP (CA)
+        .endm
+
 
 _start:
         LDW IP, cold_start      ; set the IP to a reference to QUIT
         LDW A, HIMEM            ; get end of used memory...
         STW A, (var_HERE)       ; ...and save it as HERE
-        JMP next
+        SYS SYS_BLKPOOL         ; free memory runs up to the block buffers
+        STW A, (var_LIMIT)
+        NEXT
 
 
 ; ------------------
@@ -19,18 +78,41 @@ _start:
 ;    CA - points to the codeword of the word we're about to execute
 ; ------------------
 DOCOL:  RPUSH IP                ; We're nesting down, so save the IP for when we're done
-        ADD CA, $2              ; Move CA to point to the first data word
+        ADD CA, CELL            ; Move CA to point to the first data word
         LDW IP, CA              ; Put data word in IP
-        JMP next
+        NEXT
+
+
+; ------------------
+; DOCON - push the value in the word's data field
+; ------------------
+DOCON:  ADD CA, CELL            ; Move CA to point to the data word
+        LDW A, (CA)
+        DPUSH A
+        NEXT
+
+
+; ------------------
+; next - out-of-line copy of NEXT, for code that wants to jump to it
+; ------------------
+next:   NEXT
 
 
 ; ------------------
-; NEXT - move to the next instruction of the high level word
+; call_entry - where a host embedding the VM runs a word (sim_call)
+;    CA - the word's xt, with its arguments on the data stack
 ; ------------------
-next:   LDW CA, (IP)
-        ADD IP, $2
+call_entry:
+        LDW IP, call_exit       ; the word returns to the host
         JMP (CA)
 
+call_exit:
+        .word call_return
+call_return:
+        .word call_return_code
+call_return_code:
+        SYS SYS_RETURN
+
 
 cold_start:                     ; colon-word w/o a header or codeword
         .word QUIT
@@ -39,6 +121,10 @@ cold_start:                     ; colon-word w/o a header or codeword
 
 ; -------------------------------------------------------------------
 ; Easy Forth Primitives
+;
+; The top of the data stack lives in register T, so DUP is DPUSH T and
+; a unary word like 1+ works on T in place. DPOP moves the next item
+; up into T, and DPUSH spills T before replacing it.
 ; -------------------------------------------------------------------
 
 
@@ -47,40 +133,37 @@ cold_start:                     ; colon-word w/o a header or codeword
 DROP:   .word DROP_code
 DROP_code:
         DPOP A                  ; throw away
-        JMP next
+        NEXT
 
 
 ; --- SWAP - swap top two elements of stack
         .dict "SWAP"
 SWAP:   .word SWAP_code
 SWAP_code:
-        DPOP A
-        DPOP B
-        DPUSH A
+        DPOP A                  ; A = top, T = second
+        LDW B, T
+        LDW T, A
         DPUSH B
-        JMP next
+        NEXT
 
 
 ; --- DUP
         .dict "DUP"
 DUP:    .word DUP_code
 DUP_code:
-        DPOP A
-        DPUSH A
-        DPUSH A
-        JMP next
+        DPUSH T
+        NEXT
 
 
 ; --- OVER
         .dict "OVER"
 OVER:   .word OVER_code
 OVER_code:
-        DPOP A
-        DPOP B
-        DPUSH B
+        DPOP A                  ; A = top, T = second
+        LDW B, T
         DPUSH A
         DPUSH B
-        JMP next
+        NEXT
 
 
 ; --- ROT
@@ -89,11 +172,11 @@ ROT:    .word ROT_code
 ROT_code:
         DPOP A
         DPOP B
-        DPOP C
-        DPUSH B
+        LDW C, T
+        LDW T, B
         DPUSH A
         DPUSH C
-        JMP next
+        NEXT
 
 
 ; --- 2DROP
@@ -102,20 +185,19 @@ TDROP:  .word TDROP_code
 TDROP_code:
         DPOP A
         DPOP A
-        JMP next
+        NEXT
 
 
 ; --- 2DUP
         .dict "2DUP"
 TDUP:   .word TDUP_code
 TDUP_code:
-        DPOP A
-        DPOP B
-        DPUSH B
+        DPOP A                  ; A = top, T = second
+        LDW B, T
         DPUSH A
         DPUSH B
         DPUSH A
-        JMP next
+        NEXT
 
 
 ; --- 2SWAP
@@ -125,43 +207,36 @@ TSWAP_code:
         DPOP A
         DPOP B
         DPOP C
-        DPOP D
-        DPUSH B
+        LDW D, T
+        LDW T, B
         DPUSH A
         DPUSH D
         DPUSH C
-        JMP next
+        NEXT
 
 
 ; --- ?DUP
         .dict "?DUP"
 QDUP:   .word QDUP_code
 QDUP_code:
-        DPOP A          ; get the top of stack
-        DPUSH A
-        CMP A, $0
-        JEQ _QDUP
-        DPUSH A
-_QDUP:  JMP next
+        BEQ T, $0, _QDUP
+        DPUSH T
+_QDUP:  NEXT
 
 
 ; --- 1+
         .dict "1+"
 INC:    .word INC_code
 INC_code:
-        DPOP A
-        INC A
-        DPUSH A
-        JMP next
+        INC T
+        NEXT
 
 ; --- 1-
         .dict "1-"
 DEC:    .word DEC_code
 DEC_code:
-        DPOP A
-        DEC A
-        DPUSH A
-        JMP next
+        DEC T
+        NEXT
 
 
 
@@ -170,10 +245,8 @@ DEC_code:
 ADD:    .word ADD_code
 ADD_code:
         DPOP B
-        DPOP A
-        ADD A, B
-        DPUSH A
-        JMP next
+        ADD T, B
+        NEXT
 
 
 ; --- SUB (-)
@@ -181,10 +254,8 @@ ADD_code:
 SUB:    .word SUB_code
 SUB_code:
         DPOP B
-        DPOP A
-        SUB A, B
-        DPUSH A
-        JMP next
+        SUB T, B
+        NEXT
 
 
 ; --- MULT (*)
@@ -192,10 +263,8 @@ SUB_code:
 MULT:   .word MULT_code
 MULT_code:
         DPOP B
-        DPOP A
-        MUL A, B
-        DPUSH A
-        JMP next
+        MUL T, B
+        NEXT
 
 
 ; --- /MOD
@@ -203,11 +272,113 @@ MULT_code:
 DIVMOD: .word DIVMOD_code
 DIVMOD_code:
         DPOP B
-        DPOP A
+        LDW A, T
         DIV A, B
-        DPUSH B
+        LDW T, B                ; remainder under...
+        DPUSH A                 ; ...the quotient
+        NEXT
+
+
+
+; -------------------------------------------------------------------
+; Mixed and double-cell arithmetic. A double is two cells on the stack,
+; with the high cell on top.
+; -------------------------------------------------------------------
+
+
+; --- UM* ( u1 u2 -- ud )
+        .dict "UM*"
+UMSTAR: .word UMSTAR_code
+UMSTAR_code:
+        DPOP B
+        LDW A, T
+        UMUL A, B               ; A = high, B = low
+        LDW T, B
+        DPUSH A
+        NEXT
+
+
+; --- M* ( n1 n2 -- d )
+        .dict "M*"
+MSTAR:  .word MSTAR_code
+MSTAR_code:
+        DPOP B
+        LDW A, T
+        MMUL A, B
+        LDW T, B
+        DPUSH A
+        NEXT
+
+
+; --- UM/MOD ( ud u1 -- u2 u3 ) remainder and quotient
+        .dict "UM/MOD"
+UMSLASHMOD:
+        .word UMSLASHMOD_code
+UMSLASHMOD_code:
+        DPOP C                  ; divisor
+        DPOP A                  ; high cell
+        LDW B, T                ; low cell
+        UDIV A, B, C            ; A = quotient, B = remainder
+        LDW T, B
+        DPUSH A
+        NEXT
+
+
+; --- SM/REM ( d n1 -- n2 n3 ) symmetric division: remainder and quotient
+        .dict "SM/REM"
+SMSLASHREM:
+        .word SMSLASHREM_code
+SMSLASHREM_code:
+        DPOP C
+        DPOP A
+        LDW B, T
+        SDIV A, B, C
+        LDW T, B
+        DPUSH A
+        NEXT
+
+
+; --- */MOD ( n1 n2 n3 -- n4 n5 ) n1*n2/n3 with a double intermediate: remainder and quotient
+        .dict "*/MOD"
+STARSLASHMOD:
+        .word STARSLASHMOD_code
+STARSLASHMOD_code:
+        DPOP C
+        DPOP B
+        LDW A, T
+        MMUL A, B
+        SDIV A, B, C
+        LDW T, B
+        DPUSH A
+        NEXT
+
+
+; --- */ ( n1 n2 n3 -- n4 ) n1*n2/n3 with a double intermediate
+        .dict "*/"
+STARSLASH:
+        .word STARSLASH_code
+STARSLASH_code:
+        DPOP C
+        DPOP B
+        LDW A, T
+        MMUL A, B
+        SDIV A, B, C
+        LDW T, A
+        NEXT
+
+
+; --- D+ ( d1 d2 -- d3 )
+        .dict "D+"
+DPLUS:  .word DPLUS_code
+DPLUS_code:
+        DPOP C                  ; d2 high
+        DPOP D                  ; d2 low
+        DPOP A                  ; d1 high
+        LDW B, T                ; d1 low
+        DADD A, B, C, D
+        LDW T, B
         DPUSH A
-        JMP next
+        NEXT
 
 
 
@@ -222,7 +393,7 @@ TRUE:   .word TRUE_code
 TRUE_code:
         LDW A, $FF
         DPUSH A
-        JMP next
+        NEXT
 
 
 ; --- FALSE
@@ -231,7 +402,16 @@ FALSE:  .word FALSE_code
 FALSE_code:
         LDW A, $0
         DPUSH A
-        JMP next
+        NEXT
+
+
+; Tails for the comparisons below, which replace the top of stack with the flag
+_SETTRUE:
+        LDW T, $FF
+        NEXT
+_SETFALSE:
+        LDW T, $0
+        NEXT
 
 
 ; --- EQUAL (=)
@@ -239,10 +419,8 @@ FALSE_code:
 EQUAL:  .word EQUAL_code
 EQUAL_code:
         DPOP B
-        DPOP A
-        CMP A, B
-        JEQ TRUE_code
-        JMP FALSE_code
+        BEQ T, B, _SETTRUE
+        JMP _SETFALSE
 
 
 ; --- NOT EQUAL (<>)
@@ -250,10 +428,8 @@ EQUAL_code:
 NEQUAL:  .word NEQUAL_code
 NEQUAL_code:
         DPOP B
-        DPOP A
-        CMP A, B
-        JEQ FALSE_code
-        JMP TRUE_code
+        BEQ T, B, _SETFALSE
+        JMP _SETTRUE
 
 
 ; --- LESS (<)
@@ -261,10 +437,8 @@ NEQUAL_code:
 LESS:   .word LESS_code
 LESS_code:
         DPOP B
-        DPOP A
-        CMP A, B
-        JLT TRUE_code
-        JMP FALSE_code
+        BLT T, B, _SETTRUE
+        JMP _SETFALSE
 
 
 ; --- GREAT (>)
@@ -272,10 +446,8 @@ LESS_code:
 GREAT:  .word GREAT_code
 GREAT_code:
         DPOP B
-        DPOP A
-        CMP A, B
-        JGT TRUE_code
-        JMP FALSE_code
+        BGT T, B, _SETTRUE
+        JMP _SETFALSE
 
 
 ; --- LESS-EQUAL (<=)
@@ -283,10 +455,8 @@ GREAT_code:
 LTE:    .word LTE_code
 LTE_code:
         DPOP B
-        DPOP A
-        CMP A, B
-        JLE TRUE_code
-        JMP FALSE_code
+        BLE T, B, _SETTRUE
+        JMP _SETFALSE
 
 
 ; --- GREATER-EQUAL (>=)
@@ -294,54 +464,40 @@ LTE_code:
 GTE:    .word GTE_code
 GTE_code:
         DPOP B
-        DPOP A
-        CMP A, B
-        JGE TRUE_code
-        JMP FALSE_code
+        BGE T, B, _SETTRUE
+        JMP _SETFALSE
 
 
 ; --- ZERO-EQUAL (0=)
         .dict "0="
 ZEROE:  .word ZEROE_code
 ZEROE_code:
-        DPOP A
-        LDW B, $0
-        CMP A, B
-        JEQ TRUE_code
-        JMP FALSE_code
+        BEQ T, $0, _SETTRUE
+        JMP _SETFALSE
 
 
 ; --- ZERO-NEQUAL (0<>)
         .dict "0<>"
 ZERON:  .word ZERON_code
 ZERON_code:
-        DPOP A
-        LDW B, $0
-        CMP A, B
-        JEQ FALSE_code
-        JMP TRUE_code
+        BEQ T, $0, _SETFALSE
+        JMP _SETTRUE
 
 
 ; --- ZERO-LESS (0<)
         .dict "0<"
 ZEROL:  .word ZEROL_code
 ZEROL_code:
-        DPOP A
-        LDW B, $0
-        CMP A, B
-        JLT TRUE_code
-        JMP FALSE_code
+        BLT T, $0, _SETTRUE
+        JMP _SETFALSE
 
 
 ; --- ZERO-GREAT (0>)
         .dict "0>"
 ZEROG:  .word ZEROG_code
 ZEROG_code:
-        DPOP A
-        LDW B, $0
-        CMP A, B
-        JGT TRUE_code
-        JMP FALSE_code
+        BGT T, $0, _SETTRUE
+        JMP _SETFALSE
 
 
 ; TODO - AND
@@ -353,10 +509,8 @@ ZEROG_code:
         .dict "INVERT"
 INVERT: .word INVERT_code
 INVERT_code:
-        DPOP A
-        NOT A
-        DPUSH A
-        JMP next
+        NOT T
+        NEXT
 
 
 
@@ -369,7 +523,7 @@ INVERT_code:
 EXIT:   .word EXIT_code
 EXIT_code:
         RPOP IP
-        JMP next
+        NEXT
 
 
 ; -------------------------------------------------------------------
@@ -383,9 +537,9 @@ EXIT_code:
 LIT:    .word LIT_code
 LIT_code:
         LDW X, (IP)
-        ADD IP, $2
+        ADD IP, CELL
         DPUSH X
-        JMP next
+        NEXT
 
 
 
@@ -400,17 +554,15 @@ STORE_code:
         DPOP X                  ; address to store
         DPOP Y                  ; value to store
         STW Y, (X)              ; do it - store value of Y at address pointed to by X
-        JMP next
+        NEXT
 
 
 ; --- FETCH
         .dict "@"
 FETCH:  .word FETCH_code
 FETCH_code:
-        DPOP X                  ; address to fetch
-        LDW Y, (X)              ; fetch it
-        DPUSH Y                 ; and put it on the stack
-        JMP next
+        LDW T, (T)              ; replace the address with what it points to
+        NEXT
 
 
 ; --- ADDSTORE (+!)
@@ -423,7 +575,7 @@ ADDSTORE_code:
         LDW C, (A)
         ADD C, B
         STW C, (A)
-        JMP next
+        NEXT
 
 
 ; --- SUBSTORE (-!)
@@ -436,13 +588,161 @@ SUBSTORE_code:
         LDW C, (A)
         SUB C, B
         STW C, (A)
-        JMP next
+        NEXT
 
 
 ; TODO - C!
 ; TODO - C@
 ; TODO - C@C!
-; TODO - CMOVE
+
+
+; --- CMOVE ( c-addr1 c-addr2 u -- ) copy u bytes from c-addr1 to c-addr2
+; As if a byte at a time from low addresses to high, so when the destination
+; overlaps the end of the source the copied bytes are copied again. MOVS does
+; the work: all at once when nothing would be copied again, and otherwise in
+; pieces as long as the distance between the two, each from the last.
+        .dict "CMOVE"
+CMOVE:  .word CMOVE_code
+CMOVE_code:
+        DPOP C                  ; length
+        DPOP B                  ; destination
+        DPOP A                  ; source
+        LDW D, B
+        SUB D, A                ; how far the destination is past the source
+        BEQ D, $0, _CMOVE_3
+        BLT D, C, _CMOVE_1
+        MOVS A, B, C
+        NEXT
+_CMOVE_1:
+        BLT C, D, _CMOVE_2
+        MOVS A, B, D
+        ADD A, D
+        ADD B, D
+        SUB C, D
+        JMP _CMOVE_1
+_CMOVE_2:
+        MOVS A, B, C
+_CMOVE_3:
+        NEXT
+
+
+; --- CMOVE> ( c-addr1 c-addr2 u -- )
+; As if a byte at a time from high addresses to low; the same pieces as
+; CMOVE, from the top down
+        .dict "CMOVE>"
+CMOVEUP:
+        .word CMOVEUP_code
+CMOVEUP_code:
+        DPOP C                  ; length
+        DPOP B                  ; destination
+        DPOP A                  ; source
+        LDW D, A
+        SUB D, B                ; how far the source is past the destination
+        BEQ D, $0, _CMOVEUP_4
+        BLT D, C, _CMOVEUP_1
+        MOVS A, B, C
+        NEXT
+_CMOVEUP_1:
+        ADD A, C                ; start just past the ends
+        ADD B, C
+_CMOVEUP_2:
+        BLT C, D, _CMOVEUP_3
+        SUB A, D
+        SUB B, D
+        MOVS A, B, D
+        SUB C, D
+        JMP _CMOVEUP_2
+_CMOVEUP_3:
+        SUB A, C
+        SUB B, C
+        MOVS A, B, C
+_CMOVEUP_4:
+        NEXT
+
+
+; --- MOVE ( addr1 addr2 u -- )
+; MOVS copies overlapping ranges as if through a temporary buffer
+        .dict "MOVE"
+MOVE:   .word MOVE_code
+MOVE_code:
+        DPOP C                  ; length
+        DPOP B                  ; destination
+        DPOP A                  ; source
+        MOVS A, B, C
+        NEXT
+
+
+; --- FILL ( c-addr u char -- )
+        .dict "FILL"
+FILL:   .word FILL_code
+FILL_code:
+        DPOP C                  ; fill byte
+        DPOP B                  ; length
+        DPOP A                  ; address
+        FILS A, B, C
+        NEXT
+
+
+; --- ERASE ( addr u -- )
+        .dict "ERASE"
+ERASE:  .word ERASE_code
+ERASE_code:
+        DPOP B                  ; length
+        DPOP A                  ; address
+        LDW C, $0
+        FILS A, B, C
+        NEXT
+
+
+
+; -------------------------------------------------------------------
+; Strings
+; -------------------------------------------------------------------
+
+; --- COMPARE ( c-addr1 u1 c-addr2 u2 -- n )
+        .dict "COMPARE"
+COMPARE:
+        .word COMPARE_code
+COMPARE_code:
+        DPOP D                  ; length 2
+        DPOP C                  ; address 2
+        DPOP B                  ; length 1
+        DPOP A                  ; address 1
+        LDW M, B                ; compare the shorter length...
+        BGE D, M, _COMPARE_1
+        LDW M, D
+_COMPARE_1:
+        CMPS A, C, M            ; ...in one go
+        JLT _COMPARE_3
+        JGT _COMPARE_4
+        CMP B, D                ; common part matches, so the shorter string is less
+        JLT _COMPARE_3
+        JGT _COMPARE_4
+        LDW A, $0
+_COMPARE_2:
+        DPUSH A
+        NEXT
+_COMPARE_3:
+        LDW A, $-1
+        JMP _COMPARE_2
+_COMPARE_4:
+        LDW A, $1
+        JMP _COMPARE_2
+
+
+; --- SEARCH ( c-addr1 u1 c-addr2 u2 -- c-addr3 u3 flag )
+        .dict "SEARCH"
+SEARCH: .word SEARCH_code
+SEARCH_code:
+        DPOP D                  ; needle length
+        DPOP C                  ; needle address
+        DPOP B                  ; string length
+        DPOP A                  ; string address
+        SCAS A, B, C, D         ; on a match, A and B are moved to it
+        DPUSH A
+        DPUSH B
+        JEQ TRUE_code
+        JMP FALSE_code
 
 
 ; -------------------------------------------------------------------
@@ -456,7 +756,7 @@ LATEST: .word LATEST_code
 LATEST_code:
         LDW A, var_LATEST
         DPUSH A
-        JMP next
+        NEXT
 
 
 ; --- BASE
@@ -465,7 +765,7 @@ BASE:   .word BASE_code
 BASE_code:
         LDW A, var_BASE
         DPUSH A
-        JMP next
+        NEXT
 
 
 ; --- HERE
@@ -474,7 +774,26 @@ HERE:   .word HERE_code
 HERE_code:
         LDW A, var_HERE
         DPUSH A
-        JMP next
+        NEXT
+
+
+; --- >IN
+        .dict ">IN"
+TOIN:   .word TOIN_code
+TOIN_code:
+        LDW A, var_TOIN
+        DPUSH A
+        NEXT
+
+
+; --- SOURCE-ID ( -- 0 | -1 )
+        .dict "SOURCE-ID"
+SOURCEID:
+        .word SOURCEID_code
+SOURCEID_code:
+        LDW A, (var_SOURCE_ID)
+        DPUSH A
+        NEXT
 
 
 ; --- STATE
@@ -483,7 +802,7 @@ STATE:  .word STATE_code
 STATE_code:
         LDW A, var_STATE
         DPUSH A
-        JMP next
+        NEXT
 
 
 ; -------------------------------------------------------------------
@@ -496,7 +815,7 @@ STATE_code:
 VERSION_code:
         LDW A,$A            ; Arbitrary starting point 
         DPUSH A
-        JMP next
+        NEXT
 
 
 ; TODO - R0 constant
@@ -510,7 +829,7 @@ VERSION_code:
 F_HIDDEN_code:
         LDW A, F_HIDDEN
         DPUSH A
-        JMP next
+        NEXT
 
 
 ; TODO - F_LENMASK constant
@@ -528,7 +847,7 @@ TOR:    .word TOR_code
 TOR_code:
         DPOP A
         RPUSH A
-        JMP next
+        NEXT
 
 
 ; --- R> - pop return stack and push on data stack
@@ -537,7 +856,7 @@ FROMR:  .word FROMR_code
 FROMR_code:
         RPOP A
         DPUSH A
-        JMP next
+        NEXT
 
 
 ; TODO - RSP@ - need return stack in memory to implement these two
@@ -549,7 +868,7 @@ FROMR_code:
 RDROP:  .word RDROP_code
 RDROP_code:
         RPOP A
-        JMP next
+        NEXT
 
 
 ; --- R@ - copy from return stack to data stack - ( -- x ) ( R: x -- x )
@@ -559,7 +878,7 @@ RCOPY_code:
         RPOP A
         RPUSH A
         DPUSH A
-        JMP next
+        NEXT
 
 
 
@@ -582,20 +901,41 @@ KEY:   .word KEY_code
 KEY_code:
         CALL _KEY               ; get a character...
         DPUSH X                 ; ...and push it on the stack
-        JMP next
+        NEXT
 
-_KEY:   GETC X                  ; read character from stdin
+_KEY:   SYS SYS_KEY             ; read character from stdin
+        LDW X, A
         ; TODO - handle input buffers, etc. Take care to only return a byte!
         RET
 
 
+; --- KEY? ( -- flag )
+        .dict "KEY?"
+KEYQ:   .word KEYQ_code
+KEYQ_code:
+        SYS SYS_KEYQ            ; A = 0 if no character is waiting
+        DPUSH A
+        BNE A, $0, _SETTRUE
+        NEXT
+
+
 ; --- EMIT
         .dict "EMIT"
 EMIT:   .word EMIT_code
 EMIT_code:
-        DPOP X                  ; get character to print...
-        PUTC X                  ; ...and print it.
-        JMP next
+        DPOP A                  ; get character to print...
+        SYS SYS_EMIT            ; ...and print it.
+        NEXT
+
+
+; --- TYPE ( c-addr u -- )
+        .dict "TYPE"
+TYPE:   .word TYPE_code
+TYPE_code:
+        DPOP B                  ; length
+        DPOP A                  ; address
+        SYS SYS_WRITE
+        NEXT
 
 
 ; --- WORD
@@ -605,38 +945,82 @@ WORD_code:
         CALL _WORD
         DPUSH X                 ; push base address
         DPUSH Y                 ; push length
-        JMP next
+        NEXT
+
+_WORD:
+        ; Parse the next blank-delimited word from the input source into
+        ; word_buffer, skipping \ comments and refilling the TIB as needed
+        ; Returns length in Y (0 at end of input) and address in X
+        ; Uses: I, A, B, Z
+        LDW X, var_SOURCE
+        TOKEN X, Y              ; X = start of the word in the source, Y = length
+        BNE Y, $0, _WORD_1
+        CALL _REFILL            ; source is used up, try to get another line
+        BNE Z, $0, _WORD
+        RET                     ; end of input, Y = 0
 
-_WORD:  
-        ; Search for first non-blank character, skipping \ comments
-        ; Returns length in Y and address in X
-        ; Uses: I
 _WORD_1:
-        CALL _KEY               ; get next key, returned in X
-        CMP X, $'\'             ; is it the start of a comment?
-        JEQ _WORD_3
-        CMP X, $20              ; whitespace?
-        JLE _WORD_1
-
-        LDW I, word_buffer
+        BLE Y, F_LENMASK, _WORD_2 ; truncate over-long words to what a header can hold
+        LDW Y, F_LENMASK
 _WORD_2:
-        STB X, (I)
-        INC I
-        CALL _KEY
-        CMP X, $20              ; space?
-        JGT _WORD_2             ; nope, keep going
-
-        ; Return the word (pointer to buffer) and length
-        LDW Y, I
-        SUB Y, word_buffer
+        LDW I, word_buffer
+        MOVS X, I, Y
         LDW X, word_buffer
         RET
 
-_WORD_3:        ; skip \ comments to end of current line
-        CALL _KEY
-        CMP X, $A               ; end of line?
-        JNE _WORD_3
-        JMP _WORD_1
+
+; --- REFILL ( -- flag )
+        .dict "REFILL"
+REFILL: .word REFILL_code
+REFILL_code:
+        CALL _REFILL
+        DPUSH Z
+        NEXT
+
+        ; Read the next line from the terminal into the TIB and make it the input source
+        ; output: Z = true if a line was read, false at end of input or if the
+        ; source is not the terminal
+        ; Uses: A, B
+_REFILL:
+        LDW Z, $0
+        LDW A, (var_SOURCE_ID)
+        BNE A, $0, _REFILL_1    ; only the terminal can be refilled
+        LDW A, tib
+        LDW B, TIB_SIZE
+        GETL A, B               ; B = length, or -1 at end of input
+        BEQ B, $-1, _REFILL_1
+        STW A, (var_SOURCE)
+        STW B, (var_SOURCE_LEN)
+        LDW A, $0
+        STW A, (var_TOIN)
+        LDW Z, $FF
+_REFILL_1:
+        RET
+
+
+; --- ACCEPT ( c-addr +n1 -- +n2 )
+        .dict "ACCEPT"
+ACCEPT: .word ACCEPT_code
+ACCEPT_code:
+        DPOP B                  ; buffer size
+        DPOP A                  ; buffer address
+        GETL A, B
+        BNE B, $-1, _ACCEPT_1   ; nothing read at end of input
+        LDW B, $0
+_ACCEPT_1:
+        DPUSH B
+        NEXT
+
+
+; --- SOURCE ( -- c-addr u )
+        .dict "SOURCE"
+SOURCE: .word SOURCE_code
+SOURCE_code:
+        LDW A, (var_SOURCE)
+        DPUSH A
+        LDW A, (var_SOURCE_LEN)
+        DPUSH A
+        NEXT
 
 
 ; --- >NUMBER  (NUMBER in JonesForth)
@@ -648,70 +1032,14 @@ NUMBER_code:
         CALL _NUMBER
         DPUSH X                 ; parsed number
         DPUSH Y                 ; number of unparsed chars (0 = no error)
-        JMP next
+        NEXT
 
         ; Parse number
         ; input: X = string address, Y = length
-        ; output: Z = parsed number, Y = number of unparsed chars (0 = success)
+        ; output: X = parsed number, Y = number of unparsed chars (0 = success)
 _NUMBER:
-        CMP Y, $0               ; trying to parse a zero-length string is an error, but will return 0
-        JEQ _NUMBER_5
-
-        LDW I, X
-        LDW X, $0
         LDW B, (var_BASE)
-
-        ; Check if first char is '-'
-        LDB D, (I)
-        INC I
-        LDW A, $0
-        DPUSH A
-        CMP D, $'-'
-        JNE _NUMBER_2
-        DPOP A                  ; throw away
-        LDW A, $1
-        DPUSH A                 ; push <> 0 to indicate negative
-        DEC Y                   ; decrement the length, as we consumed the '-'
-        CMP Y, $0
-        JNE _NUMBER_1           ; read the digits
-        DPOP A                  ; error, string is only '-'
-        LDW Y, $1
-        RET
-
-        ; Loop reading digits
-_NUMBER_1:
-        MUL X, B                ; A *= BASE
-        LDB D, (I)              ; get next char
-        INC I
-
-        ; Convert 0-9, A-Z to a number 0-35.
-_NUMBER_2:
-        CMP D, $'0'             ; < '0'?
-        JLT _NUMBER_4
-        SUB D, $'0'
-        CMP D, $A               ; > '0'?
-        JLT _NUMBER_3           ; nope, was a digit - go process
-        CMP D, $11              ; > '0' but < 'A'?
-        JLT _NUMBER_4           ; yes, invalid
-        SUB D, $7
-
-_NUMBER_3:
-        CMP D, B                ; >= BASE?
-        JGE _NUMBER_4
-
-        ADD X, D                ; digit is okay, add it and loop
-        DEC Y
-        CMP Y, $0               ; at end of string?
-        JNE _NUMBER_1           ; not yet
-
-        ; Negate the result if first char was '-' (saved on stack)
-_NUMBER_4:
-        DPOP A
-        CMP A, $0
-        JEQ _NUMBER_5
-        NEG X
-
-_NUMBER_5:
+        TONUM X, Y, B
         RET
 
 
@@ -728,66 +1056,69 @@ FIND_code:
         DPOP X                   ; word address
         CALL _FIND
         DPUSH Z
-        JMP next
+        NEXT
 
         ; Lookup word in dictionary
         ; input: X = word address, Y = word length
         ; output: Z = address of dict entry if found, or 0 if not found
+        ; Only the word's hash bucket is searched, newest entry first.
 _FIND:
-        LDW I, (var_LATEST)
+        CALL _HASH              ; M = address of the bucket head
+        LDW I, (M)
 _FIND_1:
-        CMP I, $0               ; is this the null pointer at the end of the linked list?
-        JEQ _FIND_4             ; ...yup...
+        BEQ I, $0, _FIND_4      ; is this the null pointer at the end of the bucket chain?
 
         ; Compare the lengths
-        LDW A, $2               ; get length address...
-        ADD A, I                ; ...into X
+        LDW A, I                ; get length address...
+        ADD A, CELL             ; ...past the link
         LDB B, (A)              ; get the length
         AND B, F_LENHIDMASK     ; ...and apply it
-        CMP Y, B                ; do lengths match?
-        JNE _FIND_2             ; nope, try next dict entry
+        BNE Y, B, _FIND_2       ; do lengths match?
 
         ; Lengths match, check the string
-        DPUSH X                 ; save the address
-        DPUSH Y                 ; save the length
-        LDW A, $3               ; point to the dict string...
-        ADD A, I                ; ...we want to compare
-_FIND_x:
-        LDB C, (X)              ; get the bytes...
-        LDB D, (A)              ; ...to compare
-        CMP C, D
-        JNE _FIND_3             ; strings do not match
-
-        INC X                   ; inc word address
-        INC A                   ; inc dict address
-        DEC Y                   ; dec length
-        CMP Y, $0
-        JNE _FIND_x             ; compare remaining chars
+        INC A                   ; point to the dict string we want to compare
+        CMPS X, A, Y
+        JNE _FIND_2             ; strings do not match
 
         ; Hey! We have a match!
-        DPOP Y                  ; clean up the stack
-        DPOP X
         LDW Z, I                ; return dict pointer
-_FIND_y:
         RET
 
-        ; Current word is not a match; try prior link
+        ; Current word is not a match; try prior entry in the bucket
 _FIND_2:
+        SUB I, CELL             ; hash link is just before the entry
         LDW I, (I)
         JMP _FIND_1
 
-        ; String does not match; restore X and Y and move on to next dict entry
-_FIND_3:
-        DPOP Y                  ; restore length
-        DPOP X                  ; restore address
-        JMP _FIND_2
-
         ; Not found
 _FIND_4:
         LDW Z, $0               ; return zero to indicate not found
         RET
 
 
+        ; Hash a word to find its dictionary bucket; must match dict_hash in ffasm
+        ; input: X = word address, Y = word length
+        ; output: M = address of the bucket head in dict_hash
+        ; Uses: A, B, C
+_HASH:
+        LDW M, $0
+        LDW A, X
+        LDW B, Y
+_HASH_1:
+        BEQ B, $0, _HASH_2
+        LDB C, (A)
+        MUL M, $21              ; hash = hash * 33 ^ c
+        XOR M, C
+        INC A
+        DEC B
+        JMP _HASH_1
+_HASH_2:
+        AND M, DICT_HASHMASK
+        MUL M, CELL             ; buckets are cells
+        ADD M, dict_hash
+        RET
+
+
 ; --- >BODY  (>CFA in JonesForth)
         .dict ">BODY"
 TCFA:   .word TCFA_code
@@ -795,10 +1126,10 @@ TCFA_code:
         DPOP Z
         CALL _TCFA
         DPUSH Z
-        JMP next
+        NEXT
 
         ; Convert dict pointer in Z to codeword pointer in Z
-_TCFA:  ADD Z, $2               ; skip link pointer
+_TCFA:  ADD Z, CELL             ; skip link pointer
         LDB A, (Z)              ; load len+flags into M
         AND A, F_LENMASK        ; mask off the flags
         INC Z                   ; skip len+flags
@@ -814,32 +1145,30 @@ _TCFA:  ADD Z, $2               ; skip link pointer
         .dict "CREATE"
 CREATE: .word CREATE_code
 CREATE_code:
-        DPOP C                  ; get word length
-        DPOP B                  ; get word address
+        DPOP Y                  ; get word length
+        DPOP X                  ; get word address
+        CALL _HASH              ; find the bucket for the new word
         LDW I, (var_HERE)       ; get the address where we'll be writing things
+        LDW A, (M)              ; get the newest entry in the bucket...
+        STW A, (I)              ; ...and chain to it
+        ADD I, CELL             ; bump address
         LDW J, I                ; save current point
+        STW J, (M)              ; new entry is now the head of its bucket
         LDW A, (var_LATEST)     ; get pointer to prev word
         STW A, (I)              ; add link
-        ADD I, $2               ; bump address
-        STB C, (I)              ; save the length
+        ADD I, CELL             ; bump address
+        STB Y, (I)              ; save the length
         INC I                   ; bump address
 
         ; Copy the word itself
-_CREATE_1:
-        LDB D, (B)
-        STB D, (I)
-        INC I
-        INC B
-        DEC C
-        CMP C, $0
-        JNE _CREATE_1
+        MOVS X, I, Y
+        ADD I, Y
 
         ; update LATEST and HERE
-_CREATE_2:
         STW J, (var_LATEST)
         STW I, (var_HERE)
 
-        JMP next
+        NEXT
 
 
 ; --- COMMA (,)
@@ -848,10 +1177,10 @@ COMMA:  .word COMMA_code
 COMMA_code:
         DPOP Z                  ; data to store
         CALL _COMMA
-        JMP next
+        NEXT
 _COMMA: LDW I, (var_HERE)       ; add word in Z to dict entry
         STW Z, (I)
-        ADD I, $2
+        ADD I, CELL
         STW I, (var_HERE)
         RET
 
@@ -862,7 +1191,7 @@ LBRAC:  .word LBRAC_code
 LBRAC_code:
         LDW A, $0
         STW A, (var_STATE)      ; set STATE to zero (immediate mode)
-        JMP next
+        NEXT
 
 
 ; --- RBRAC (])
@@ -871,7 +1200,7 @@ RBRAC:  .word RBRAC_code
 RBRAC_code:
         LDW A, $1
         STW A, (var_STATE)      ; set STATE to one (compile mode)
-        JMP next
+        NEXT
 
 
 ; --- COLON (:)
@@ -914,11 +1243,11 @@ IMMEDIATE:
         .word IMMEDIATE_code
 IMMEDIATE_code:
         DPOP A                  ; get the address of the dict entry
-        ADD A, $2               ; skip link pointer
+        ADD A, CELL             ; skip link pointer
         LDB B, (A)              ; get the length/flags byte
         XOR B, F_IMMED          ; flip the bit
         STB B, (A)              ; and save it back
-        JMP next
+        NEXT
 
 
 ; --- HIDDEN
@@ -926,11 +1255,11 @@ IMMEDIATE_code:
 HIDDEN: .word HIDDEN_code
 HIDDEN_code:
         DPOP A                  ; get the address of the dict entry
-        ADD A, $2               ; skip link pointer
+        ADD A, CELL             ; skip link pointer
         LDB B, (A)              ; get the length/flags byte
         XOR B, F_HIDDEN         ; flip the bit
         STB B, (A)              ; and save it back
-        JMP next
+        NEXT
 
 
 ; --- ' (tick)
@@ -939,12 +1268,11 @@ TICK:   .word TICK_code
 TICK_code:
         CALL _WORD              ; parse the next word
         CALL _FIND              ; look up the word
-        CMP Z, $0               ; did we find a word?
-        JEQ _TICK_1             ; no, push the zero
+        BEQ Z, $0, _TICK_1      ; did we find a word?
         CALL _TCFA              ; convert dict entry to code address and push that
 _TICK_1:
         DPUSH Z
-        JMP next
+        NEXT
 
 
 
@@ -957,9 +1285,257 @@ _TICK_1:
 BRANCH: .word BRANCH_code
 BRANCH_code:
         ADD IP, (IP)
-        JMP next
+        NEXT
+
+
+; --- 0BRANCH ( x -- ) - branch by the following offset if x is zero
+        .dict "0BRANCH"
+ZBRANCH:
+        .word ZBRANCH_code
+ZBRANCH_code:
+        BRZ IP
+        NEXT
+
+
+; Helpers for the control structures below. A branch offset is relative
+; to the offset cell itself, as BRANCH adds it to IP while IP points there.
+
+        ; Compile the word in Z and an empty offset cell, and push the cell's address
+_MARK:  CALL _COMMA
+        LDW Z, (var_HERE)
+        DPUSH Z
+        LDW Z, $0
+        CALL _COMMA
+        RET
+
+        ; Compile the word in Z, then an offset back to the address in A
+_BACK:  CALL _COMMA
+        LDW Z, A
+        SUB Z, (var_HERE)
+        CALL _COMMA
+        RET
+
+        ; Point the offset cell at the address in A to HERE
+_RESOLVE:
+        LDW Z, (var_HERE)
+        SUB Z, A
+        STW Z, (A)
+        RET
+
+
+; --- IF ( C: -- orig )
+        .dict "IF", IMMED
+IF:     .word IF_code
+IF_code:
+        LDW Z, ZBRANCH
+        CALL _MARK
+        NEXT
+
+
+; --- ELSE ( C: orig1 -- orig2 )
+        .dict "ELSE", IMMED
+ELSE:   .word ELSE_code
+ELSE_code:
+        DPOP A
+        LDW Z, BRANCH
+        CALL _MARK
+        CALL _RESOLVE
+        NEXT
+
+
+; --- THEN ( C: orig -- )
+        .dict "THEN", IMMED
+THEN:   .word THEN_code
+THEN_code:
+        DPOP A
+        CALL _RESOLVE
+        NEXT
+
 
-; TODO - 0BRANCH
+; --- BEGIN ( C: -- dest )
+        .dict "BEGIN", IMMED
+BEGIN:  .word BEGIN_code
+BEGIN_code:
+        LDW A, (var_HERE)
+        DPUSH A
+        NEXT
+
+
+; --- UNTIL ( C: dest -- )
+        .dict "UNTIL", IMMED
+UNTIL:  .word UNTIL_code
+UNTIL_code:
+        DPOP A
+        LDW Z, ZBRANCH
+        CALL _BACK
+        NEXT
+
+
+; --- WHILE ( C: dest -- orig dest )
+        .dict "WHILE", IMMED
+WHILE:  .word WHILE_code
+WHILE_code:
+        DPOP A
+        LDW Z, ZBRANCH
+        CALL _MARK
+        DPUSH A
+        NEXT
+
+
+; --- REPEAT ( C: orig dest -- )
+        .dict "REPEAT", IMMED
+REPEAT: .word REPEAT_code
+REPEAT_code:
+        DPOP A
+        LDW Z, BRANCH
+        CALL _BACK
+        DPOP A
+        CALL _RESOLVE
+        NEXT
+
+
+
+; -------------------------------------------------------------------
+; Counted Loops
+;
+; A running loop keeps a frame on the return stack: the index on top,
+; then the limit, then the address just past the loop for LEAVE. DO
+; compiles (DO) and a cell for that address; LOOP compiles (LOOP) and
+; the offset back to the start of the body, then fills in the cell.
+; -------------------------------------------------------------------
+
+; --- (DO) ( limit index -- ) ( R: -- leave limit index )
+        .dict "(DO)"
+PDO:    .word PDO_code
+PDO_code:
+        LDW A, (IP)             ; address past the loop
+        ADD IP, CELL
+        DPOP C                  ; index
+        DPOP B                  ; limit
+        RPUSH A
+        RPUSH B
+        RPUSH C
+        NEXT
+
+
+; --- (?DO) ( limit index -- ) - like (DO), but skips the loop if limit = index
+        .dict "(?DO)"
+PQDO:   .word PQDO_code
+PQDO_code:
+        DPOP C                  ; index
+        DPOP B                  ; limit
+        BEQ B, C, _PQDO_1
+        LDW A, (IP)
+        ADD IP, CELL
+        RPUSH A
+        RPUSH B
+        RPUSH C
+        NEXT
+_PQDO_1:
+        LDW IP, (IP)            ; nothing to do, go straight past the loop
+        NEXT
+
+
+; --- (LOOP) - step the index by one, branching back while the loop runs
+        .dict "(LOOP)"
+PLOOP:  .word PLOOP_code
+PLOOP_code:
+        RLOOP IP, $1
+        NEXT
+
+
+; --- (+LOOP) ( n -- ) - step the index by n
+        .dict "(+LOOP)"
+PPLOOP: .word PPLOOP_code
+PPLOOP_code:
+        DPOP A
+        RLOOP IP, A
+        NEXT
+
+
+; --- I ( -- n ) ( R: leave limit index -- leave limit index )
+        .dict "I"
+LOOPI:  .word LOOPI_code
+LOOPI_code:
+        RPICK A, $0
+        DPUSH A
+        NEXT
+
+
+; --- J ( -- n ) - index of the enclosing loop
+        .dict "J"
+LOOPJ:  .word LOOPJ_code
+LOOPJ_code:
+        RPICK A, $3
+        DPUSH A
+        NEXT
+
+
+; --- UNLOOP ( R: leave limit index -- )
+        .dict "UNLOOP"
+UNLOOP: .word UNLOOP_code
+UNLOOP_code:
+        RPOP A
+        RPOP A
+        RPOP A
+        NEXT
+
+
+; --- LEAVE ( R: leave limit index -- ) - drop the frame and go past the loop
+        .dict "LEAVE"
+LEAVE:  .word LEAVE_code
+LEAVE_code:
+        RPOP A
+        RPOP A
+        RPOP IP
+        NEXT
+
+
+; --- DO ( C: -- leave-cell )
+        .dict "DO", IMMED
+DO:     .word DO_code
+DO_code:
+        LDW Z, PDO
+_DO_1:  CALL _COMMA             ; compile the runtime word...
+        LDW Z, (var_HERE)       ; ...and leave its cell for LOOP to fill in
+        DPUSH Z
+        LDW Z, $0
+        CALL _COMMA
+        NEXT
+
+
+; --- ?DO ( C: -- leave-cell )
+        .dict "?DO", IMMED
+QDO:    .word QDO_code
+QDO_code:
+        LDW Z, PQDO
+        JMP _DO_1
+
+
+; --- LOOP ( C: leave-cell -- )
+        .dict "LOOP", IMMED
+LOOP:   .word LOOP_code
+LOOP_code:
+        LDW Z, PLOOP
+_LOOP_1:
+        CALL _COMMA             ; compile the runtime word
+        DPOP A                  ; the leave cell; the body starts right after it
+        LDW Z, A
+        ADD Z, CELL
+        SUB Z, (var_HERE)       ; compile the offset back to the body
+        CALL _COMMA
+        LDW Z, (var_HERE)       ; the loop ends here, so LEAVE comes here
+        STW Z, (A)
+        NEXT
+
+
+; --- +LOOP ( C: leave-cell -- )
+        .dict "+LOOP", IMMED
+PLUSLOOP:
+        .word PLUSLOOP_code
+PLUSLOOP_code:
+        LDW Z, PPLOOP
+        JMP _LOOP_1
 
 
 
@@ -980,9 +1556,10 @@ BRANCH_code:
         .dict "QUIT"
 QUIT:   .word DOCOL             ; codeword - the interpreter
         ; .word CSTACK
+quit_loop:
         .word INTERPRET
         .word BRANCH
-        .word $-4
+        .offset quit_loop
 
 
 ; --- INTERPRET
@@ -992,16 +1569,16 @@ INTERPRET:
         .word INTERPRET_code
 INTERPRET_code:
         CALL _WORD              ; returns X=addr, Y=len
+        BEQ Y, $0, _INTERP_7    ; end of input?
 
         ; Is it in the dictionary?
         LDW A, $0
         STW A, (interpret_is_lit)
         CALL _FIND
-        CMP Z, $0               ; found?
-        JEQ _INTERP_1           ; nope
+        BEQ Z, $0, _INTERP_1    ; found?
 
         LDW M, Z                ; is it an immediate word?
-        ADD M, $2
+        ADD M, CELL
 _FRED:  LDB M, (M)
         AND M, F_IMMED
 
@@ -1009,8 +1586,7 @@ _FRED:  LDB M, (M)
 
         LDW CA, Z
 
-        CMP M, $0
-        JEQ _INTERP_2           ; not immediate
+        BEQ M, $0, _INTERP_2    ; not immediate
         JMP _INTERP_4           ; immediate, go execute it!
 
 
@@ -1019,49 +1595,596 @@ _INTERP_1:
         LDW A, $1
         STW A, (interpret_is_lit)
         CALL _NUMBER            ; Returns the parsed number in X, Y > 0 if error
-        CMP Y, $0
-        JNE _INTERP_6
+        BNE Y, $0, _INTERP_6
         LDW Z, LIT
 
         ; We have a word, are we compiling or executing?
 _INTERP_2:
         LDW A, (var_STATE)      ; check STATE
-        CMP A, $0
-        JEQ _INTERP_4           ; executing
+        BEQ A, $0, _INTERP_4    ; executing
 
         CALL _COMMA             ; append the word
         LDW A, (interpret_is_lit)
-        CMP A, $0               ; is it a literal?
-        JEQ _INTERP_3           ; nope
+        BEQ A, $0, _INTERP_3    ; is it a literal?
         LDW Z, X                ; yep - literal - store it
         CALL _COMMA
 
 _INTERP_3:
-        JMP next
+        NEXT
 
         ; Executing - run the word
 _INTERP_4:
         LDW A, (interpret_is_lit)
-        CMP A, $0
-        JNE _INTERP_5           ; literal!
+        BNE A, $0, _INTERP_5    ; literal!
 
         ; Not a literal, execute it now. This never returns, but the word
-        ; will eventually JMP next, which will reenter the loop in QUIT.
+        ; will eventually NEXT, which will reenter the loop in QUIT.
         JMP (Z)
 
         ; Executing a literal - push it on the stack
 _INTERP_5:
         DPUSH X
-        JMP next
+        NEXT
         
         ; Parse error (not a known word or valid number). Print error message and perhaps some context.
 _INTERP_6:
         ; TODO - include some context in the message
         LDW A, error_message
-        PUTS A
-        LDW A, $A               ; newline
-        PUTC A
-        JMP next
+        LDW B, $C               ; length, including the newline
+        SYS SYS_WRITE
+        NEXT
+
+        ; End of input. For the terminal there is nothing more to do...
+_INTERP_7:
+        LDW A, (var_SOURCE_ID)
+        BNE A, $0, _INTERP_8
+        HLT
+
+        ; ...but the end of an EVALUATE string returns from EVALUATE
+_INTERP_8:
+        RPOP IP
+        RPOP A
+        STW A, (var_SOURCE_ID)
+        RPOP A
+        STW A, (var_TOIN)
+        RPOP A
+        STW A, (var_SOURCE_LEN)
+        RPOP A
+        STW A, (var_SOURCE)
+        NEXT
+
+
+; --- EVALUATE ( i*x c-addr u -- j*x )
+        .dict "EVALUATE"
+EVALUATE:
+        .word EVALUATE_code
+EVALUATE_code:
+        LDW A, (var_SOURCE)     ; save the current input source...
+        RPUSH A
+        LDW A, (var_SOURCE_LEN)
+        RPUSH A
+        LDW A, (var_TOIN)
+        RPUSH A
+        LDW A, (var_SOURCE_ID)
+        RPUSH A
+        DPOP B                  ; ...and make the string the input source
+        DPOP A
+        STW A, (var_SOURCE)
+        STW B, (var_SOURCE_LEN)
+        LDW A, $0
+        STW A, (var_TOIN)
+        LDW A, $-1
+        STW A, (var_SOURCE_ID)
+        RPUSH IP                ; interpret it; INTERPRET returns here at the end
+        LDW IP, evaluate_loop
+        NEXT
+
+evaluate_loop:                  ; colon-word body w/o a header or codeword
+        .word INTERPRET
+        .word BRANCH
+        .offset evaluate_loop
+
+
+; -------------------------------------------------------------------
+; File Access
+; -------------------------------------------------------------------
+
+; --- R/O ( -- fam )
+        .dict "R/O"
+RO:     .word RO_code
+RO_code:
+        LDW A, FAM_RO
+        DPUSH A
+        NEXT
+
+
+; --- W/O ( -- fam )
+        .dict "W/O"
+WO:     .word WO_code
+WO_code:
+        LDW A, FAM_WO
+        DPUSH A
+        NEXT
+
+
+; --- R/W ( -- fam )
+        .dict "R/W"
+RW:     .word RW_code
+RW_code:
+        LDW A, FAM_RW
+        DPUSH A
+        NEXT
+
+
+; --- OPEN-FILE ( c-addr u fam -- fileid ior )
+        .dict "OPEN-FILE"
+OPENFILE:
+        .word OPENFILE_code
+OPENFILE_code:
+        DPOP C                  ; access method
+        DPOP B                  ; name length
+        DPOP A                  ; name address
+        SYS SYS_OPEN            ; C = file id, D = ior
+        DPUSH C
+        DPUSH D
+        NEXT
+
+
+; --- CREATE-FILE ( c-addr u fam -- fileid ior )
+        .dict "CREATE-FILE"
+CREATEFILE:
+        .word CREATEFILE_code
+CREATEFILE_code:
+        DPOP C                  ; access method
+        DPOP B                  ; name length
+        DPOP A                  ; name address
+        SYS SYS_CREATE          ; C = file id, D = ior
+        DPUSH C
+        DPUSH D
+        NEXT
+
+
+; --- CLOSE-FILE ( fileid -- ior )
+        .dict "CLOSE-FILE"
+CLOSEFILE:
+        .word CLOSEFILE_code
+CLOSEFILE_code:
+        DPOP C
+        SYS SYS_CLOSE
+        DPUSH D
+        NEXT
+
+
+; --- READ-FILE ( c-addr u1 fileid -- u2 ior )
+        .dict "READ-FILE"
+READFILE:
+        .word READFILE_code
+READFILE_code:
+        DPOP C                  ; file id
+        DPOP B                  ; buffer size
+        DPOP A                  ; buffer address
+        SYS SYS_FREAD           ; A = count, D = ior
+        DPUSH A
+        DPUSH D
+        NEXT
+
+
+; --- WRITE-FILE ( c-addr u fileid -- ior )
+        .dict "WRITE-FILE"
+WRITEFILE:
+        .word WRITEFILE_code
+WRITEFILE_code:
+        DPOP C                  ; file id
+        DPOP B                  ; length
+        DPOP A                  ; address
+        SYS SYS_FWRITE
+        DPUSH D
+        NEXT
+
+
+; --- FILE-SIZE ( fileid -- ud ior )
+        .dict "FILE-SIZE"
+FILESIZE:
+        .word FILESIZE_code
+FILESIZE_code:
+        DPOP C
+        SYS SYS_FSIZE           ; A:B = size, D = ior
+        DPUSH B                 ; low cell first
+        DPUSH A
+        DPUSH D
+        NEXT
+
+
+; --- FILE-POSITION ( fileid -- ud ior )
+        .dict "FILE-POSITION"
+FILEPOSITION:
+        .word FILEPOSITION_code
+FILEPOSITION_code:
+        DPOP C
+        SYS SYS_FTELL           ; A:B = position, D = ior
+        DPUSH B                 ; low cell first
+        DPUSH A
+        DPUSH D
+        NEXT
+
+
+; --- REPOSITION-FILE ( ud fileid -- ior )
+        .dict "REPOSITION-FILE"
+REPOSITIONFILE:
+        .word REPOSITIONFILE_code
+REPOSITIONFILE_code:
+        DPOP C                  ; file id
+        DPOP A                  ; high cell
+        DPOP B                  ; low cell
+        SYS SYS_FSEEK
+        DPUSH D
+        NEXT
+
+
+; --- INCLUDED ( i*x c-addr u -- j*x )
+        .dict "INCLUDED"
+INCLUDED:
+        .word DOCOL
+        .word include_load
+        .word EVALUATE
+        .word include_free
+        .word EXIT
+
+
+; --- INCLUDE ( i*x "name" -- j*x )
+        .dict "INCLUDE"
+INCLUDE:
+        .word DOCOL
+        .word WORD
+        .word INCLUDED
+        .word EXIT
+
+
+        ; ( c-addr u -- c-addr' u' ) Read the whole of the named file into the top
+        ; of free memory and leave it as a string for EVALUATE. The old limit is
+        ; saved on the return stack for include_free. A file that cannot be
+        ; read gives an empty string.
+include_load:
+        .word include_load_code
+include_load_code:
+        LDW A, (var_LIMIT)
+        RPUSH A
+        DPOP B                  ; name length
+        DPOP A                  ; name address
+        LDW C, FAM_RO
+        SYS SYS_OPEN            ; C = file id, D = ior
+        BNE D, $0, _LOAD_2
+        SYS SYS_FSIZE           ; A:B = size
+        BNE A, $0, _LOAD_1      ; far too big
+        LDW A, (var_LIMIT)
+        SUB A, (var_HERE)       ; A = free memory
+        BGT B, A, _LOAD_1
+        LDW A, (var_LIMIT)
+        SUB A, B                ; the file goes just below the limit...
+        STW A, (var_LIMIT)
+        LDW N, A
+        SYS SYS_FREAD           ; ...and is read straight into place; A = count
+        BNE D, $0, _LOAD_1
+        SYS SYS_CLOSE
+        DPUSH N
+        DPUSH A
+        NEXT
+_LOAD_1:
+        SYS SYS_CLOSE
+_LOAD_2:
+        LDW A, include_error
+        LDW B, $F               ; length, including the newline
+        SYS SYS_WRITE
+        LDW A, $0
+        DPUSH A
+        DPUSH A
+        NEXT
+
+        ; Release the memory taken by include_load
+include_free:
+        .word include_free_code
+include_free_code:
+        RPOP A
+        STW A, (var_LIMIT)
+        NEXT
+
+
+
+; -------------------------------------------------------------------
+; Blocks
+; -------------------------------------------------------------------
+
+; --- BLOCK ( u -- a-addr )
+        .dict "BLOCK"
+BLOCK:  .word BLOCK_code
+BLOCK_code:
+        LDW A, T
+        SYS SYS_BLOCK           ; A = buffer holding the block
+        LDW T, A
+        NEXT
+
+
+; --- BUFFER ( u -- a-addr )
+        .dict "BUFFER"
+BUFFER: .word BUFFER_code
+BUFFER_code:
+        LDW A, T
+        SYS SYS_BUFFER          ; A = buffer assigned to the block
+        LDW T, A
+        NEXT
+
+
+; --- UPDATE ( -- )
+        .dict "UPDATE"
+UPDATE: .word UPDATE_code
+UPDATE_code:
+        SYS SYS_UPDATE
+        NEXT
+
+
+; --- SAVE-BUFFERS ( -- )
+        .dict "SAVE-BUFFERS"
+SAVEBUFFERS:
+        .word SAVEBUFFERS_code
+SAVEBUFFERS_code:
+        SYS SYS_SAVEBUFS
+        NEXT
+
+
+; --- EMPTY-BUFFERS ( -- )
+        .dict "EMPTY-BUFFERS"
+EMPTYBUFFERS:
+        .word EMPTYBUFFERS_code
+EMPTYBUFFERS_code:
+        SYS SYS_EMPTYBUFS
+        NEXT
+
+
+; --- FLUSH ( -- )
+        .dict "FLUSH"
+FLUSH:  .word FLUSH_code
+FLUSH_code:
+        SYS SYS_SAVEBUFS
+        SYS SYS_EMPTYBUFS
+        NEXT
+
+
+
+; -------------------------------------------------------------------
+; Tasks
+;
+; Tasks share memory and the dictionary, and each has its own registers
+; and stacks. PAUSE passes control round the tasks that are ready; a task
+; waiting for input lets the others run until some arrives.
+; -------------------------------------------------------------------
+
+; --- TASK ( "<spaces>name" -- ) name: ( -- task )
+        .dict "TASK"
+TASK:   .word DOCOL
+        .word WORD
+        .word CREATE
+        .word LIT
+        .word DOCON
+        .word COMMA
+        .word task_new
+        .word COMMA             ; the word's value is the new task's id
+        .word EXIT
+
+task_new:                       ; ( -- task ) headerless
+        .word task_new_code
+task_new_code:
+        SYS SYS_TASK            ; A = new, stopped task
+        DPUSH A
+        NEXT
+
+
+; --- ACTIVATE ( task -- ) run the rest of the definition as that task
+        .dict "ACTIVATE"
+ACTIVATE:
+        .word ACTIVATE_code
+ACTIVATE_code:
+        DPOP A                  ; task to start
+        LDW B, IP               ; it carries on after ACTIVATE...
+        LDW C, task_end         ; ...stops when the definition exits...
+        LDW D, next             ; ...and starts with a NEXT
+        SYS SYS_ACTIVATE
+        RPOP IP                 ; the caller returns from the definition
+        NEXT
+
+task_end:                       ; where an activated task goes when its word exits
+        .word STOP
+
+
+; --- PAUSE ( -- )
+        .dict "PAUSE"
+PAUSE:  .word PAUSE_code
+PAUSE_code:
+        PAUSE                   ; switch to the next ready task
+        NEXT
+
+
+; --- STOP ( -- )
+        .dict "STOP"
+STOP:   .word STOP_code
+STOP_code:
+        SYS SYS_STOP            ; switch to the next task for good
+        NEXT
+
+
+; --- TIMER ( xt u -- ) execute xt every u instructions, or never if u is 0
+;     ' PAUSE 1000 TIMER makes the tasks preemptive
+        .dict "TIMER"
+TIMER:  .word TIMER_code
+TIMER_code:
+        DPOP B                  ; period
+        DPOP A                  ; handler
+        STW A, (var_TICKER)
+        LDW A, timer_entry
+        SYS SYS_TIMER
+        NEXT
+
+timer_entry:                    ; the VM has saved the registers and come here
+        LDW CA, (var_TICKER)
+        LDW IP, timer_exit      ; the handler returns to RETI
+        JMP (CA)
+
+timer_exit:
+        .word timer_reti
+timer_reti:
+        .word timer_reti_code
+timer_reti_code:
+        RETI                    ; back to the interrupted code
+
+
+
+; -------------------------------------------------------------------
+; Cores
+;
+; Cores run on host threads against the same memory. Plain @ and ! are
+; not ordered between cores; CAS and XADD are atomic and, like FENCE,
+; order every access before them against every access after.
+; -------------------------------------------------------------------
+
+; --- SPAWN ( x xt -- core ) run xt ( x -- y ) on a core of its own
+        .dict "SPAWN"
+SPAWN:  .word SPAWN_code
+SPAWN_code:
+        DPOP B                  ; xt
+        DPOP A                  ; its argument
+        LDW D, core_entry
+        SYS SYS_SPAWN           ; A = the new core
+        DPUSH A
+        NEXT
+
+core_entry:                     ; a new core starts here, with CA = xt
+        LDW IP, core_exit       ; the word returns to a halt
+        JMP (CA)
+
+core_exit:
+        .word core_halt
+core_halt:
+        .word core_halt_code
+core_halt_code:
+        LDW A, $0
+        SYS SYS_EXIT            ; done; JOIN picks up the top of the stack
+
+
+; --- JOIN ( core -- y ) wait for a core to finish
+        .dict "JOIN"
+JOIN:   .word JOIN_code
+JOIN_code:
+        LDW A, T
+        SYS SYS_JOIN            ; A = what the core left on its stack
+        LDW T, A
+        NEXT
+
+
+; --- CAS ( x1 x2 a-addr -- x3 ) store x2 at a-addr if it holds x1; x3 is the old value
+        .dict "CAS"
+CAS:    .word CAS_code
+CAS_code:
+        DPOP I                  ; address
+        DPOP C                  ; new value
+        LDW B, T                ; expected value
+        CAS I, B, C             ; B = old value
+        LDW T, B
+        NEXT
+
+
+; --- XADD ( n a-addr -- x ) add n to the cell at a-addr; x is the old value
+        .dict "XADD"
+XADD:   .word XADD_code
+XADD_code:
+        DPOP I                  ; address
+        LDW B, T
+        XADD I, B               ; B = old value
+        LDW T, B
+        NEXT
+
+
+; --- FENCE ( -- )
+        .dict "FENCE"
+FENCE:  .word FENCE_code
+FENCE_code:
+        FENCE
+        NEXT
+
+
+
+; -------------------------------------------------------------------
+; Channels
+;
+; Bounded queues of cells between tasks, cores and separate VMs. A task
+; that has to wait on a channel lets the other tasks run.
+; -------------------------------------------------------------------
+
+; --- CHANNEL ( u -- ch ) a channel holding up to u cells
+        .dict "CHANNEL"
+CHANNEL:
+        .word CHANNEL_code
+CHANNEL_code:
+        LDW A, T
+        SYS SYS_CHANNEL         ; A = the new channel
+        LDW T, A
+        NEXT
+
+
+; --- SEND ( x ch -- flag ) wait for room and send x; false if the channel is closed
+        .dict "SEND"
+SEND:   .word SEND_code
+SEND_code:
+        LDW C, $1
+        JMP _SEND
+
+
+; --- ?SEND ( x ch -- flag ) send x if there is room; false if not, or closed
+        .dict "?SEND"
+QSEND:  .word QSEND_code
+QSEND_code:
+        LDW C, $0
+_SEND:  DPOP B                  ; channel
+        LDW A, T
+        SYS SYS_SEND            ; D = sent?
+        LDW T, D
+        NEXT
+
+
+; --- RECEIVE ( ch -- x true | false ) wait for a cell; false once the channel is closed and empty
+        .dict "RECEIVE"
+RECEIVE:
+        .word RECEIVE_code
+RECEIVE_code:
+        LDW C, $1
+        JMP _RECEIVE
+
+
+; --- ?RECEIVE ( ch -- x true | false ) take a cell if there is one
+        .dict "?RECEIVE"
+QRECEIVE:
+        .word QRECEIVE_code
+QRECEIVE_code:
+        LDW C, $0
+_RECEIVE:
+        LDW B, T                ; channel
+        SYS SYS_RECEIVE         ; A = cell, D = received?
+        BEQ D, $0, _RECEIVE_1
+        LDW T, A
+        DPUSH D
+        NEXT
+_RECEIVE_1:
+        LDW T, D
+        NEXT
+
+
+; --- CLOSE-CHANNEL ( ch -- )
+        .dict "CLOSE-CHANNEL"
+CLOSECHANNEL:
+        .word CLOSECHANNEL_code
+CLOSECHANNEL_code:
+        DPOP B
+        SYS SYS_CLOSECHAN
+        NEXT
+
 
 
 ; -------------------------------------------------------------------
@@ -1089,7 +2212,7 @@ HEX:    .word HEX_code
 HEX_code:
         LDW A, $10
         STW A, (var_BASE)
-        JMP next
+        NEXT
 
 
 ; --- DECIMAL
@@ -1098,7 +2221,7 @@ DECIMAL:.word DECIMAL_code
 DECIMAL_code:
         LDW A, $A
         STW A, (var_BASE)
-        JMP next
+        NEXT
 
 
 ; -------------------------------------------------------------------
@@ -1112,7 +2235,7 @@ CSTACK: .word CSTACK_code
 CSTACK_code:
         ; DCLR                    ; clear data stack?
         RCLR                    ; clear return stack
-        JMP next
+        NEXT
 
 
 ; --- DOT-S (hack version for debugging) - TODO - replace this with a real version
@@ -1120,8 +2243,8 @@ CSTACK_code:
         .word DOTS_code
 DOTS_code:
         LDW A, (var_BASE)
-        PSTACK A
-        JMP next
+        SYS SYS_PSTACK
+        NEXT
 
 
 ; --- DOT-R (hack version for debugging) - TODO - remove this?
@@ -1129,21 +2252,28 @@ DOTS_code:
         .word DOTR_code
 DOTR_code:
         LDW A, (var_BASE)
-        PRSTACK A
-        JMP next
+        SYS SYS_PRSTACK
+        NEXT
 
 
 ; --- DOT (hack version for debugging) - TODO - replace this with a real version
         .dict "."
         .word DOT_code
 DOT_code:
-        LDW A, B
-        LDW A, (var_BASE)
-        DPOP B
-        PUTN B, A
+        DPOP A
+        LDW B, (var_BASE)
+        SYS SYS_PUTN
         LDW A, $A               ; CR
-        PUTC A
-        JMP next
+        SYS SYS_EMIT
+        NEXT
+
+
+; --- BYE - leave the simulator
+        .dict "BYE"
+BYE:    .word BYE_code
+BYE_code:
+        LDW A, $0               ; exit code
+        SYS SYS_EXIT
 
 
 ; -- BREAK (hack for debugging) - break into debugger
@@ -1151,7 +2281,7 @@ DOT_code:
 BREAK:  .word BREAK_code
 BREAK_code:
         BRK
-        JMP next
+        NEXT
 
 
 
@@ -1162,13 +2292,32 @@ BREAK_code:
         ; TODO - .data
         ; A static buffer to hold value returned by WORD.
 word_buffer:
-        .space $20
+        .space WORD_SIZE
+
+        ; Terminal input buffer, filled a line at a time by REFILL
+tib:
+        .space TIB_SIZE
+
+        ; The input source being parsed: address, length, >IN. TOKEN relies on this order.
+var_SOURCE:
+        .word tib
+var_SOURCE_LEN:
+        .word $0
+var_TOIN:
+        .word $0
+var_SOURCE_ID:
+        .word $0                ; 0 = terminal, -1 = string (EVALUATE)
 
 interpret_is_lit:
         .word $0                ; flag used to record if reading a literal
 
 error_message:
-        .asciz "PARSE ERROR"
+        .ascii "PARSE ERROR"
+        .byte $A
+
+include_error:
+        .ascii "CANNOT INCLUDE"
+        .byte $A
 
 var_STATE:
         .word $0
@@ -1176,7 +2325,13 @@ var_BASE:
         .word $A
 var_HERE:
         .word $0
+var_LIMIT:
+        .word $0                ; end of free memory; files being INCLUDED sit above it
+var_TICKER:
+        .word $0                ; execution token TIMER runs
 var_LATEST:
         .lastdict               ; most recent entry in dictionary; must be AFTER all .dict entries!
+dict_hash:
+        .hashtable              ; newest entry in each hash bucket; must be AFTER all .dict entries!
 HIMEM:
 
@@ -10,12 +10,17 @@
 #include "opcodes.h"
 #include "util.h"
 #include "forth.h"
+#include "objfile.h"
 
 
 #define OK 0
 #define ERROR 1
 #define UNHANDLED 2
 
+#define MAX_MACRO_DEPTH 16
+
+#define UNDEFINED CELL_MASK     // location of a symbol that has not been defined yet
+
 
 typedef struct ArgCount
 {
@@ -32,6 +37,13 @@ ArgCount arg_counts[] =
     { OP_JLT, 1 },
     { OP_JGE, 1 },
     { OP_JLE, 1 },
+    { OP_BEQ, 3 },
+    { OP_BNE, 3 },
+    { OP_BGT, 3 },
+    { OP_BLT, 3 },
+    { OP_BGE, 3 },
+    { OP_BLE, 3 },
+    { OP_BRZ, 1 },
     { OP_LDW, 2 },
     { OP_LDB, 2 },
     { OP_STW, 2 },
@@ -40,15 +52,17 @@ ArgCount arg_counts[] =
     { OP_RPUSH, 1 },
     { OP_DPOP, 1 },
     { OP_RPOP, 1 },
+    { OP_RPICK, 2 },
+    { OP_RLOOP, 2 },
     { OP_INC, 1 },
     { OP_DEC, 1 },
     { OP_NEG, 1 },
-    { OP_GETC, 1 },
-    { OP_PUTC, 1 },
-    { OP_PUTN, 2 },
-    { OP_PUTS, 1 },
-    { OP_PSTACK, 1 },
-    { OP_PRSTACK, 1 },
+    { OP_SYS, 1 },
+    { OP_PAUSE, 0 },
+    { OP_RETI, 0 },
+    { OP_CAS, 3 },
+    { OP_XADD, 2 },
+    { OP_FENCE, 0 },
     { OP_DCLR, 0 },
     { OP_RCLR, 0 },
     { OP_BRK, 0 },
@@ -59,9 +73,21 @@ ArgCount arg_counts[] =
     { OP_XOR, 2 },
     { OP_MUL, 2 },
     { OP_DIV, 2 },
+    { OP_UMUL, 2 },
+    { OP_MMUL, 2 },
+    { OP_UDIV, 3 },
+    { OP_SDIV, 3 },
+    { OP_DADD, 4 },
     { OP_SUB, 2 },
     { OP_CALL, 1 },
     { OP_CMP, 2 },
+    { OP_CMPS, 3 },
+    { OP_SCAS, 4 },
+    { OP_MOVS, 3 },
+    { OP_FILS, 3 },
+    { OP_TOKEN, 2 },
+    { OP_TONUM, 3 },
+    { OP_GETL, 2 },
     { OP_RET, 0 }
 };
 
@@ -78,7 +104,8 @@ typedef struct Options
 
 typedef struct SymbolRef
 {
-    unsigned short location;
+    Cell location;
+    bool relative;              // store the offset from the reference (.offset) rather than the address
     int line_number;
     struct SymbolRef *next;
 } SymbolRef;
@@ -87,7 +114,7 @@ typedef struct SymbolRef
 typedef struct Variable
 {
     char *name;
-    unsigned short value;
+    Cell value;
     struct Variable *next;
 } Variable;
 
@@ -95,21 +122,57 @@ typedef struct Variable
 typedef struct Symbol
 {
     char *name;
-    unsigned short location;
+    Cell location;
     struct Symbol *next;
     SymbolRef *refs;
 } Symbol;
 
 
+typedef struct MacroLine
+{
+    char *text;
+    struct MacroLine *next;
+} MacroLine;
+
+
+typedef struct Macro
+{
+    char *name;
+    int num_params;
+    char *params[MAXARGS];
+    MacroLine *lines;           // body, in source order
+    MacroLine *last_line;
+    struct Macro *next;
+} Macro;
+
+
+typedef struct LineMap
+{
+    Cell location;
+    int line_number;
+} LineMap;
+
+
 typedef struct Context
 {
     char *memory;
-    unsigned short origin;
+    Cell origin;
     Variable *variables;        // linked list of variables
     Symbol *symbols;            // linked list of symbols
     int num_symbols;
     int line_number;
-    unsigned short last_dict;   // address of last dict entry
+    Cell last_dict;             // address of last dict entry
+    Cell buckets[DICT_BUCKETS]; // most recent dict entry in each hash bucket
+    Macro *macros;              // linked list of macros
+    Macro *defining;            // macro whose body is being recorded, if any
+    int num_expansions;         // used to generate unique labels (\@)
+    int macro_depth;            // guard against runaway recursive macros
+    Cell *dict;                 // addresses of dict entries, oldest first
+    int num_dict;
+    int size_dict;
+    LineMap *lines;             // address of each instruction -> source line
+    int num_lines;
+    int size_lines;
 } Context;
 
 
@@ -232,20 +295,23 @@ char *skip_white(char *str)
 
 void add_byte(Context *context, unsigned char val)
 {
-    context->memory[context->origin++] = val;
+    context->memory[context->origin++ & MEMMASK] = val;
 }
 
 
-void add_space(Context *context, unsigned short num)
+void add_space(Context *context, Cell num)
 {
     context->origin += num;
 }
 
 
-void add_word(Context *context, unsigned short val)
+void add_word(Context *context, Cell val)
 {
-    add_byte(context, val >> 8);
-    add_byte(context, val & 0xFF);
+    // Big-endian, high byte first
+    for (int i = CELL_BYTES - 1; i >= 0; i--)
+    {
+        add_byte(context, (val >> (i * 8)) & 0xFF);
+    }
 }
 
 
@@ -260,16 +326,14 @@ void add_literal(Context *context, char *literal)
     }
     else
     {
-        unsigned short word = strtol(literal, NULL, 16);
+        Cell word = strtol(literal, NULL, 16);
         add_word(context, word);
     }
 }
 
 
-Variable *set_variable(Context *context, char *name, char *val)
+Variable *set_variable_value(Context *context, char *name, Cell word)
 {
-    unsigned short word = strtol(val + 1, NULL, 16);    // val + 1 to skip leading $
-
     // If the var already exists, just update the value
     Variable *var;
     for (var = context->variables; var != NULL; var = var->next)
@@ -292,6 +356,14 @@ Variable *set_variable(Context *context, char *name, char *val)
 }
 
 
+Variable *set_variable(Context *context, char *name, char *val)
+{
+    Cell word = strtol(val + 1, NULL, 16);    // val + 1 to skip leading $
+
+    return set_variable_value(context, name, word);
+}
+
+
 Variable *lookup_variable(Context *context, char *name)
 {
     Variable *var = context->variables;
@@ -326,7 +398,7 @@ Symbol *add_symbol(Context *context, char *name)
 {
     Symbol *symbol = malloc(sizeof(Symbol));
     symbol->name = my_strdup(name);
-    symbol->location = 0xFFFF;
+    symbol->location = UNDEFINED;
     symbol->next = context->symbols;
     symbol->refs = NULL;
     context->symbols = symbol;
@@ -335,7 +407,7 @@ Symbol *add_symbol(Context *context, char *name)
 }
 
 
-void add_label_ref(Context *context, char *name)
+void add_symbol_ref(Context *context, char *name, bool relative)
 {
     Symbol *symbol = lookup_symbol(context, name);
     if (symbol == NULL)
@@ -345,12 +417,18 @@ void add_label_ref(Context *context, char *name)
 
     SymbolRef *ref = malloc(sizeof(SymbolRef));
     ref->location = context->origin;
+    ref->relative = relative;
     ref->next = symbol->refs;
     ref->line_number = context->line_number;
     symbol->refs = ref;
 
-    add_byte(context, 0xFF);
-    add_byte(context, 0xFF);
+    add_word(context, UNDEFINED);
+}
+
+
+void add_label_ref(Context *context, char *name)
+{
+    add_symbol_ref(context, name, FALSE);
 }
 
 
@@ -365,6 +443,78 @@ void add_string(Context *context, char *str)
 }
 
 
+Cell dict_hash(char *name)
+{
+    // Must match _HASH in ff.asm
+    Cell hash = 0;
+    for (char *c = name; *c != 0; c++)
+    {
+        hash = (hash * DICT_HASH_MULT) ^ (unsigned char)*c;
+    }
+
+    return hash & (DICT_BUCKETS - 1);
+}
+
+
+Macro *lookup_macro(Context *context, char *name)
+{
+    Macro *macro = context->macros;
+    while (macro != NULL)
+    {
+        if (!strcmp(macro->name, name))
+        {
+            return macro;
+        }
+        macro = macro->next;
+    }
+    return NULL;
+}
+
+
+void add_macro_line(Macro *macro, char *text)
+{
+    MacroLine *line = malloc(sizeof(MacroLine));
+    line->text = my_strdup(text);
+    line->next = NULL;
+
+    if (macro->last_line == NULL)
+    {
+        macro->lines = line;
+    }
+    else
+    {
+        macro->last_line->next = line;
+    }
+    macro->last_line = line;
+}
+
+
+void add_dict_entry(Context *context, Cell addr)
+{
+    if (context->num_dict >= context->size_dict)
+    {
+        context->size_dict = context->size_dict == 0 ? 64 : context->size_dict * 2;
+        context->dict = realloc(context->dict, context->size_dict * sizeof(Cell));
+    }
+
+    context->dict[context->num_dict++] = addr;
+}
+
+
+void add_line_entry(Context *context)
+{
+    if (context->num_lines >= context->size_lines)
+    {
+        context->size_lines = context->size_lines == 0 ? 256 : context->size_lines * 2;
+        context->lines = realloc(context->lines, context->size_lines * sizeof(LineMap));
+    }
+
+    context->lines[context->num_lines].location = context->origin;
+    context->lines[context->num_lines].line_number = context->line_number;
+    context->num_lines++;
+}
+
+
 bool check_arg_count(Context *context, char *name, int seen, int needed)
 {
     if (seen < needed)
@@ -451,11 +601,31 @@ int parse_pseudo(Context *context, int argc, char *argv[])
             return ERROR;
         }
 
-        unsigned short num = strtol(&(argv[1][1]), NULL, 16);
+        Cell num;
+        Variable *var = lookup_variable(context, argv[1]);
+        if (var != NULL)
+        {
+            num = var->value;
+        }
+        else
+        {
+            num = strtol(&(argv[1][1]), NULL, 16);
+        }
         add_space(context, num);
         return OK;
     }
 
+    if (!strcmp(argv[0], ".offset"))
+    {
+        if (!check_arg_count(context, argv[0], argc, 1))
+        {
+            return ERROR;
+        }
+
+        add_symbol_ref(context, argv[1], TRUE);
+        return OK;
+    }
+
     if (!strcmp(argv[0], ".dict"))
     {
         if (!check_arg_count(context, argv[0], argc, 2))
@@ -486,8 +656,12 @@ int parse_pseudo(Context *context, int argc, char *argv[])
             }
         }
 
+        // Chain the entry into its hash bucket; the link lives just before the entry
+        Cell bucket = dict_hash(name);
+        add_word(context, context->buckets[bucket]);
+
         // Save the current addr
-        unsigned short addr = context->origin;
+        Cell addr = context->origin;
 
         // Set up the entry
         add_word(context, context->last_dict);  // pointer to prev word
@@ -496,10 +670,49 @@ int parse_pseudo(Context *context, int argc, char *argv[])
 
         // Remember where to link the next word
         context->last_dict = addr;
+        context->buckets[bucket] = addr;
+        add_dict_entry(context, addr);
+
+        return OK;
+    }
+
+    if (!strcmp(argv[0], ".macro"))
+    {
+        if (!check_arg_count(context, argv[0], argc, 2))
+        {
+            return ERROR;
+        }
+
+        if (lookup_macro(context, argv[1]) != NULL)
+        {
+            print_error(context, "Macro '%s' is already defined.\n", argv[1]);
+            return ERROR;
+        }
+
+        Macro *macro = malloc(sizeof(Macro));
+        macro->name = my_strdup(argv[1]);
+        macro->num_params = argc - 2;
+        for (int i = 2; i < argc; i++)
+        {
+            macro->params[i - 2] = my_strdup(argv[i]);
+        }
+        macro->lines = NULL;
+        macro->last_line = NULL;
+        macro->next = context->macros;
+        context->macros = macro;
+
+        // Subsequent lines are recorded (not assembled) until .endm
+        context->defining = macro;
 
         return OK;
     }
 
+    if (!strcmp(argv[0], ".endm"))
+    {
+        print_error(context, ".endm without .macro\n");
+        return ERROR;
+    }
+
     if (!strcmp(argv[0], ".lastdict"))
     {
         // Equivalent to ".word last_dict"
@@ -507,6 +720,16 @@ int parse_pseudo(Context *context, int argc, char *argv[])
         return OK;
     }
 
+    if (!strcmp(argv[0], ".hashtable"))
+    {
+        // Bucket heads for the dictionary hash table
+        for (int i = 0; i < DICT_BUCKETS; i++)
+        {
+            add_word(context, context->buckets[i]);
+        }
+        return OK;
+    }
+
     return UNHANDLED;
 }
 
@@ -697,6 +920,111 @@ void split_params(char *str, char *argv[], int *argc)
 }
 
 
+bool parse_line(char *str, Context *context);
+
+
+void substitute_macro_args(Macro *macro, char *args[], char *uniq, char *text, char *out)
+{
+    // Replace \param with the matching argument and \@ with a per-expansion
+    // counter (for unique labels); anything else is copied as-is.
+    char name[MAXCHAR];
+    char *o = out;
+    char *c = text;
+    while (*c != 0 && (o - out) < MAXCHAR - 1)
+    {
+        if (*c != '\\')
+        {
+            *o++ = *c++;
+            continue;
+        }
+
+        if (c[1] == '@')
+        {
+            o += snprintf(o, MAXCHAR - (o - out), "%s", uniq);
+            c += 2;
+            continue;
+        }
+
+        char *n = name;
+        char *d = c + 1;
+        while (isalnum(*d) || *d == '_')
+        {
+            *n++ = *d++;
+        }
+        *n = 0;
+
+        int i;
+        for (i = 0; i < macro->num_params; i++)
+        {
+            if (!strcmp(name, macro->params[i]))
+            {
+                break;
+            }
+        }
+
+        if (n != name && i < macro->num_params)
+        {
+            o += snprintf(o, MAXCHAR - (o - out), "%s", args[i]);
+            c = d;
+        }
+        else
+        {
+            *o++ = *c++;
+        }
+    }
+
+    if (o - out >= MAXCHAR)
+    {
+        o = out + MAXCHAR - 1;
+    }
+    *o = 0;
+}
+
+
+bool expand_macro(Context *context, Macro *macro, int argc, char *argv[])
+{
+    if (argc - 1 != macro->num_params)
+    {
+        print_error(context, "Incorrect number of arguments for macro %s, expected %d, saw %d.\n",
+                macro->name, macro->num_params, argc - 1);
+        return FALSE;
+    }
+
+    if (context->macro_depth >= MAX_MACRO_DEPTH)
+    {
+        print_error(context, "Macro %s nested too deeply.\n", macro->name);
+        return FALSE;
+    }
+
+    // argv points into a static buffer that the nested parse will reuse
+    char *args[MAXARGS];
+    for (int i = 1; i < argc; i++)
+    {
+        args[i - 1] = my_strdup(argv[i]);
+    }
+
+    char uniq[20];
+    sprintf(uniq, "%d", context->num_expansions++);
+
+    bool ok = TRUE;
+    char buf[MAXCHAR];
+    context->macro_depth += 1;
+    for (MacroLine *line = macro->lines; line != NULL && ok; line = line->next)
+    {
+        substitute_macro_args(macro, args, uniq, line->text, buf);
+        ok = parse_line(buf, context);
+    }
+    context->macro_depth -= 1;
+
+    for (int i = 0; i < argc - 1; i++)
+    {
+        free(args[i]);
+    }
+
+    return ok;
+}
+
+
 bool parse_opcode(Context *context, char *opcode)
 {
     char *argv[MAXARGS];
@@ -727,7 +1055,13 @@ bool parse_opcode(Context *context, char *opcode)
         return FALSE;
     }
 
-    unsigned short code = op_name_to_code(argv[0]);
+    Macro *macro = lookup_macro(context, argv[0]);
+    if (macro != NULL)
+    {
+        return expand_macro(context, macro, argc, argv);
+    }
+
+    Cell code = op_name_to_code(argv[0]);
     if (code == 0)
     {
         print_error(context, "Unknown opcode: |%s|\n", argv[0]);
@@ -765,6 +1099,30 @@ bool parse_opcode(Context *context, char *opcode)
             mode = parse_address_mode(context, argv[2]);
             break;
 
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BGT:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLE:
+            mode = parse_address_mode(context, argv[2]);
+            if (mode == ADDR_MODE2 || mode == ADDR_MODE3)
+            {
+                print_error(context, "Unsupported address mode %d for branch.\n", mode);
+                return FALSE;
+            }
+            break;
+
+        case OP_RPICK:
+        case OP_RLOOP:
+            mode = parse_address_mode(context, argv[2]);
+            if (mode == ADDR_MODE2 || mode == ADDR_MODE3)
+            {
+                print_error(context, "Unsupported address mode %d for %s.\n", mode, argv[0]);
+                return FALSE;
+            }
+            break;
+
         case OP_STW:
         case OP_STB:
             mode = parse_address_mode(context, argv[2]);
@@ -782,6 +1140,7 @@ bool parse_opcode(Context *context, char *opcode)
     }
 
     // Write the op-code and addressing mode
+    add_line_entry(context);
     add_byte(context, code | mode);
 
     // Handle the first argument
@@ -805,6 +1164,14 @@ bool parse_opcode(Context *context, char *opcode)
             add_label_ref(context, argv[1]);
             break;
 
+        case OP_SYS:
+            // The service number
+            if (!add_by_mode(context, ADDR_MODE1, argv[1]))
+            {
+                return FALSE;
+            }
+            break;
+
         case OP_LDW:
         case OP_LDB:
         case OP_STW:
@@ -813,15 +1180,12 @@ bool parse_opcode(Context *context, char *opcode)
         case OP_RPUSH:
         case OP_DPOP:
         case OP_RPOP:
+        case OP_RPICK:
+        case OP_RLOOP:
+        case OP_BRZ:
         case OP_INC:
         case OP_DEC:
         case OP_NEG:
-        case OP_GETC:
-        case OP_PUTC:
-        case OP_PUTN:
-        case OP_PUTS:
-        case OP_PSTACK:
-        case OP_PRSTACK:
         case OP_ADD:
         case OP_NOT:
         case OP_AND:
@@ -829,8 +1193,28 @@ bool parse_opcode(Context *context, char *opcode)
         case OP_XOR:
         case OP_MUL:
         case OP_DIV:
+        case OP_UMUL:
+        case OP_MMUL:
+        case OP_UDIV:
+        case OP_SDIV:
+        case OP_DADD:
         case OP_SUB:
         case OP_CMP:
+        case OP_CMPS:
+        case OP_SCAS:
+        case OP_MOVS:
+        case OP_FILS:
+        case OP_TOKEN:
+        case OP_TONUM:
+        case OP_GETL:
+        case OP_CAS:
+        case OP_XADD:
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BGT:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLE:
             if (!add_register(context, argv[1]))
             {
                 return FALSE;
@@ -852,14 +1236,35 @@ bool parse_opcode(Context *context, char *opcode)
         case OP_MUL:
         case OP_SUB:
         case OP_CMP:
+        case OP_RPICK:
+        case OP_RLOOP:
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BGT:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLE:
             if (!add_by_mode(context, mode, argv[2]))
             {
                 return FALSE;
             }
             break;
 
-        case OP_PUTN:
         case OP_DIV:
+        case OP_UMUL:
+        case OP_MMUL:
+        case OP_UDIV:
+        case OP_SDIV:
+        case OP_DADD:
+        case OP_CMPS:
+        case OP_SCAS:
+        case OP_MOVS:
+        case OP_FILS:
+        case OP_TOKEN:
+        case OP_TONUM:
+        case OP_GETL:
+        case OP_CAS:
+        case OP_XADD:
             if (!add_register(context, argv[2]))
             {
                 return FALSE;
@@ -867,6 +1272,41 @@ bool parse_opcode(Context *context, char *opcode)
             break;
     }
 
+    // Handle any further arguments (registers, or a branch target)
+    switch (code)
+    {
+        case OP_CMPS:
+        case OP_SCAS:
+        case OP_MOVS:
+        case OP_FILS:
+        case OP_TONUM:
+        case OP_UDIV:
+        case OP_SDIV:
+        case OP_DADD:
+        case OP_CAS:
+            for (int i = 3; i < argc; i++)
+            {
+                if (!add_register(context, argv[i]))
+                {
+                    return FALSE;
+                }
+            }
+            break;
+
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BGT:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLE:
+            // The branch target
+            if (!add_by_mode(context, ADDR_MODE1, argv[3]))
+            {
+                return FALSE;
+            }
+            break;
+    }
+
     return TRUE;
 }
 
@@ -879,6 +1319,21 @@ bool parse_line(char *str, Context *context)
         return TRUE;
     }
 
+    // While defining a macro, just record the body
+    if (context->defining != NULL)
+    {
+        char *first = skip_white(str);
+        if (!strncmp(first, ".endm", 5) && (first[5] == 0 || isspace(first[5])))
+        {
+            context->defining = NULL;
+        }
+        else
+        {
+            add_macro_line(context->defining, str);
+        }
+        return TRUE;
+    }
+
     char *label = NULL;
     char *opcode;
     if (!isspace(*str))
@@ -920,7 +1375,7 @@ bool update_references(Context *context)
     char scratch[20];
     for (symbol = context->symbols; symbol != NULL; symbol = symbol->next)
     {
-        if (symbol->refs != NULL && symbol->location == 0xFFFF)
+        if (symbol->refs != NULL && symbol->location == UNDEFINED)
         {
             strcpy(lines, "");
             for (ref = symbol->refs; ref != NULL; ref = ref->next)
@@ -937,12 +1392,18 @@ bool update_references(Context *context)
             continue;
         }
 
-        char hi_byte = symbol->location >> 8;
-        char lo_byte = symbol->location & 0xFF;
         for (ref = symbol->refs; ref != NULL; ref = ref->next)
         {
-            context->memory[ref->location] = hi_byte;
-            context->memory[ref->location + 1] = lo_byte;
+            Cell value = symbol->location;
+            if (ref->relative)
+            {
+                value -= ref->location;
+            }
+
+            Cell origin = context->origin;
+            context->origin = ref->location;
+            add_word(context, value);
+            context->origin = origin;
         }
     }
 
@@ -950,6 +1411,165 @@ bool update_references(Context *context)
 }
 
 
+int compare_symbols(const void *a, const void *b)
+{
+    Symbol *sa = *(Symbol **)a;
+    Symbol *sb = *(Symbol **)b;
+
+    if (sa->location != sb->location)
+    {
+        return sa->location < sb->location ? -1 : 1;
+    }
+
+    return strcmp(sa->name, sb->name);
+}
+
+
+Symbol **sorted_symbols(Context *context, int *num)
+{
+    Symbol **symbols = malloc((context->num_symbols + 1) * sizeof(Symbol *));
+    *num = 0;
+    for (Symbol *symbol = context->symbols; symbol != NULL; symbol = symbol->next)
+    {
+        symbols[(*num)++] = symbol;
+    }
+
+    qsort(symbols, *num, sizeof(Symbol *), compare_symbols);
+    return symbols;
+}
+
+
+int compare_lines(const void *a, const void *b)
+{
+    const LineMap *la = a;
+    const LineMap *lb = b;
+
+    if (la->location != lb->location)
+    {
+        return la->location < lb->location ? -1 : 1;
+    }
+
+    return la->line_number - lb->line_number;
+}
+
+
+void write_be16(FILE *file, unsigned int val)
+{
+    fputc((val >> 8) & 0xFF, file);
+    fputc(val & 0xFF, file);
+}
+
+
+void write_be32(FILE *file, unsigned int val)
+{
+    write_be16(file, val >> 16);
+    write_be16(file, val & 0xFFFF);
+}
+
+
+void write_padding(FILE *file, unsigned int size)
+{
+    for (unsigned int i = size; i < OBJ_ALIGN(size); i++)
+    {
+        fputc(0, file);
+    }
+}
+
+
+void write_section_entry(FILE *file, unsigned int type, unsigned int *offset, unsigned int size, unsigned int count)
+{
+    write_be16(file, type);
+    write_be16(file, 0);
+    write_be32(file, *offset);
+    write_be32(file, size);
+    write_be32(file, count);
+
+    *offset += OBJ_ALIGN(size);
+}
+
+
+bool write_object(Context *context, char *filename)
+{
+    FILE *outfile = fopen(filename, "wb");
+    if (outfile == NULL)
+    {
+        printf("Could not open output file: %s\n", filename);
+        return FALSE;
+    }
+
+    int num_symbols;
+    Symbol **symbols = sorted_symbols(context, &num_symbols);
+    unsigned int strings_size = 0;
+    for (int i = 0; i < num_symbols; i++)
+    {
+        strings_size += strlen(symbols[i]->name) + 1;
+    }
+
+    qsort(context->lines, context->num_lines, sizeof(LineMap), compare_lines);
+
+    unsigned int image_size = context->origin;
+    unsigned int symbols_size = num_symbols * OBJ_SYMBOL_SIZE;
+    unsigned int dict_size = context->num_dict * OBJ_DICT_SIZE;
+    unsigned int lines_size = context->num_lines * OBJ_LINE_SIZE;
+    int num_sections = 5;
+
+    // Header
+    fwrite(OBJ_MAGIC, 1, 4, outfile);
+    fputc(OBJ_VERSION, outfile);
+    fputc(OBJ_ENDIAN_BIG, outfile);
+    fputc(CELL_BYTES, outfile);         // cell size
+    fputc(num_sections, outfile);
+
+    // Section table
+    unsigned int offset = OBJ_HEADER_SIZE + num_sections * OBJ_SECTION_SIZE;
+    write_section_entry(outfile, OBJ_SECT_IMAGE, &offset, image_size, 1);
+    write_section_entry(outfile, OBJ_SECT_SYMBOLS, &offset, symbols_size, num_symbols);
+    write_section_entry(outfile, OBJ_SECT_STRINGS, &offset, strings_size, num_symbols);
+    write_section_entry(outfile, OBJ_SECT_DICT, &offset, dict_size, context->num_dict);
+    write_section_entry(outfile, OBJ_SECT_LINES, &offset, lines_size, context->num_lines);
+
+    // Image
+    fwrite(context->memory, sizeof(char), image_size, outfile);
+    write_padding(outfile, image_size);
+
+    // Symbols, then their names
+    unsigned int name_offset = 0;
+    for (int i = 0; i < num_symbols; i++)
+    {
+        write_be32(outfile, symbols[i]->location);
+        write_be32(outfile, name_offset);
+        name_offset += strlen(symbols[i]->name) + 1;
+    }
+    write_padding(outfile, symbols_size);
+
+    for (int i = 0; i < num_symbols; i++)
+    {
+        fwrite(symbols[i]->name, 1, strlen(symbols[i]->name) + 1, outfile);
+    }
+    write_padding(outfile, strings_size);
+
+    // Dictionary index, newest entry first (the same order as the linked list)
+    for (int i = context->num_dict - 1; i >= 0; i--)
+    {
+        write_be32(outfile, context->dict[i]);
+    }
+    write_padding(outfile, dict_size);
+
+    // Line map
+    for (int i = 0; i < context->num_lines; i++)
+    {
+        write_be32(outfile, context->lines[i].location);
+        write_be32(outfile, context->lines[i].line_number);
+    }
+    write_padding(outfile, lines_size);
+
+    free(symbols);
+    fclose(outfile);
+
+    return TRUE;
+}
+
+
 bool assemble(FILE *in, Options *options)
 {
     char str[MAXCHAR];
@@ -961,6 +1581,20 @@ bool assemble(FILE *in, Options *options)
     context->num_symbols = 0;
     context->line_number = 0;
     context->last_dict = 0;
+    memset(context->buckets, 0, sizeof(context->buckets));
+    context->macros = NULL;
+    context->defining = NULL;
+    context->num_expansions = 0;
+    context->macro_depth = 0;
+    context->dict = NULL;
+    context->num_dict = 0;
+    context->size_dict = 0;
+    context->lines = NULL;
+    context->num_lines = 0;
+    context->size_lines = 0;
+
+    // Let the source size things by the cell width of this build
+    set_variable_value(context, "CELL", CELL_BYTES);
 
     puts("Assembling...");
     while (fgets(str, MAXCHAR, in) != NULL)
@@ -972,25 +1606,23 @@ bool assemble(FILE *in, Options *options)
         }
     }
 
-    if (!update_references(context))
+    if (context->defining != NULL)
     {
+        print_error(context, "Missing .endm for macro %s\n", context->defining->name);
         return FALSE;
     }
 
-    // Write the binary image
-    FILE *outfile = fopen(options->outfile, "wb");
-    if (outfile == NULL)
+    if (!update_references(context))
     {
-        printf("Could not open output file: %s\n", options->outfile);
         return FALSE;
     }
 
-    fwrite(&(context->origin), sizeof(context->origin), 1, outfile);
-    fwrite(context->memory, sizeof(char), context->origin, outfile);
-
-    fclose(outfile);
+    if (!write_object(context, options->outfile))
+    {
+        return FALSE;
+    }
 
-    // Write the symbols (if we have any)
+    // Write the symbols (if we have any) in human-readable form
     if (context->symbols != NULL)
     {
         FILE *symfile = fopen(options->symfile, "w");
@@ -999,12 +1631,14 @@ bool assemble(FILE *in, Options *options)
             printf("Could not open symbol file: %s\n", options->symfile);
             return FALSE;
         }
-        fprintf(symfile, "%d\n", context->num_symbols);
-        Symbol *symbol;
-        for (symbol = context->symbols; symbol != NULL; symbol = symbol->next)
+        int num;
+        Symbol **symbols = sorted_symbols(context, &num);
+        fprintf(symfile, "%d\n", num);
+        for (int i = 0; i < num; i++)
         {
-            fprintf(symfile, "%04X %s\n", symbol->location, symbol->name);
+            fprintf(symfile, CELL_FMT " %s\n", symbols[i]->location, symbols[i]->name);
         }
+        free(symbols);
         fclose(symfile);
     }
 
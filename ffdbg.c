@@ -19,6 +19,7 @@
 #define SEPS " \t\n"
 #define HIST_FILE ".ffhist"
 #define DUMP_SIZE (5 * 16)
+#define DEFAULT_BUFFERS 8
 
 
 
@@ -26,6 +27,9 @@ typedef struct Options
 {
     char *infile;
     char *symfile;
+    char *root;         // directory the file words are confined to, if any
+    char *blocks;       // block file, if any
+    int buffers;        // number of block buffers
 } Options;
 
 
@@ -59,26 +63,58 @@ struct Context
 
 Options *parse_args(int argc, char *argv[])
 {
-    if (argc != 2)
+    char *infile = NULL;
+    char *root = NULL;
+    char *blocks = NULL;
+    int buffers = DEFAULT_BUFFERS;
+    for (int i = 1; i < argc; i++)
     {
-        printf("Incorrect number of arguments!\n");
-        printf("Usage: %s <infile>\n", argv[0]);
+        if (!strcmp(argv[i], "--root") && i + 1 < argc)
+        {
+            root = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--blocks") && i + 1 < argc)
+        {
+            blocks = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--buffers") && i + 1 < argc)
+        {
+            buffers = atoi(argv[++i]);
+        }
+        else if (infile == NULL && argv[i][0] != '-')
+        {
+            infile = argv[i];
+        }
+        else
+        {
+            infile = NULL;
+            break;
+        }
+    }
+
+    if (infile == NULL)
+    {
+        printf("Incorrect arguments!\n");
+        printf("Usage: %s [--root <dir>] [--blocks <file> [--buffers <n>]] <infile>\n", argv[0]);
         return NULL;
     }
 
     Options *options = malloc(sizeof(Options));
+    options->root = root;
+    options->blocks = blocks;
+    options->buffers = buffers;
 
     char scratch[MAXCHAR];
-    char *dot = strrchr(argv[1], '.');
+    char *dot = strrchr(infile, '.');
     if (dot == NULL)
     {
-        strcpy(scratch, argv[1]);
+        strcpy(scratch, infile);
         strcat(scratch, ".fo");
         options->infile = my_strdup(scratch);
     }
     else
     {
-        options->infile = argv[1];
+        options->infile = infile;
     }
 
     strcpy(scratch, options->infile);
@@ -119,7 +155,7 @@ StringPool *sp_init()
 }
 
 
-unsigned short sp_find_or_add(StringPool *pool, char *str)
+Cell sp_find_or_add(StringPool *pool, char *str)
 {
     // NOTE: using 1-based indexing so that 0 indicates not-found
     for (int i = 0; i < pool->num_strings; i++)
@@ -144,7 +180,7 @@ unsigned short sp_find_or_add(StringPool *pool, char *str)
 }
 
 
-char *sp_get_string(StringPool *pool, unsigned short idx)
+char *sp_get_string(StringPool *pool, Cell idx)
 {
     if (idx < 1 || idx > pool->num_strings)
     {
@@ -155,7 +191,7 @@ char *sp_get_string(StringPool *pool, unsigned short idx)
 }
 
 
-bool convert_to_number(char *word, unsigned short *value)
+bool convert_to_number(char *word, Cell *value)
 {
     char *c;
     for (c = word; *c != 0; c++)
@@ -171,7 +207,7 @@ bool convert_to_number(char *word, unsigned short *value)
 }
 
 
-void do_push(Context *context, unsigned short value)
+void do_push(Context *context, Cell value)
 {
     StackNode *node = malloc(sizeof(StackNode));
     node->value = value;
@@ -180,7 +216,7 @@ void do_push(Context *context, unsigned short value)
 }
 
 
-unsigned short do_pop(Context *context)
+Cell do_pop(Context *context)
 {
     if (context->stack == NULL)
     {
@@ -190,7 +226,7 @@ unsigned short do_pop(Context *context)
 
     StackNode *node = context->stack;
     context->stack = node->next;
-    unsigned short value = node->value;
+    Cell value = node->value;
     free(node);
     return value;
 }
@@ -206,7 +242,7 @@ void do_push_string(Context *context, char *str)
         *pos = 0;
     }
 
-    unsigned short sid = sp_find_or_add(context->string_pool, buf);
+    Cell sid = sp_find_or_add(context->string_pool, buf);
 
     do_push(context, sid);
 }
@@ -215,7 +251,7 @@ void do_push_string(Context *context, char *str)
 bool execute_command(Context *context)
 {
     char buf[MAXCHAR];
-    sprintf(buf, "0x%04X: ", context->sim->pc);
+    sprintf(buf, "0x" CELL_FMT ": ", context->sim->pc);
     char *args[MAXARGS];
 
 #ifdef USE_READLINE
@@ -271,7 +307,7 @@ bool execute_command(Context *context)
             continue;
         }
 
-        unsigned short value;
+        Cell value;
         if (convert_to_number(word, &value))
         {
             do_push(context, value);
@@ -354,6 +390,12 @@ void dc_push_z(Context *context)
 }
 
 
+void dc_push_t(Context *context)
+{
+    do_push(context, context->sim->t);
+}
+
+
 void dc_dot(Context *context)
 {
     if (context->stack == NULL)
@@ -361,16 +403,16 @@ void dc_dot(Context *context)
         printf("<empty stack>\n");
         return;
     }
-    unsigned short value = do_pop(context);
+    Cell value = do_pop(context);
     char *symbol = sim_reverse_lookup_symbol(context->sim, value);
 
     if (symbol == NULL)
     {
-        printf("0x%04X\n", value);
+        printf("0x" CELL_FMT "\n", value);
     }
     else
     {
-        printf("0x%04X (%s)\n", value, symbol);
+        printf("0x" CELL_FMT " (%s)\n", value, symbol);
     }
 }
 
@@ -401,8 +443,8 @@ void dc_list(Context *context)
         return;
     }
 
-    unsigned short num = do_pop(context);
-    unsigned short addr = do_pop(context);
+    Cell num = do_pop(context);
+    Cell addr = do_pop(context);
 
     sim_disassemble(context->sim, addr, num);
 }
@@ -431,7 +473,7 @@ void format_stack(char *buf, StackNode *top)
             strcat(buf, ", ");
         }
 
-        strcat(buf, format_word(top->value));
+        append_word(buf, top->value);
 
         num += 1;
         top = top->next;
@@ -445,6 +487,7 @@ void dc_print(Context *context)
     char ds[MAXCHAR];
     char rs[MAXCHAR];
     char cs[MAXCHAR];
+    StackNode top;
 
     puts("");
     if (sim->halted)
@@ -452,19 +495,20 @@ void dc_print(Context *context)
         printf("    *** HALTED ***\n\n");
     }
 
-    format_stack(ds, sim->data_stack);
+    Cell flags = sim_flags(sim);
+    format_stack(ds, sim_data_stack(sim, &top));
     format_stack(rs, sim->return_stack);
     format_stack(cs, sim->call_stack);
 
-    printf("    PC: 0x%04X    I: 0x%04X    A: 0x%04X     Data: %s\n", sim->pc, sim->i, sim->a, ds);
-    printf("    IP: 0x%04X    J: 0x%04X    B: 0x%04X   Return: %s\n", sim->ip, sim->j, sim->b, rs);
-    printf("    CA: 0x%04X    M: 0x%04X    C: 0x%04X     Call: %s\n", sim->ca, sim->m, sim->c, cs);
-    printf("     X: 0x%04X    N: 0x%04X    D: 0x%04X\n", sim->x, sim->n, sim->d);
-    printf("     Y: 0x%04X\n", sim->y);
-    printf("     Z: 0x%04X    Flags, lt: %d   eq: %d   gt: %d\n", sim->z,
-            (sim->flags & FLAG_LT) == FLAG_LT,
-            (sim->flags & FLAG_EQUAL) == FLAG_EQUAL,
-            (sim->flags & FLAG_GT) == FLAG_GT);
+    printf("    PC: 0x" CELL_FMT "    I: 0x" CELL_FMT "    A: 0x" CELL_FMT "     Data: %s\n", sim->pc, sim->i, sim->a, ds);
+    printf("    IP: 0x" CELL_FMT "    J: 0x" CELL_FMT "    B: 0x" CELL_FMT "   Return: %s\n", sim->ip, sim->j, sim->b, rs);
+    printf("    CA: 0x" CELL_FMT "    M: 0x" CELL_FMT "    C: 0x" CELL_FMT "     Call: %s\n", sim->ca, sim->m, sim->c, cs);
+    printf("     X: 0x" CELL_FMT "    N: 0x" CELL_FMT "    D: 0x" CELL_FMT "\n", sim->x, sim->n, sim->d);
+    printf("     Y: 0x" CELL_FMT "    T: 0x" CELL_FMT "\n", sim->y, sim->t);
+    printf("     Z: 0x" CELL_FMT "    Flags, lt: %d   eq: %d   gt: %d\n", sim->z,
+            (flags & FLAG_LT) == FLAG_LT,
+            (flags & FLAG_EQUAL) == FLAG_EQUAL,
+            (flags & FLAG_GT) == FLAG_GT);
 
     puts("");
 
@@ -482,7 +526,47 @@ void dc_syms(Context *context)
     Simulator *sim = context->sim;
     for (int i = 0; i < sim->num_symbols; i++)
     {
-        printf("   0x%04X  %s\n", sim->symbols[i]->location, sim->symbols[i]->name);
+        printf("   0x" CELL_FMT "  %s\n", sim->symbols[i].location, sim->symbols[i].name);
+    }
+}
+
+
+void dc_where(Context *context)
+{
+    Simulator *sim = context->sim;
+    SimLine line;
+    if (sim_lookup_line(sim, sim->pc, &line))
+    {
+        printf("   0x" CELL_FMT "  line %d\n", sim->pc, line.line_number);
+    }
+    else
+    {
+        printf("No line information for 0x" CELL_FMT ".\n", sim->pc);
+    }
+}
+
+
+char *read_dict_string(Simulator *sim, Cell addr)
+{
+    unsigned char len = sim_read_byte(sim, addr) & F_LENMASK;
+
+    static char buf[MAXCHAR];
+    memset(buf, 0, MAXCHAR);
+    for (int i = 0; i < len; i++)
+    {
+        buf[i] = sim_read_byte(sim, addr + 1 + i);
+    }
+    return buf;
+}
+
+
+void dc_words(Context *context)
+{
+    Simulator *sim = context->sim;
+    for (int i = 0; i < sim->num_dict; i++)
+    {
+        Cell addr = sim_dict_entry(sim, i);
+        printf("   0x" CELL_FMT "  %s\n", addr, read_dict_string(sim, addr + CELL_BYTES));
     }
 }
 
@@ -496,8 +580,8 @@ void dc_dump(Context *context)
     }
 
     char ascii[MAXCHAR];
-    unsigned short addr = do_pop(context);
-    unsigned short i;
+    Cell addr = do_pop(context);
+    Cell i;
     unsigned char value;
     for (i = 0; i < DUMP_SIZE; i++)
     {
@@ -507,7 +591,7 @@ void dc_dump(Context *context)
             {
                 printf("  |%s|\n", ascii);
             }
-            printf("  0x%04X:", addr + i);
+            printf("  0x" CELL_FMT ":", addr + i);
             memset(ascii, 0, MAXCHAR);
         }
         else if ((i % 8) == 0)
@@ -515,7 +599,7 @@ void dc_dump(Context *context)
             printf(" ");
         }
 
-        value = context->sim->memory[addr + i];
+        value = sim_read_byte(context->sim, addr + i);
         printf(" %02X", value);
         if ((value < ' ') || (value > '~'))
         {
@@ -533,7 +617,7 @@ void dc_dump(Context *context)
 
 void dc_emit(Context *context)
 {
-    unsigned short sid = do_pop(context);
+    Cell sid = do_pop(context);
     if (sid == 0)
     {
         return;
@@ -545,7 +629,7 @@ void dc_emit(Context *context)
 
 void dc_lookup(Context *context)
 {
-    unsigned short sid = do_pop(context);
+    Cell sid = do_pop(context);
     if (sid == 0)
     {
         return;
@@ -555,7 +639,7 @@ void dc_lookup(Context *context)
     {
         return;
     }
-    unsigned short addr;
+    Cell addr;
     if (sim_lookup_symbol(context->sim, name, &addr))
     {
         do_push(context, addr);
@@ -570,7 +654,7 @@ void dc_lookup(Context *context)
 void dc_find(Context *context)
 {
     char buf[MAXCHAR];
-    unsigned short sid = do_pop(context);
+    Cell sid = do_pop(context);
     if (sid == 0)
     {
         return;
@@ -582,7 +666,7 @@ void dc_find(Context *context)
     }
     int name_len = strlen(name);
 
-    unsigned short addr;
+    Cell addr;
     if (!sim_lookup_symbol(context->sim, "var_LATEST", &addr))
     {
         printf("Could not find var_LATEST symbol!\n");
@@ -595,13 +679,13 @@ void dc_find(Context *context)
     // Keep searching until we find something...
     while (addr != 0)
     {
-        unsigned char dict_len = context->sim->memory[addr + 2] & F_LENMASK;
+        unsigned char dict_len = sim_read_byte(context->sim, addr + CELL_BYTES) & F_LENMASK;
         if (dict_len == name_len)
         {
             memset(buf, 0, MAXCHAR);
             for (int i = 0; i < dict_len; i++)
             {
-                buf[i] = context->sim->memory[addr + 3 + i];
+                buf[i] = sim_read_byte(context->sim, addr + CELL_BYTES + 1 + i);
             }
             
             if (!strcmp(buf, name))
@@ -622,7 +706,7 @@ void dc_find(Context *context)
 
 void dc_toggle_breakpoint(Context *context)
 {
-    unsigned short addr = do_pop(context);
+    Cell addr = do_pop(context);
     sim_toggle_breakpoint(context->sim, addr);
 }
 
@@ -637,7 +721,7 @@ void dc_list_breakpoints(Context *context)
     char entry[MAXCHAR];
     for (Breakpoint *bp = sim->breakpoints; bp != NULL; bp = bp->next)
     {
-        sprintf(entry, "   0x%04X", bp->addr);
+        sprintf(entry, "   0x" CELL_FMT, bp->addr);
         char *sym = sim_reverse_lookup_symbol(sim, bp->addr);
         if (sym != NULL)
         {
@@ -658,20 +742,6 @@ void dc_reset(Context *context)
 }
 
 
-char *read_dict_string(Simulator *sim, unsigned short addr)
-{
-    unsigned char len = sim_read_byte(sim, addr) & F_LENMASK;
-
-    static char buf[MAXCHAR];
-    memset(buf, 0, MAXCHAR);
-    for (int i = 0; i < len; i++)
-    {
-        buf[i] = sim->memory[addr + 1 + i];
-    }
-    return buf;
-}
-
-
 void dc_dict(Context *context)
 {
     if (context->stack == NULL)
@@ -680,19 +750,19 @@ void dc_dict(Context *context)
         return;
     }
 
-    unsigned short addr = do_pop(context);
+    Cell addr = do_pop(context);
 
     Simulator *sim = context->sim;
 
-    unsigned short prev = sim_read_word(sim, addr);
-    unsigned char len = sim_read_byte(sim, addr + 2);
-    unsigned short codeAddr = sim_read_word(sim, addr + 3 + (len & F_LENMASK));
+    Cell prev = sim_read_word(sim, addr);
+    unsigned char len = sim_read_byte(sim, addr + CELL_BYTES);
+    Cell codeAddr = sim_read_word(sim, addr + CELL_BYTES + 1 + (len & F_LENMASK));
 
     char name[MAXCHAR];
-    strcpy(name, read_dict_string(sim, addr + 2));
+    strcpy(name, read_dict_string(sim, addr + CELL_BYTES));
 
     char code[MAXCHAR];
-    sprintf(code, "0x%04X", codeAddr);
+    sprintf(code, "0x" CELL_FMT, codeAddr);
     char *sym = sim_reverse_lookup_symbol(sim, codeAddr);
     if (sym != NULL)
     {
@@ -714,23 +784,23 @@ void dc_dict(Context *context)
     len &= F_LENMASK;
 
     printf("         +--------+-------+-----------------+----------------------+\n");
-    printf(" 0x%04X: | 0x%04X | %2d %2s | %-15.15s | %-20.20s |\n", addr, prev, len, flags, name, code);
+    printf(" 0x" CELL_FMT ": | 0x" CELL_FMT " | %2d %2s | %-15.15s | %-20.20s |\n", addr, prev, len, flags, name, code);
     printf("         +--------+-------+-----------------+----------------------+\n");
 
-    unsigned short docolAddr;
-    unsigned short exitAddr;
-    unsigned short branchAddr;      // TODO - copout - for now, stop on BRANCH
+    Cell docolAddr;
+    Cell exitAddr;
+    Cell branchAddr;      // TODO - copout - for now, stop on BRANCH
     sim_lookup_symbol(context->sim, "DOCOL", &docolAddr);
     sim_lookup_symbol(context->sim, "EXIT", &exitAddr);
     sim_lookup_symbol(context->sim, "BRANCH", &branchAddr);
     if (codeAddr == docolAddr)
     {
-        addr += 3 + len + 2;
-        for (int i = 0; i < 10; i++, addr += 2)
+        addr += CELL_BYTES + 1 + len + CELL_BYTES;
+        for (int i = 0; i < 10; i++, addr += CELL_BYTES)
         {
             codeAddr = sim_read_word(sim, addr);
 
-            sprintf(code, "0x%04X", codeAddr);
+            sprintf(code, "0x" CELL_FMT, codeAddr);
             sym = sim_reverse_lookup_symbol(sim, codeAddr);
             if (sym != NULL)
             {
@@ -738,7 +808,7 @@ void dc_dict(Context *context)
                 strcat(code, sym);
             }
 
-            printf("                                    0x%04X: | %-20.20s |\n", addr, code);
+            printf("                                    0x" CELL_FMT ": | %-20.20s |\n", addr, code);
 
             if (codeAddr == exitAddr || codeAddr == branchAddr)
             {
@@ -751,6 +821,55 @@ void dc_dict(Context *context)
 }
 
 
+void dc_blocks(Context *context)
+{
+    SimBlocks *blocks = context->sim->blocks;
+    if (blocks == NULL)
+    {
+        printf("No block file.\n");
+        return;
+    }
+
+    printf("Block file: %lu blocks, %d buffers at 0x" CELL_FMT "\n", (unsigned long)blocks->num_blocks,
+           blocks->num_buffers, blocks->pool);
+    printf("Hits: %lu   Misses: %lu   Write-backs: %lu\n", blocks->hits, blocks->misses, blocks->writebacks);
+
+    for (int i = 0; i < blocks->num_buffers; i++)
+    {
+        SimBlockBuffer *buffer = &blocks->buffers[i];
+        if (buffer->block == NO_BLOCK)
+        {
+            continue;
+        }
+
+        printf("   0x" CELL_FMT "  block %-6ld %s%s\n", buffer->addr, buffer->block,
+               buffer->dirty ? " dirty" : "", (buffer == blocks->current) ? " current" : "");
+    }
+}
+
+
+void dc_tasks(Context *context)
+{
+    static const char *states[] = { "free", "ready", "blocked", "stopped" };
+    Simulator *sim = context->sim;
+
+    for (int i = 0; i < SIM_MAX_TASKS; i++)
+    {
+        SimTask *task = &sim->tasks[i];
+        if (task->state == TASK_FREE)
+        {
+            continue;
+        }
+
+        // The running task's registers are live in the simulator
+        bool running = (task == sim->task);
+        printf("%c %2d  %-8s PC: 0x" CELL_FMT "  IP: 0x" CELL_FMT "  Depth: %d\n", running ? '*' : ' ', i + 1,
+               states[task->state], running ? sim->pc : task->pc, running ? sim->ip : task->ip,
+               running ? sim->data_depth : task->data_depth);
+    }
+}
+
+
 void add_command(Context *context, char *name, void (*func)(Context *context))
 {
     DebugCommand *command = malloc(sizeof(DebugCommand));
@@ -780,6 +899,7 @@ Context *create_context(Simulator *sim)
     add_command(context, "x", dc_push_x);
     add_command(context, "y", dc_push_y);
     add_command(context, "z", dc_push_z);
+    add_command(context, "t", dc_push_t);
     add_command(context, ".", dc_dot);
     add_command(context, "quit", dc_quit);
     add_command(context, "q", dc_quit);
@@ -793,6 +913,8 @@ Context *create_context(Simulator *sim)
     add_command(context, "p", dc_print);
     add_command(context, "print", dc_print);
     add_command(context, "syms", dc_syms);
+    add_command(context, "where", dc_where);
+    add_command(context, "words", dc_words);
     add_command(context, "dump", dc_dump);
     add_command(context, "hd", dc_dump);
     add_command(context, "dd", dc_dump);
@@ -804,6 +926,8 @@ Context *create_context(Simulator *sim)
     add_command(context, "breakpoints", dc_list_breakpoints);
     add_command(context, "reset", dc_reset);
     add_command(context, "dict", dc_dict);
+    add_command(context, "blocks", dc_blocks);
+    add_command(context, "tasks", dc_tasks);
 
     // TODO - help
 
@@ -828,8 +952,26 @@ int main(int argc, char *argv[])
 #endif
 
     Simulator *sim = sim_init(options->infile);
+    if (sim == NULL)
+    {
+        return 1;
+    }
     sim->debugging = TRUE;
-    sim_load_symbols(sim, options->symfile);
+    if (!sim_set_file_root(sim, options->root))
+    {
+        printf("Could not open file root: %s\n", options->root);
+        return 1;
+    }
+    if (options->blocks != NULL && !sim_open_blocks(sim, options->blocks, options->buffers))
+    {
+        return 1;
+    }
+
+    // Older object files do not carry their symbols
+    if (sim->num_symbols == 0)
+    {
+        sim_load_symbols(sim, options->symfile);
+    }
 
     Context *context = create_context(sim);
 
@@ -841,6 +983,8 @@ int main(int argc, char *argv[])
     write_history(HIST_FILE);
 #endif
 
+    sim_close_blocks(sim);
+
     return 0;
 }
 
@@ -0,0 +1,716 @@
+#define _GNU_SOURCE     // for accept4
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "simulator.h"
+#include "ffserve.h"
+
+#define MAX_EVENTS      256
+#define READ_SIZE       4096
+#define MAX_PENDING     65536   // stop reading from a client with this much unconsumed input
+#define LATENCY_BUCKETS 32      // powers of two of microseconds
+
+
+// One thread runs an epoll loop that owns the sockets and every session's
+// buffers; worker threads only run VMs. A session with input is put on the
+// run queue, a worker runs its VM for one slice (an instruction budget), and
+// hands it back on the done list, waking the loop with an eventfd. The loop
+// then sends the output, and queues the session again if it was preempted
+// or more input has come in. So each VM is only ever touched by one thread
+// at a time, and nothing but the two queues needs a lock.
+
+typedef struct Session
+{
+    int fd;                 // -1 once the client has gone
+    Simulator *sim;
+    bool busy;              // on the run queue or running on a worker
+    bool eof;               // the client has sent all its input
+    bool hung_up;           // the socket is out of the epoll set, as it would only report EPOLLHUP
+    bool closing;           // close once the output is sent
+
+    SimBuffer in;           // input the VM is reading (from sim->input_pos on), then a partial line
+    SimBuffer pending;      // input that came while it was busy
+    SimBuffer vm_out;       // output of the current slice
+    SimBuffer out;          // output still to send
+    size_t out_pos;
+
+    bool timing;            // input is waiting to be dealt with, since queued_at
+    struct timespec queued_at;
+
+    struct Session *next;   // on the run queue, done list or dead list
+} Session;
+
+
+typedef struct Server
+{
+    Simulator *image;       // the booted VM every session is cloned from
+    unsigned long slice;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;            // eventfd the workers use to hand sessions back
+    int signal_fd;
+
+    int num_workers;
+    pthread_t *workers;
+    pthread_mutex_t lock;   // for the run queue, the done list and stopping
+    pthread_cond_t work;
+    Session *run_head;
+    Session *run_tail;
+    Session *done;
+    bool stopping;
+
+    Session *dead;          // freed at the end of each pass of the loop
+
+    // Metrics; only the loop touches these
+    unsigned long opened;
+    unsigned long closed;
+    unsigned long requests;
+    unsigned long slices;
+    unsigned long preempted;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    double total_latency;   // microseconds
+    unsigned long max_latency;
+    unsigned long latency[LATENCY_BUCKETS];
+} Server;
+
+
+void buffer_append(SimBuffer *buf, const char *data, size_t len)
+{
+    if (buf->len + len + 1 > buf->size)
+    {
+        buf->size = (buf->size == 0) ? 256 : buf->size;
+        while (buf->len + len + 1 > buf->size)
+        {
+            buf->size *= 2;
+        }
+        buf->data = realloc(buf->data, buf->size);
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = 0;
+}
+
+
+unsigned long microseconds_since(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+
+void record_latency(Server *server, unsigned long us)
+{
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (1UL << (bucket + 1)) <= us)
+    {
+        bucket++;
+    }
+
+    server->latency[bucket]++;
+    server->requests++;
+    server->total_latency += us;
+    if (us > server->max_latency)
+    {
+        server->max_latency = us;
+    }
+}
+
+
+unsigned long latency_percentile(Server *server, int percent)
+{
+    // Upper bound of the bucket the percentile falls in
+    unsigned long target = (server->requests * percent + 99) / 100;
+    unsigned long count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        count += server->latency[i];
+        if (count >= target)
+        {
+            return 1UL << (i + 1);
+        }
+    }
+    return server->max_latency;
+}
+
+
+void print_metrics(Server *server)
+{
+    printf("Sessions: %lu open, %lu served\n", server->opened - server->closed, server->opened);
+    printf("Requests: %lu   Latency: avg %.0f us, p50 < %lu us, p99 < %lu us, max %lu us\n", server->requests,
+           server->requests ? server->total_latency / server->requests : 0.0,
+           latency_percentile(server, 50), latency_percentile(server, 99), server->max_latency);
+    printf("Slices: %lu (%lu preempted)   Bytes: %lu in, %lu out\n", server->slices, server->preempted,
+           server->bytes_in, server->bytes_out);
+    fflush(stdout);
+}
+
+
+void *worker_thread(void *arg)
+{
+    Server *server = arg;
+
+    while (TRUE)
+    {
+        pthread_mutex_lock(&server->lock);
+        while (server->run_head == NULL && !server->stopping)
+        {
+            pthread_cond_wait(&server->work, &server->lock);
+        }
+        if (server->stopping)
+        {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
+        }
+
+        Session *session = server->run_head;
+        server->run_head = session->next;
+        pthread_mutex_unlock(&server->lock);
+
+        // Run one slice; a session waiting on a channel just waits for input
+        Simulator *sim = session->sim;
+        sim->budget = server->slice;
+        sim->waiting = FALSE;
+        sim->wait_channel = NULL;
+        sim_run(sim);
+
+        pthread_mutex_lock(&server->lock);
+        session->next = server->done;
+        server->done = session;
+        pthread_mutex_unlock(&server->lock);
+
+        uint64_t one = 1;
+        if (write(server->wake_fd, &one, sizeof(one)) < 0)
+        {
+            // Only fails if the counter is saturated, and then the loop is awake anyway
+        }
+    }
+}
+
+
+void queue_session(Server *server, Session *session)
+{
+    session->busy = TRUE;
+    session->next = NULL;
+
+    pthread_mutex_lock(&server->lock);
+    if (server->run_head == NULL)
+    {
+        server->run_head = session;
+    }
+    else
+    {
+        server->run_tail->next = session;
+    }
+    server->run_tail = session;
+    pthread_cond_signal(&server->work);
+    pthread_mutex_unlock(&server->lock);
+}
+
+
+void update_events(Server *server, Session *session)
+{
+    if (session->hung_up)
+    {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = 0;
+    event.data.ptr = session;
+    if (!session->closing && !session->eof && session->pending.len < MAX_PENDING)
+    {
+        event.events |= EPOLLIN;
+    }
+    if (session->out_pos < session->out.len)
+    {
+        event.events |= EPOLLOUT;
+    }
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+}
+
+
+void close_session(Server *server, Session *session)
+{
+    // Drop the client; the session itself goes once no worker has it
+    if (session->fd < 0)
+    {
+        return;
+    }
+
+    close(session->fd);
+    session->fd = -1;
+    server->closed++;
+
+    if (!session->busy)
+    {
+        session->next = server->dead;
+        server->dead = session;
+    }
+}
+
+
+void free_session(Session *session)
+{
+    sim_free(session->sim);
+    free(session->in.data);
+    free(session->pending.data);
+    free(session->vm_out.data);
+    free(session->out.data);
+    free(session);
+}
+
+
+void flush_session(Server *server, Session *session)
+{
+    while (session->out_pos < session->out.len)
+    {
+        ssize_t n = send(session->fd, session->out.data + session->out_pos, session->out.len - session->out_pos,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (n < 0)
+        {
+            close_session(server, session);
+            return;
+        }
+
+        session->out_pos += n;
+        server->bytes_out += n;
+    }
+
+    if (session->out_pos == session->out.len)
+    {
+        session->out.len = 0;
+        session->out_pos = 0;
+        if (session->closing)
+        {
+            close_session(server, session);
+            return;
+        }
+    }
+
+    update_events(server, session);
+}
+
+
+size_t complete_lines(Session *session)
+{
+    // How much of the input to let the VM see. A read can end part way
+    // through a line, and the VM takes the end of its input as the end of a
+    // line, so a trailing partial line is held back until the rest of it
+    // (or the end of the input) arrives, unless it is already too long.
+    SimBuffer *in = &session->in;
+    if (session->eof || in->len >= MAX_PENDING)
+    {
+        return in->len;
+    }
+
+    size_t len = in->len;
+    while (len > 0 && in->data[len - 1] != '\n')
+    {
+        len--;
+    }
+    return len;
+}
+
+
+bool has_new_input(Session *session)
+{
+    // Is there input the VM has not been given yet?
+    return session->pending.len > 0 || (session->eof && session->sim->input_len < session->in.len);
+}
+
+
+void feed_session(Server *server, Session *session)
+{
+    // Give the VM the input that has come in, after what it has not read yet,
+    // and queue it to run
+    Simulator *sim = session->sim;
+    SimBuffer *in = &session->in;
+
+    size_t unread = in->len - sim->input_pos;
+    memmove(in->data, in->data + sim->input_pos, unread);
+    in->len = unread;
+    buffer_append(in, session->pending.data, session->pending.len);
+    session->pending.len = 0;
+
+    sim->input = in->data;
+    sim->input_len = complete_lines(session);
+    sim->input_pos = 0;
+
+    if (!session->timing)
+    {
+        session->timing = TRUE;
+        clock_gettime(CLOCK_MONOTONIC, &session->queued_at);
+    }
+
+    queue_session(server, session);
+}
+
+
+void open_sessions(Server *server)
+{
+    while (TRUE)
+    {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            return;     // EAGAIN once they have all been accepted
+        }
+
+        Session *session = calloc(1, sizeof(Session));
+        session->fd = fd;
+        session->sim = sim_clone(server->image);
+        session->sim->host_input = TRUE;
+        session->sim->output = &session->vm_out;
+        session->sim->print_errors = FALSE;     // they go to the client instead
+
+        // The clone shares the server's files only if it was given --root.
+        // It gets no cores: they would run outside its slices, JOIN would
+        // block a worker, and nothing could stop them when the session ends.
+        sim_register_service(session->sim, SYS_SPAWN, NULL);
+        sim_register_service(session->sim, SYS_JOIN, NULL);
+        buffer_append(&session->in, "", 0);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = session;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        server->opened++;
+    }
+}
+
+
+void read_session(Server *server, Session *session, bool hung_up)
+{
+    // Take in what the client has sent. Once it has hung up, epoll would
+    // report nothing but EPOLLHUP from now on, so read everything left and
+    // stop watching the socket; the input is still dealt with, and the
+    // output sent if the socket will take it.
+    char buf[READ_SIZE];
+    while (TRUE)
+    {
+        ssize_t n = read(session->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (n < 0)
+        {
+            close_session(server, session);
+            return;
+        }
+        if (n == 0)
+        {
+            // Finish what the client sent, and close once the VM wants more
+            session->eof = TRUE;
+            break;
+        }
+
+        server->bytes_in += n;
+        buffer_append(&session->pending, buf, n);
+        if (!hung_up)
+        {
+            break;
+        }
+    }
+
+    if (hung_up)
+    {
+        session->eof = TRUE;
+        session->hung_up = TRUE;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+    }
+
+    if (!session->busy && !session->closing && (session->pending.len > 0 || session->eof))
+    {
+        feed_session(server, session);
+    }
+
+    flush_session(server, session);
+}
+
+
+void finish_slice(Server *server, Session *session)
+{
+    // A worker has handed the session back
+    Simulator *sim = session->sim;
+    session->busy = FALSE;
+    server->slices++;
+
+    if (session->fd < 0)
+    {
+        session->next = server->dead;
+        server->dead = session;
+        return;
+    }
+
+    buffer_append(&session->out, session->vm_out.data, session->vm_out.len);
+    session->vm_out.len = 0;
+
+    if (sim->preempted && session->hung_up)
+    {
+        // Nothing can reach a client that has hung up, so do not let a
+        // long-running VM go on for nobody
+        server->preempted++;
+        close_session(server, session);
+        return;
+    }
+    else if (sim->preempted)
+    {
+        server->preempted++;
+        feed_session(server, session);
+    }
+    else if (sim->halted)
+    {
+        if (sim->error != SIM_OK)
+        {
+            buffer_append(&session->out, sim->error_message, strlen(sim->error_message));
+            buffer_append(&session->out, "\n", 1);
+        }
+        session->closing = TRUE;
+    }
+    else if (has_new_input(session))
+    {
+        feed_session(server, session);
+    }
+    else
+    {
+        // All the input so far has been dealt with
+        if (session->timing)
+        {
+            session->timing = FALSE;
+            record_latency(server, microseconds_since(&session->queued_at));
+        }
+        session->closing = session->eof;
+    }
+
+    flush_session(server, session);
+}
+
+
+void finish_slices(Server *server)
+{
+    uint64_t count;
+    if (read(server->wake_fd, &count, sizeof(count)) < 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    Session *session = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    while (session != NULL)
+    {
+        Session *next = session->next;
+        finish_slice(server, session);
+        session = next;
+    }
+}
+
+
+bool handle_signal(Server *server)
+{
+    // Returns FALSE when it is time to stop
+    struct signalfd_siginfo info;
+    if (read(server->signal_fd, &info, sizeof(info)) != sizeof(info))
+    {
+        return TRUE;
+    }
+
+    if (info.ssi_signo == SIGUSR1)
+    {
+        print_metrics(server);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+int open_listener(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Socket path is too long: %s\n", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        printf("Could not create socket.\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        printf("Could not listen on %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+void add_event(Server *server, int fd, void *ptr)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = ptr;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+
+int serve(Simulator *image, const char *path, int num_workers, unsigned long slice)
+{
+    // Boot the image until it waits for input; every session starts from here
+    image->host_input = TRUE;
+    while (!image->halted && !image->waiting)
+    {
+        sim_run(image);
+    }
+    if (image->halted)
+    {
+        printf("The image halted while booting.\n");
+        return 1;
+    }
+
+    Server *server = calloc(1, sizeof(Server));
+    server->image = image;
+    server->slice = slice;
+    server->num_workers = num_workers;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->work, NULL);
+
+    server->listen_fd = open_listener(path);
+    if (server->listen_fd < 0)
+    {
+        return 1;
+    }
+
+    // Signals are taken through the loop, so block them before starting the
+    // workers, which inherit the mask. They may have been ignored (as in a
+    // background job), and an ignored signal never reaches the signalfd.
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    add_event(server, server->listen_fd, &server->listen_fd);
+    add_event(server, server->wake_fd, &server->wake_fd);
+    add_event(server, server->signal_fd, &server->signal_fd);
+
+    server->workers = malloc(num_workers * sizeof(pthread_t));
+    for (int i = 0; i < num_workers; i++)
+    {
+        pthread_create(&server->workers[i], NULL, worker_thread, server);
+    }
+
+    printf("Serving on %s with %d workers.\n", path, num_workers);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    bool running = TRUE;
+    while (running)
+    {
+        int n = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &server->listen_fd)
+            {
+                open_sessions(server);
+            }
+            else if (ptr == &server->wake_fd)
+            {
+                finish_slices(server);
+            }
+            else if (ptr == &server->signal_fd)
+            {
+                running = handle_signal(server);
+            }
+            else
+            {
+                Session *session = ptr;
+                if (events[i].events & EPOLLERR)
+                {
+                    close_session(server, session);     // nowhere to send the output
+                }
+                else if (events[i].events & (EPOLLIN | EPOLLHUP))
+                {
+                    read_session(server, session, (events[i].events & EPOLLHUP) != 0);
+                }
+                if (session->fd >= 0 && (events[i].events & EPOLLOUT))
+                {
+                    flush_session(server, session);
+                }
+            }
+        }
+
+        // Only free sessions once no event in this batch can refer to them
+        while (server->dead != NULL)
+        {
+            Session *session = server->dead;
+            server->dead = session->next;
+            free_session(session);
+        }
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server->stopping = TRUE;
+    pthread_cond_broadcast(&server->work);
+    pthread_mutex_unlock(&server->lock);
+    for (int i = 0; i < num_workers; i++)
+    {
+        pthread_join(server->workers[i], NULL);
+    }
+
+    print_metrics(server);
+    unlink(path);
+    return 0;
+}
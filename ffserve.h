@@ -0,0 +1,11 @@
+#ifndef FFSERVE_H
+#define FFSERVE_H
+
+#include "simulator.h"
+
+// Serve Forth sessions on a Unix domain socket until SIGINT or SIGTERM, each
+// in a VM cloned from image once it has booted. SIGUSR1 prints the metrics.
+
+int serve(Simulator *image, const char *path, int num_workers, unsigned long slice);
+
+#endif
@@ -2,40 +2,109 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "simulator.h"
 #include "util.h"
+#include "ffserve.h"
+
+#define DEFAULT_BUFFERS 8
+#define DEFAULT_SLICE   100000
 
 
 typedef struct Options
 {
     char *infile;
+    char *root;         // directory the file words are confined to, if any
+    char *blocks;       // block file, if any
+    int buffers;        // number of block buffers
+    unsigned long budget;   // instructions to run before giving up
+    char *serve;        // socket to serve sessions on, if any
+    int workers;        // threads running sessions' VMs
+    unsigned long slice;    // instructions a session runs before others get a turn
 } Options;
 
 
 Options *parse_args(int argc, char *argv[])
 {
-    if (argc != 2)
+    char *infile = NULL;
+    char *root = NULL;
+    char *blocks = NULL;
+    int buffers = DEFAULT_BUFFERS;
+    unsigned long budget = SIM_NO_LIMIT;
+    char *serve = NULL;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long slice = DEFAULT_SLICE;
+    for (int i = 1; i < argc; i++)
     {
-        printf("Incorrect number of arguments!\n");
-        printf("Usage: %s <infile>\n", argv[0]);
+        if (!strcmp(argv[i], "--root") && i + 1 < argc)
+        {
+            root = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--blocks") && i + 1 < argc)
+        {
+            blocks = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--buffers") && i + 1 < argc)
+        {
+            buffers = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--budget") && i + 1 < argc)
+        {
+            budget = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--serve") && i + 1 < argc)
+        {
+            serve = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--workers") && i + 1 < argc)
+        {
+            workers = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--slice") && i + 1 < argc)
+        {
+            slice = strtoul(argv[++i], NULL, 0);
+        }
+        else if (infile == NULL && argv[i][0] != '-')
+        {
+            infile = argv[i];
+        }
+        else
+        {
+            infile = NULL;
+            break;
+        }
+    }
+
+    if (infile == NULL || workers < 1 || slice == 0)
+    {
+        printf("Incorrect arguments!\n");
+        printf("Usage: %s [--root <dir>] [--blocks <file> [--buffers <n>]] [--budget <n>]\n"
+               "       [--serve <socket> [--workers <n>] [--slice <n>]] <infile>\n", argv[0]);
         return NULL;
     }
 
     Options *options = malloc(sizeof(Options));
+    options->root = root;
+    options->blocks = blocks;
+    options->buffers = buffers;
+    options->budget = budget;
+    options->serve = serve;
+    options->workers = workers;
+    options->slice = slice;
 
     char scratch[MAXCHAR];
-    char *dot = strrchr(argv[1], '.');
+    char *dot = strrchr(infile, '.');
     if (dot == NULL)
     {
-        strcpy(scratch, argv[1]);
+        strcpy(scratch, infile);
         strcat(scratch, ".fo");
         options->infile = my_strdup(scratch);
     }
     else
     {
-        options->infile = argv[1];
+        options->infile = infile;
     }
 
     strcpy(scratch, options->infile);
@@ -56,9 +125,49 @@ int main(int argc, char *argv[])
     }
 
     Simulator *sim = sim_init(options->infile);
+    if (sim == NULL)
+    {
+        return 1;
+    }
+
+    if (!sim_set_file_root(sim, options->root))
+    {
+        printf("Could not open file root: %s\n", options->root);
+        return 1;
+    }
+
+    if (options->serve != NULL)
+    {
+        // Sessions get a VM each, cloned from this one once it has booted
+        return serve(sim, options->serve, options->workers, options->slice);
+    }
+
+    if (options->blocks != NULL && !sim_open_blocks(sim, options->blocks, options->buffers))
+    {
+        return 1;
+    }
 
-    sim_run(sim);
+    // Read stdin in the background, so the VM only waits when it has run out of input
+    sim_start_reader(sim, STDIN_FILENO);
+    sim->budget = options->budget;
+    while (!sim->halted)
+    {
+        sim_run(sim);
+        if (sim->preempted)
+        {
+            // The budget covers the whole run, so a runaway program ends here
+            printf("Instruction budget used up at 0x" CELL_FMT ".\n", sim->pc);
+            sim->exit_code = 1;
+            break;
+        }
+        if (sim->waiting)
+        {
+            sim_await_input(sim);
+            sim->waiting = FALSE;
+        }
+    }
+    sim_close_blocks(sim);
 
-    return 0;
+    return sim->exit_code;
 }
 
@@ -5,4 +5,8 @@
 #define F_IMMED 0x80
 #define F_LENMASK 0x1f
 
+// Dictionary hash table; keep in sync with DICT_HASHMASK in ff.asm
+#define DICT_BUCKETS 0x100
+#define DICT_HASH_MULT 33
+
 #endif
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fakeforth.h"
+
+// Tests of libfakeforth, run by `make check`. Each test runs a clone of a VM
+// booted from ff.fo and compares what it printed, or left in memory, with
+// what it should have.
+
+typedef struct
+{
+    char out[1024];
+    size_t out_len;
+    const char **chunks;    // input, a chunk per read, with NULL for none yet
+    int chunk;
+    int nchunks;
+} TestIO;
+
+
+static void test_write(void *context, const char *str, size_t len)
+{
+    TestIO *io = context;
+    if (len > sizeof(io->out) - 1 - io->out_len)
+    {
+        len = sizeof(io->out) - 1 - io->out_len;
+    }
+    memcpy(io->out + io->out_len, str, len);
+    io->out_len += len;
+    io->out[io->out_len] = '\0';
+}
+
+
+static long test_read(void *context, char *buf, size_t size)
+{
+    TestIO *io = context;
+    if (io->chunk == io->nchunks)
+    {
+        return 0;
+    }
+
+    const char *chunk = io->chunks[io->chunk++];
+    if (chunk == NULL)
+    {
+        return -1;
+    }
+
+    // The chunks are small enough to fit in one read
+    size_t len = strlen(chunk);
+    memcpy(buf, chunk, len);
+    return len;
+}
+
+
+static int failures = 0;
+
+static void check(const char *name, const char *got, const char *expected)
+{
+    if (strcmp(got, expected) != 0)
+    {
+        printf("FAIL %s: got \"%s\", expected \"%s\"\n", name, got, expected);
+        failures++;
+    }
+    else
+    {
+        printf("ok   %s\n", name);
+    }
+}
+
+
+static void test_chunks(FFVM *booted, const char *name, const char **chunks, int nchunks, const char *expected)
+{
+    // Feed the chunks through the read callback, calling ff_run again each
+    // time the callback has none yet, as a host waiting on input would
+    TestIO io = { "", 0, chunks, 0, nchunks };
+    FFVM *vm = ff_clone(booted);
+    ff_set_io(vm, &(FFIO){ .write = test_write, .read = test_read, .context = &io });
+    while (ff_run(vm) == FF_OK && io.chunk < io.nchunks)
+    {
+    }
+    ff_destroy(vm);
+    check(name, io.out, expected);
+}
+
+
+static void test_eval(FFVM *booted, const char *name, const char *src, const char *expected)
+{
+    TestIO io = { "", 0, NULL, 0, 0 };
+    FFVM *vm = ff_clone(booted);
+    ff_set_io(vm, &(FFIO){ .write = test_write, .context = &io });
+    ff_eval(vm, src, strlen(src));
+    ff_destroy(vm);
+    check(name, io.out, expected);
+}
+
+
+static void test_copy(FFVM *booted, const char *word, int from, int to, int len)
+{
+    // Copy within a run of letters above HERE with word (CMOVE or CMOVE>), and
+    // check it against copying a byte at a time in the same direction
+    char expected[64], got[64], src[64], name[64];
+    for (int i = 0; i < 63; i++)
+    {
+        expected[i] = 'A' + i % 26;
+    }
+    expected[63] = '\0';
+
+    FFVM *vm = ff_clone(booted);
+    FFCell here;
+    ff_lookup(vm, "var_HERE", &here);
+    FFCell base = ff_read_cell(vm, here) + 64;
+    ff_write(vm, base, expected, sizeof(expected));
+    for (int i = 0; i < len; i++)
+    {
+        int j = strcmp(word, "CMOVE") ? len - 1 - i : i;
+        expected[to + j] = expected[from + j];
+    }
+
+    snprintf(src, sizeof(src), "%u %u %d %s\n", base + from, base + to, len, word);
+    ff_eval(vm, src, strlen(src));
+    ff_read(vm, base, got, sizeof(got));
+    ff_destroy(vm);
+    snprintf(name, sizeof(name), "%s from %d to %d, %d bytes", word, from, to, len);
+    check(name, got, expected);
+}
+
+
+static char *read_file(const char *filename, size_t *size)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    char *buf = malloc(*size);
+    if (fread(buf, 1, *size, file) != *size)
+    {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(file);
+    return buf;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *filename = (argc > 1) ? argv[1] : "ff.fo";
+    size_t size;
+    char *image = read_file(filename, &size);
+    FFVM *booted;
+    if (image == NULL || ff_create(&booted, image, size) != FF_OK)
+    {
+        fprintf(stderr, "Could not load %s\n", filename);
+        return 1;
+    }
+    free(image);
+    ff_eval(booted, "", 0);
+
+    test_eval(booted, "eval", "1 2 + .\n", "3\n");
+
+    const char *whole[] = { "1 2 + .\n" };
+    test_chunks(booted, "one chunk", whole, 1, "3\n");
+
+    const char *split[] = { "1", NULL, "2 . ", NULL, "3", NULL, "4 .\n" };
+    test_chunks(booted, "chunks split mid-word", split, 7, "12\n34\n");
+
+    const char *lines[] = { "5 .\n6", NULL, " .\n" };
+    test_chunks(booted, "chunks split across lines", lines, 3, "5\n6\n");
+
+    const char *unended[] = { "7", NULL, "8 ." };
+    test_chunks(booted, "last line without a newline", unended, 3, "78\n");
+
+    const char *words[] = { "CMOVE", "CMOVE>" };
+    for (int i = 0; i < 2; i++)
+    {
+        test_copy(booted, words[i], 0, 30, 20);
+        test_copy(booted, words[i], 30, 0, 20);
+        test_copy(booted, words[i], 5, 5, 20);
+        test_copy(booted, words[i], 10, 11, 20);
+        test_copy(booted, words[i], 10, 13, 20);
+        test_copy(booted, words[i], 11, 10, 20);
+        test_copy(booted, words[i], 13, 10, 20);
+        test_copy(booted, words[i], 10, 13, 0);
+    }
+
+    ff_destroy(booted);
+    return (failures == 0) ? 0 : 1;
+}
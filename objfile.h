@@ -0,0 +1,49 @@
+#ifndef OBJFILE_H
+#define OBJFILE_H
+
+// Object file (.fo) format, version 2.
+//
+// All multi-byte fields are big-endian, the same as the simulated machine.
+// The file is laid out to be mapped: the image is copied into VM memory, the
+// dictionary index, line map and symbol names are used in place, and the
+// loader builds a table of symbol addresses pointing at the mapped names.
+//
+//   header        "FFOB", version, endian ('B'), cell size, section count
+//   section table one ObjSection per section
+//   sections      each starts on a 4-byte boundary
+//
+// Sections:
+//   OBJ_SECT_IMAGE    memory image, loaded at address 0
+//   OBJ_SECT_SYMBOLS  count x (u32 address, u32 name offset), sorted by address
+//   OBJ_SECT_STRINGS  NUL-terminated symbol names, referenced by offset
+//   OBJ_SECT_DICT     count x u32 address of each .dict entry, newest first
+//   OBJ_SECT_LINES    count x (u32 address, u32 source line), sorted by address (optional)
+//
+// The cell size is 2, or 4 for a CELL32 build; a simulator only loads files
+// built for its own cell size.
+//
+// Version 1 files (no magic) are a host-endian 16-bit length followed by the image.
+
+#define OBJ_MAGIC           "FFOB"
+#define OBJ_VERSION         2
+#define OBJ_ENDIAN_BIG      'B'
+
+#define OBJ_HEADER_SIZE     8
+#define OBJ_SECTION_SIZE    16
+
+#define OBJ_SECT_IMAGE      1
+#define OBJ_SECT_SYMBOLS    2
+#define OBJ_SECT_STRINGS    3
+#define OBJ_SECT_DICT       4
+#define OBJ_SECT_LINES      5
+
+#define OBJ_SYMBOL_SIZE     8
+#define OBJ_DICT_SIZE       4
+#define OBJ_LINE_SIZE       8
+
+// Section table entry, as stored on disk:
+//   u16 type, u16 reserved, u32 offset (from start of file), u32 size (bytes), u32 count (entries)
+
+#define OBJ_ALIGN(n)        (((n) + 3) & ~3)
+
+#endif
@@ -10,7 +10,7 @@ typedef struct NameMap
     unsigned char code;
 } NameMap;
 
-NameMap name_map[] =
+static const NameMap name_map[] =
 {
     { "NOP", OP_NOP },
     { "JMP", OP_JMP },
@@ -20,19 +20,29 @@ NameMap name_map[] =
     { "JLT", OP_JLT },
     { "JGE", OP_JGE },
     { "JLE", OP_JLE },
+    { "BEQ", OP_BEQ },
+    { "BNE", OP_BNE },
+    { "BGT", OP_BGT },
+    { "BLT", OP_BLT },
+    { "BGE", OP_BGE },
+    { "BLE", OP_BLE },
+    { "BRZ", OP_BRZ },
     { "DPUSH", OP_DPUSH },
     { "RPUSH", OP_RPUSH },
     { "DPOP", OP_DPOP },
     { "RPOP", OP_RPOP },
+    { "RPICK", OP_RPICK },
+    { "RLOOP", OP_RLOOP },
     { "INC", OP_INC },
     { "DEC", OP_DEC },
     { "NEG", OP_NEG },
-    { "GETC", OP_GETC },
-    { "PUTC", OP_PUTC },
-    { "PUTN", OP_PUTN },
-    { "PUTS", OP_PUTS },
-    { "PSTACK", OP_PSTACK },
-    { "PRSTACK", OP_PRSTACK },
+    { "GETL", OP_GETL },
+    { "SYS", OP_SYS },
+    { "PAUSE", OP_PAUSE },
+    { "RETI", OP_RETI },
+    { "CAS", OP_CAS },
+    { "XADD", OP_XADD },
+    { "FENCE", OP_FENCE },
     { "ADD", OP_ADD },
     { "AND", OP_AND },
     { "NOT", OP_NOT },
@@ -40,12 +50,23 @@ NameMap name_map[] =
     { "XOR", OP_XOR },
     { "MUL", OP_MUL },
     { "DIV", OP_DIV },
+    { "UMUL", OP_UMUL },
+    { "MMUL", OP_MMUL },
+    { "UDIV", OP_UDIV },
+    { "SDIV", OP_SDIV },
+    { "DADD", OP_DADD },
     { "SUB", OP_SUB },
     { "CALL", OP_CALL },
     { "RET", OP_RET },
     { "DCLR", OP_DCLR },
     { "RCLR", OP_RCLR },
     { "CMP", OP_CMP },
+    { "CMPS", OP_CMPS },
+    { "SCAS", OP_SCAS },
+    { "MOVS", OP_MOVS },
+    { "FILS", OP_FILS },
+    { "TOKEN", OP_TOKEN },
+    { "TONUM", OP_TONUM },
     { "LDW", OP_LDW },
     { "LDB", OP_LDB },
     { "STW", OP_STW },
@@ -54,7 +75,7 @@ NameMap name_map[] =
     { "HLT", OP_HLT }
 };
 
-int num_ops = sizeof(name_map) / sizeof(name_map[0]);
+static const int num_ops = sizeof(name_map) / sizeof(name_map[0]);
 
 
 typedef struct RegisterMap
@@ -63,7 +84,7 @@ typedef struct RegisterMap
     char *name;
 } RegisterMap;
 
-RegisterMap register_map[] =
+static const RegisterMap register_map[] =
 {
     { REG_IP, "IP" },
     { REG_CA, "CA" },
@@ -78,9 +99,10 @@ RegisterMap register_map[] =
     { REG_X, "X" },
     { REG_Y, "Y" },
     { REG_Z, "Z" },
+    { REG_T, "T" },
 };
 
-int num_registers = sizeof(register_map) / sizeof(register_map[0]);
+static const int num_registers = sizeof(register_map) / sizeof(register_map[0]);
 
 
 char *op_code_to_name(unsigned char code)
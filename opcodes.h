@@ -14,9 +14,9 @@
 #define OP_INC      OPCODE(7)
 #define OP_DEC      OPCODE(8)
 #define OP_NEG      OPCODE(9)
-#define OP_PSTACK   OPCODE(10)
-#define OP_GETC     OPCODE(11)
-#define OP_PUTC     OPCODE(12)
+#define OP_SYS      OPCODE(10)
+#define OP_PAUSE    OPCODE(11)
+#define OP_RETI     OPCODE(12)
 #define OP_ADD      OPCODE(13)
 #define OP_CALL     OPCODE(14)
 #define OP_RET      OPCODE(15)
@@ -34,16 +34,37 @@
 #define OP_STW      OPCODE(27)
 #define OP_STB      OPCODE(28)
 #define OP_BRK      OPCODE(29)
-#define OP_PUTS     OPCODE(30)
+#define OP_CAS      OPCODE(30)
 #define OP_DCLR     OPCODE(31)
 #define OP_RCLR     OPCODE(32)
-#define OP_PUTN     OPCODE(33)
+#define OP_XADD     OPCODE(33)
 #define OP_AND      OPCODE(34)
 #define OP_OR       OPCODE(35)
 #define OP_XOR      OPCODE(36)
 #define OP_NOT      OPCODE(37)
-#define OP_PRSTACK  OPCODE(38)
+#define OP_FENCE    OPCODE(38)
 #define OP_DIV      OPCODE(39)
+#define OP_CMPS     OPCODE(40)
+#define OP_SCAS     OPCODE(41)
+#define OP_MOVS     OPCODE(42)
+#define OP_FILS     OPCODE(43)
+#define OP_TOKEN    OPCODE(44)
+#define OP_TONUM    OPCODE(45)
+#define OP_GETL     OPCODE(46)
+#define OP_BEQ      OPCODE(47)
+#define OP_BNE      OPCODE(48)
+#define OP_BGT      OPCODE(49)
+#define OP_BLT      OPCODE(50)
+#define OP_BGE      OPCODE(51)
+#define OP_BLE      OPCODE(52)
+#define OP_RLOOP    OPCODE(53)
+#define OP_RPICK    OPCODE(54)
+#define OP_BRZ      OPCODE(55)
+#define OP_UMUL     OPCODE(56)
+#define OP_MMUL     OPCODE(57)
+#define OP_UDIV     OPCODE(58)
+#define OP_SDIV     OPCODE(59)
+#define OP_DADD     OPCODE(60)
 
 #define OP_HLT      OPCODE(63)
 
@@ -68,12 +89,18 @@
 #define REG_X       0x10
 #define REG_Y       0x11
 #define REG_Z       0x12
+#define REG_T       0x13    // top of the data stack
 
 // Bits for the flag register
 #define FLAG_EQUAL  0x01
 #define FLAG_GT     0x02    // greater than
 #define FLAG_LT     0x04    // less than
 
+// What the simulator's recorded flag operands mean
+#define FLAGS_NONE      0   // nothing compared yet; no flags set
+#define FLAGS_COMPARE   1   // unsigned compare of val1 with val2
+#define FLAGS_RESULT    2   // signed result in val1, compared with zero
+
 unsigned char op_name_to_code(char *name);
 char *op_code_to_name(unsigned char code);
 
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE     // for MAP_SHARED and ftruncate
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simulator.h"
+#include "simblocks.h"
+
+
+bool map_blocks(SimBlocks *blocks, size_t num_blocks)
+{
+    // (Re)map the first num_blocks blocks of the file, growing it if need be
+    if (blocks->map != NULL)
+    {
+        munmap(blocks->map, blocks->num_blocks * BLOCK_SIZE);
+        blocks->map = NULL;
+    }
+
+    struct stat st;
+    if (fstat(blocks->fd, &st) < 0)
+    {
+        return FALSE;
+    }
+    if ((size_t)st.st_size < num_blocks * BLOCK_SIZE && ftruncate(blocks->fd, num_blocks * BLOCK_SIZE) < 0)
+    {
+        return FALSE;
+    }
+
+    blocks->num_blocks = num_blocks;
+    if (num_blocks == 0)
+    {
+        return TRUE;    // nothing to map yet
+    }
+
+    void *map = mmap(NULL, num_blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        blocks->num_blocks = 0;
+        return FALSE;
+    }
+
+    blocks->map = map;
+    return TRUE;
+}
+
+
+bool sim_open_blocks(Simulator *sim, const char *path, int num_buffers)
+{
+    // Use path as the block file, creating it if need be, with a pool of
+    // num_buffers buffers at the top of VM memory
+    if (num_buffers < 1 || (size_t)num_buffers * BLOCK_SIZE > MEMSIZE / 2)
+    {
+        printf("Block buffers must take between 1K and half of memory.\n");
+        return FALSE;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+    {
+        printf("Could not open block file: %s\n", path);
+        return FALSE;
+    }
+
+    sim_close_blocks(sim);
+
+    SimBlocks *blocks = calloc(1, sizeof(SimBlocks));
+    blocks->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !map_blocks(blocks, st.st_size / BLOCK_SIZE))
+    {
+        printf("Could not map block file: %s\n", path);
+        close(fd);
+        free(blocks);
+        return FALSE;
+    }
+
+    blocks->num_buffers = num_buffers;
+    blocks->buffers = calloc(num_buffers, sizeof(SimBlockBuffer));
+    blocks->pool = MEMSIZE - num_buffers * BLOCK_SIZE;
+    for (int i = 0; i < num_buffers; i++)
+    {
+        blocks->buffers[i].addr = blocks->pool + i * BLOCK_SIZE;
+        blocks->buffers[i].block = NO_BLOCK;
+    }
+
+    sim->blocks = blocks;
+    return TRUE;
+}
+
+
+bool write_back(SimBlocks *blocks, SimBlockBuffer *buffer, unsigned char *memory)
+{
+    // Copy a dirty buffer out to the mapped file
+    if (!buffer->dirty)
+    {
+        return TRUE;
+    }
+
+    if ((size_t)buffer->block >= blocks->num_blocks && !map_blocks(blocks, buffer->block + 1))
+    {
+        return FALSE;
+    }
+
+    memcpy(blocks->map + buffer->block * BLOCK_SIZE, memory + buffer->addr, BLOCK_SIZE);
+    buffer->dirty = FALSE;
+    blocks->writebacks++;
+    return TRUE;
+}
+
+
+bool save_blocks(Simulator *sim)
+{
+    SimBlocks *blocks = sim->blocks;
+    bool ok = TRUE;
+    for (int i = 0; i < blocks->num_buffers; i++)
+    {
+        ok = write_back(blocks, &blocks->buffers[i], sim->memory) && ok;
+    }
+
+    if (blocks->map != NULL)
+    {
+        msync(blocks->map, blocks->num_blocks * BLOCK_SIZE, MS_SYNC);
+    }
+
+    return ok;
+}
+
+
+void empty_blocks(SimBlocks *blocks)
+{
+    for (int i = 0; i < blocks->num_buffers; i++)
+    {
+        blocks->buffers[i].block = NO_BLOCK;
+        blocks->buffers[i].dirty = FALSE;
+    }
+    blocks->current = NULL;
+}
+
+
+void sim_close_blocks(Simulator *sim)
+{
+    // Write back any changes and let go of the block file
+    SimBlocks *blocks = sim->blocks;
+    if (blocks == NULL)
+    {
+        return;
+    }
+
+    save_blocks(sim);
+    if (blocks->map != NULL)
+    {
+        munmap(blocks->map, blocks->num_blocks * BLOCK_SIZE);
+    }
+    close(blocks->fd);
+    free(blocks->buffers);
+    free(blocks);
+    sim->blocks = NULL;
+}
+
+
+void reset_blocks(Simulator *sim)
+{
+    // The VM starts over, so it no longer knows what is in the buffers
+    if (sim->blocks != NULL)
+    {
+        save_blocks(sim);
+        empty_blocks(sim->blocks);
+    }
+}
+
+
+SimBlockBuffer *assign_buffer(Simulator *sim, Cell block, bool read)
+{
+    // Find the buffer holding block, or give it the least recently used one,
+    // reading the block's contents into it if asked
+    SimBlocks *blocks = sim->blocks;
+    SimBlockBuffer *buffer = NULL;
+    SimBlockBuffer *lru = &blocks->buffers[0];
+
+    for (int i = 0; i < blocks->num_buffers; i++)
+    {
+        SimBlockBuffer *b = &blocks->buffers[i];
+        if (b->block == block)
+        {
+            buffer = b;
+            break;
+        }
+        if (b->last_used < lru->last_used)
+        {
+            lru = b;
+        }
+    }
+
+    if (buffer != NULL)
+    {
+        blocks->hits++;
+    }
+    else
+    {
+        blocks->misses++;
+        buffer = lru;
+        if (!write_back(blocks, buffer, sim->memory))
+        {
+            sim_error(sim, SIM_ERR_IO, "Could not write block %ld.", buffer->block);
+            return NULL;
+        }
+
+        buffer->block = block;
+        if (read)
+        {
+            // Blocks past the end of the file read as zeros
+            unsigned char *mem = sim->memory + buffer->addr;
+            if (block < blocks->num_blocks)
+            {
+                memcpy(mem, blocks->map + (size_t)block * BLOCK_SIZE, BLOCK_SIZE);
+            }
+            else
+            {
+                memset(mem, 0, BLOCK_SIZE);
+            }
+        }
+    }
+
+    buffer->last_used = ++blocks->clock;
+    blocks->current = buffer;
+    return buffer;
+}
+
+
+bool check_blocks(Simulator *sim)
+{
+    if (sim->blocks == NULL)
+    {
+        sim_error(sim, SIM_ERR_IO, "No block file.");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+void service_block(Simulator *sim)
+{
+    // A = address of a buffer holding block A
+    if (!check_blocks(sim))
+    {
+        return;
+    }
+
+    SimBlockBuffer *buffer = assign_buffer(sim, sim->a, TRUE);
+    if (buffer != NULL)
+    {
+        sim->a = buffer->addr;
+    }
+}
+
+
+void service_buffer(Simulator *sim)
+{
+    // A = address of a buffer assigned to block A, without reading it
+    if (!check_blocks(sim))
+    {
+        return;
+    }
+
+    SimBlockBuffer *buffer = assign_buffer(sim, sim->a, FALSE);
+    if (buffer != NULL)
+    {
+        sim->a = buffer->addr;
+    }
+}
+
+
+void service_update(Simulator *sim)
+{
+    // Mark the most recently used buffer as changed
+    if (check_blocks(sim) && sim->blocks->current != NULL)
+    {
+        sim->blocks->current->dirty = TRUE;
+    }
+}
+
+
+void service_save_buffers(Simulator *sim)
+{
+    // Write every changed buffer back to the block file
+    if (check_blocks(sim) && !save_blocks(sim))
+    {
+        sim_error(sim, SIM_ERR_IO, "Could not write blocks.");
+    }
+}
+
+
+void service_empty_buffers(Simulator *sim)
+{
+    // Forget what every buffer holds, without saving changes
+    if (check_blocks(sim))
+    {
+        empty_blocks(sim->blocks);
+    }
+}
+
+
+void service_block_pool(Simulator *sim)
+{
+    // A = start of the block buffers, which free memory has to stay below
+    sim->a = (sim->blocks == NULL) ? (Cell)MEMSIZE : sim->blocks->pool;
+}
+
+
+void register_block_services(Simulator *sim)
+{
+    sim_register_service(sim, SYS_BLOCK, service_block);
+    sim_register_service(sim, SYS_BUFFER, service_buffer);
+    sim_register_service(sim, SYS_UPDATE, service_update);
+    sim_register_service(sim, SYS_SAVEBUFS, service_save_buffers);
+    sim_register_service(sim, SYS_EMPTYBUFS, service_empty_buffers);
+    sim_register_service(sim, SYS_BLKPOOL, service_block_pool);
+}
@@ -0,0 +1,11 @@
+#ifndef SIMBLOCKS_H
+#define SIMBLOCKS_H
+
+#include "simulator.h"
+
+// Block services for SYS; the simulator calls these to set up and tear down
+
+void register_block_services(Simulator *sim);
+void reset_blocks(Simulator *sim);
+
+#endif
@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "simulator.h"
+#include "simchannels.h"
+#include "simtasks.h"
+
+
+// Channels are bounded queues of cells that any number of VMs can send to and
+// receive from, whether they share memory or not. Each is a ring of slots
+// with a sequence number apiece (Vyukov's bounded MPMC queue), so sending and
+// receiving are a compare-and-swap on the head or tail with no lock, for one
+// sender or many. The mutex and condition are only for sleeping: a VM with
+// nothing else to run waits on them until the channel it wants is ready.
+//
+// The channel table is shared by the VMs that can talk to each other (cores
+// get their parent's; sim_share_channels joins two VMs'), and freed with the
+// last of them. Channel ids are 1 + the slot, and are not reused.
+
+typedef struct ChannelSlot
+{
+    size_t seq;             // pos when free to send into, pos + 1 when holding a value
+    Cell value;
+} ChannelSlot;
+
+struct SimChannel
+{
+    size_t mask;            // capacity - 1; the capacity is a power of two
+    ChannelSlot *slots;
+    size_t head;            // next position to send to
+    size_t tail;            // next position to receive from
+    int closed;
+    int waiters;            // VMs asleep on this channel
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // a value was sent or received, or the channel closed
+};
+
+struct SimChannels
+{
+    pthread_mutex_t lock;   // held while channels are created
+    int refs;               // VMs using the table
+    int num_channels;
+    SimChannel *channels[SIM_MAX_CHANNELS];
+};
+
+
+void init_channels(Simulator *sim)
+{
+    SimChannels *table = calloc(1, sizeof(SimChannels));
+    pthread_mutex_init(&table->lock, NULL);
+    table->refs = 1;
+    sim->channels = table;
+}
+
+
+void retain_channels(Simulator *sim)
+{
+    __atomic_add_fetch(&sim->channels->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void release_channels(Simulator *sim)
+{
+    SimChannels *table = sim->channels;
+    sim->channels = NULL;
+    if (__atomic_sub_fetch(&table->refs, 1, __ATOMIC_SEQ_CST) > 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < table->num_channels; i++)
+    {
+        SimChannel *channel = table->channels[i];
+        pthread_mutex_destroy(&channel->lock);
+        pthread_cond_destroy(&channel->changed);
+        free(channel->slots);
+        free(channel);
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+
+void sim_share_channels(Simulator *sim, Simulator *other)
+{
+    // From now on sim uses other's channels (and its cores, those it spawns)
+    if (sim->channels == other->channels)
+    {
+        return;
+    }
+
+    release_channels(sim);
+    sim->channels = other->channels;
+    retain_channels(sim);
+}
+
+
+bool try_send(SimChannel *channel, Cell value)
+{
+    size_t pos = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+    ChannelSlot *slot;
+
+    while (TRUE)
+    {
+        slot = &channel->slots[pos & channel->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - pos);
+        if (diff == 0)
+        {
+            // The slot is free; claim it, unless another sender got there first
+            if (__atomic_compare_exchange_n(&channel->head, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return FALSE;   // full
+        }
+        else
+        {
+            pos = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->value = value;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+
+bool try_receive(SimChannel *channel, Cell *value)
+{
+    size_t pos = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+    ChannelSlot *slot;
+
+    while (TRUE)
+    {
+        slot = &channel->slots[pos & channel->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&channel->tail, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return FALSE;   // empty
+        }
+        else
+        {
+            pos = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    *value = slot->value;
+    __atomic_store_n(&slot->seq, pos + channel->mask + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+
+bool channel_ready(SimChannel *channel, bool send)
+{
+    // Could a send (or receive) go ahead now, or has the channel closed?
+    if (__atomic_load_n(&channel->closed, __ATOMIC_SEQ_CST))
+    {
+        return TRUE;
+    }
+
+    size_t pos = __atomic_load_n(send ? &channel->head : &channel->tail, __ATOMIC_SEQ_CST);
+    size_t seq = __atomic_load_n(&channel->slots[pos & channel->mask].seq, __ATOMIC_SEQ_CST);
+    return seq == (send ? pos : pos + 1);
+}
+
+
+void wake_channel(SimChannel *channel)
+{
+    // Only take the lock if a VM is asleep on the channel
+    if (__atomic_load_n(&channel->waiters, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&channel->lock);
+        pthread_cond_broadcast(&channel->changed);
+        pthread_mutex_unlock(&channel->lock);
+    }
+}
+
+
+void await_channel(Simulator *sim)
+{
+    // Sleep until the channel the VM is waiting on is ready for it
+    SimChannel *channel = sim->wait_channel;
+    bool send = sim->wait_to_send;
+    sim->wait_channel = NULL;
+
+    __atomic_add_fetch(&channel->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&channel->lock);
+    while (!channel_ready(channel, send))
+    {
+        pthread_cond_wait(&channel->changed, &channel->lock);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    __atomic_sub_fetch(&channel->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void park(Simulator *sim, SimChannel *channel, bool send)
+{
+    // The SYS runs again once this task gets its turn back; other tasks run
+    // meanwhile, and the VM only waits for the channel if there are none
+    sim->pc = sim->last_pc;
+
+    if (sim->task->next != sim->task)
+    {
+        execute_pause(sim);
+        return;
+    }
+
+    sim->wait_channel = channel;
+    sim->wait_to_send = send;
+    sim->waiting = TRUE;
+}
+
+
+SimChannel *lookup_channel(Simulator *sim, Cell id)
+{
+    SimChannels *table = sim->channels;
+    int num_channels = __atomic_load_n(&table->num_channels, __ATOMIC_ACQUIRE);
+    if (id < 1 || id > num_channels)
+    {
+        sim_error(sim, SIM_ERR_ID, "Unknown channel " CELL_FMT ".", id);
+        return NULL;
+    }
+
+    return table->channels[id - 1];
+}
+
+
+void service_channel(Simulator *sim)
+{
+    // A = id of a new channel holding up to A cells (rounded up to a power of two)
+    size_t capacity = 1;
+    while (capacity < sim->a)
+    {
+        capacity <<= 1;
+    }
+
+    SimChannels *table = sim->channels;
+    pthread_mutex_lock(&table->lock);
+    if (table->num_channels == SIM_MAX_CHANNELS)
+    {
+        pthread_mutex_unlock(&table->lock);
+        sim_error(sim, SIM_ERR_LIMIT, "Too many channels.");
+        return;
+    }
+
+    SimChannel *channel = calloc(1, sizeof(SimChannel));
+    channel->mask = capacity - 1;
+    channel->slots = malloc(capacity * sizeof(ChannelSlot));
+    for (size_t i = 0; i < capacity; i++)
+    {
+        channel->slots[i].seq = i;
+    }
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->changed, NULL);
+
+    table->channels[table->num_channels] = channel;
+    __atomic_store_n(&table->num_channels, table->num_channels + 1, __ATOMIC_RELEASE);
+    sim->a = table->num_channels;
+    pthread_mutex_unlock(&table->lock);
+}
+
+
+void service_send(Simulator *sim)
+{
+    // Send A on channel B, waiting for room if C is non-zero; D = TRUE if
+    // it was sent, FALSE if the channel is full (and C is zero) or closed
+    SimChannel *channel = lookup_channel(sim, sim->b);
+    if (channel == NULL)
+    {
+        return;
+    }
+
+    if (__atomic_load_n(&channel->closed, __ATOMIC_SEQ_CST))
+    {
+        sim->d = FALSE;
+        return;
+    }
+
+    if (try_send(channel, sim->a))
+    {
+        wake_channel(channel);
+        sim->d = CELL_MASK;
+        return;
+    }
+
+    if (sim->c == 0)
+    {
+        sim->d = FALSE;
+        return;
+    }
+
+    park(sim, channel, TRUE);
+}
+
+
+void service_receive(Simulator *sim)
+{
+    // A = the next cell from channel B, waiting for one if C is non-zero;
+    // D = TRUE if there was one, FALSE if it is empty (and C is zero) or
+    // closed and empty
+    SimChannel *channel = lookup_channel(sim, sim->b);
+    if (channel == NULL)
+    {
+        return;
+    }
+
+    Cell value;
+    if (try_receive(channel, &value))
+    {
+        wake_channel(channel);
+        sim->a = value;
+        sim->d = CELL_MASK;
+        return;
+    }
+
+    if (sim->c == 0 || __atomic_load_n(&channel->closed, __ATOMIC_SEQ_CST))
+    {
+        sim->d = FALSE;
+        return;
+    }
+
+    park(sim, channel, FALSE);
+}
+
+
+void service_close_channel(Simulator *sim)
+{
+    // Close channel B: nothing more can be sent, and what is in it can still
+    // be received
+    SimChannel *channel = lookup_channel(sim, sim->b);
+    if (channel == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&channel->closed, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&channel->lock);
+    pthread_cond_broadcast(&channel->changed);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+
+void register_channel_services(Simulator *sim)
+{
+    sim_register_service(sim, SYS_CHANNEL, service_channel);
+    sim_register_service(sim, SYS_SEND, service_send);
+    sim_register_service(sim, SYS_RECEIVE, service_receive);
+    sim_register_service(sim, SYS_CLOSECHAN, service_close_channel);
+}
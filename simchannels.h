@@ -0,0 +1,15 @@
+#ifndef SIMCHANNELS_H
+#define SIMCHANNELS_H
+
+#include "simulator.h"
+
+// Channel services for SYS; the simulator calls these to set up and tear
+// down, and to wait on a channel for the host
+
+void register_channel_services(Simulator *sim);
+void init_channels(Simulator *sim);
+void retain_channels(Simulator *sim);
+void release_channels(Simulator *sim);
+void await_channel(Simulator *sim);
+
+#endif
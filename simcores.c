@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "simulator.h"
+#include "simcores.h"
+
+
+// Each core is a Simulator of its own (see sim_init_core) running sim_run on a
+// host thread, against the memory of the VM that spawned it. Memory is shared
+// as it is, so plain loads and stores take no locks; cores coordinate with the
+// CAS, XADD and FENCE opcodes. The table of cores is shared by all of them,
+// and its lock is only held while a core is added or taken out.
+
+typedef struct SimCore
+{
+    Simulator *sim;         // NULL when the slot is free
+    pthread_t thread;
+} SimCore;
+
+struct SimCores
+{
+    pthread_mutex_t lock;
+    SimCore cores[SIM_MAX_CORES];
+};
+
+
+void *core_thread(void *arg)
+{
+    Simulator *core = arg;
+
+    while (!core->halted)
+    {
+        sim_run(core);
+        if (core->waiting && core->wait_channel != NULL)
+        {
+            sim_await_input(core);
+            core->waiting = FALSE;
+        }
+        else if (core->waiting)
+        {
+            sim_error(core, SIM_ERR_IO, "Cores cannot read input.");
+        }
+    }
+
+    return NULL;
+}
+
+
+void service_spawn(Simulator *sim)
+{
+    // A = id of a new core, which starts at machine code D with CA = B and A
+    // on its data stack
+    if (sim->cores == NULL)
+    {
+        // Only the first VM can get here, before any core shares the table
+        sim->cores = calloc(1, sizeof(SimCores));
+        pthread_mutex_init(&sim->cores->lock, NULL);
+    }
+
+    SimCores *cores = sim->cores;
+    pthread_mutex_lock(&cores->lock);
+
+    SimCore *slot = NULL;
+    for (int i = 0; i < SIM_MAX_CORES; i++)
+    {
+        if (cores->cores[i].sim == NULL)
+        {
+            slot = &cores->cores[i];
+            break;
+        }
+    }
+
+    if (slot == NULL)
+    {
+        pthread_mutex_unlock(&cores->lock);
+        sim_error(sim, SIM_ERR_LIMIT, "Too many cores.");
+        return;
+    }
+
+    Simulator *core = sim_init_core(sim);
+    core->pc = sim->d;
+    core->ca = sim->b;
+    core->t = sim->a;
+    core->data_depth = 1;
+
+    if (pthread_create(&slot->thread, NULL, core_thread, core) != 0)
+    {
+        pthread_mutex_unlock(&cores->lock);
+        sim_free_core(core);
+        sim_error(sim, SIM_ERR_LIMIT, "Could not start a core.");
+        return;
+    }
+
+    slot->sim = core;
+    sim->a = slot - cores->cores + 1;
+    pthread_mutex_unlock(&cores->lock);
+}
+
+
+void service_join(Simulator *sim)
+{
+    // Wait for core A to finish, and free it; A = its top of stack, or 0
+    SimCores *cores = sim->cores;
+    Cell id = sim->a;
+    Simulator *core = NULL;
+    pthread_t thread;
+
+    if (cores != NULL && id >= 1 && id <= SIM_MAX_CORES)
+    {
+        // Take the core out of the table, so nothing else can join it
+        pthread_mutex_lock(&cores->lock);
+        SimCore *slot = &cores->cores[id - 1];
+        core = slot->sim;
+        thread = slot->thread;
+        slot->sim = NULL;
+        pthread_mutex_unlock(&cores->lock);
+    }
+
+    if (core == NULL || core == sim)
+    {
+        sim_error(sim, SIM_ERR_ID, "Cannot join core " CELL_FMT ".", id);
+        return;
+    }
+
+    pthread_join(thread, NULL);
+    sim->a = (core->data_depth > 0) ? core->t : 0;
+    sim_free_core(core);
+}
+
+
+void register_core_services(Simulator *sim)
+{
+    sim_register_service(sim, SYS_SPAWN, service_spawn);
+    sim_register_service(sim, SYS_JOIN, service_join);
+}
@@ -0,0 +1,10 @@
+#ifndef SIMCORES_H
+#define SIMCORES_H
+
+#include "simulator.h"
+
+// Core services for SYS; the simulator calls this to set them up
+
+void register_core_services(Simulator *sim);
+
+#endif
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE     // for openat, pread and pwrite
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "simulator.h"
+#include "simfiles.h"
+
+
+bool sim_set_file_root(Simulator *sim, const char *dir)
+{
+    // Confine the file services to dir; NULL turns them off
+    if (sim->file_root >= 0)
+    {
+        close(sim->file_root);
+        sim->file_root = -1;
+    }
+
+    if (dir == NULL)
+    {
+        return TRUE;
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return FALSE;
+    }
+
+    sim->file_root = fd;
+    return TRUE;
+}
+
+
+bool valid_file_name(const char *name)
+{
+    // Names must stay under the root: relative, with no ".." components
+    if (name[0] == 0 || name[0] == '/')
+    {
+        return FALSE;
+    }
+
+    const char *part = name;
+    while (*part != 0)
+    {
+        size_t len = strcspn(part, "/");
+        if (len == 2 && !strncmp(part, "..", 2))
+        {
+            return FALSE;
+        }
+
+        part += len;
+        if (*part == '/')
+        {
+            part++;
+        }
+    }
+
+    return TRUE;
+}
+
+
+int open_beneath(int root, const char *name, int flags)
+{
+    // Open name under root one component at a time, refusing to follow a
+    // symlink anywhere along the way, so nothing outside root can be reached.
+    // Returns the fd, or -1 with errno set.
+    int dir = root;
+    const char *part = name;
+    char component[MAXCHAR];
+    while (TRUE)
+    {
+        size_t len = strcspn(part, "/");
+        memcpy(component, part, len);
+        component[len] = 0;
+        part += len;
+        while (*part == '/')
+        {
+            part++;
+        }
+
+        int fd;
+        if (*part == 0)
+        {
+            fd = openat(dir, component, flags | O_NOFOLLOW | O_CLOEXEC, 0666);
+        }
+        else
+        {
+            fd = openat(dir, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+
+        if (dir != root)
+        {
+            int saved = errno;
+            close(dir);
+            errno = saved;
+        }
+        if (fd < 0 || *part == 0)
+        {
+            return fd;
+        }
+        dir = fd;
+    }
+}
+
+
+SimFile *lookup_file(Simulator *sim, Cell id)
+{
+    // File ids are 1 + the slot, so that 0 is never a valid id
+    if (id < 1 || id > SIM_MAX_FILES || sim->files[id - 1].fd < 0)
+    {
+        return NULL;
+    }
+
+    return &sim->files[id - 1];
+}
+
+
+void close_files(Simulator *sim)
+{
+    for (int i = 0; i < SIM_MAX_FILES; i++)
+    {
+        if (sim->files[i].fd >= 0)
+        {
+            close(sim->files[i].fd);
+            sim->files[i].fd = -1;
+        }
+    }
+}
+
+
+void set_double(Simulator *sim, off_t value)
+{
+    // A:B = value, high cell first
+    sim->a = (DCell)value >> CELL_BITS;
+    sim->b = (DCell)value & CELL_MASK;
+}
+
+
+void open_file(Simulator *sim, int flags)
+{
+    // Open the file named by A (length B) with access method C; C = file id, D = ior
+    Cell addr = sim->a & MEMMASK;
+    unsigned int len = sim_clamp_length(addr, sim->b);
+    Cell fam = sim->c;
+    char name[MAXCHAR];
+
+    sim->c = 0;
+
+    if (len >= MAXCHAR || memchr(sim->memory + addr, 0, len) != NULL)
+    {
+        sim->d = EINVAL;
+        return;
+    }
+    memcpy(name, sim->memory + addr, len);
+    name[len] = 0;
+
+    if (sim->file_root < 0 || !valid_file_name(name))
+    {
+        sim->d = EACCES;
+        return;
+    }
+
+    switch (fam)
+    {
+        case FAM_RO:
+            flags |= O_RDONLY;
+            break;
+
+        case FAM_WO:
+            flags |= O_WRONLY;
+            break;
+
+        case FAM_RW:
+            flags |= O_RDWR;
+            break;
+
+        default:
+            sim->d = EINVAL;
+            return;
+    }
+
+    int slot;
+    for (slot = 0; slot < SIM_MAX_FILES && sim->files[slot].fd >= 0; slot++)
+    {
+    }
+    if (slot == SIM_MAX_FILES)
+    {
+        sim->d = EMFILE;
+        return;
+    }
+
+    int fd = open_beneath(sim->file_root, name, flags);
+    if (fd < 0)
+    {
+        sim->d = errno;
+        return;
+    }
+
+    sim->files[slot].fd = fd;
+    sim->files[slot].pos = 0;
+    sim->c = slot + 1;
+    sim->d = 0;
+}
+
+
+void service_open(Simulator *sim)
+{
+    open_file(sim, 0);
+}
+
+
+void service_create(Simulator *sim)
+{
+    open_file(sim, O_CREAT | O_TRUNC);
+}
+
+
+void service_close(Simulator *sim)
+{
+    // Close file C; D = ior
+    SimFile *file = lookup_file(sim, sim->c);
+    if (file == NULL)
+    {
+        sim->d = EBADF;
+        return;
+    }
+
+    sim->d = (close(file->fd) < 0) ? errno : 0;
+    file->fd = -1;
+}
+
+
+void service_fread(Simulator *sim)
+{
+    // Read up to B bytes from file C straight into memory at A; A = count, D = ior
+    SimFile *file = lookup_file(sim, sim->c);
+    Cell addr = sim->a & MEMMASK;
+    unsigned int len = sim_clamp_length(addr, sim->b);
+    unsigned int done = 0;
+
+    sim->a = 0;
+    if (file == NULL)
+    {
+        sim->d = EBADF;
+        return;
+    }
+
+    while (done < len)
+    {
+        ssize_t n = pread(file->fd, sim->memory + addr + done, len - done, file->pos + done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            sim->d = errno;
+            return;
+        }
+        if (n == 0)
+        {
+            break;      // end of file
+        }
+        done += n;
+    }
+
+    file->pos += done;
+    sim->a = done;
+    sim->d = 0;
+}
+
+
+void service_fwrite(Simulator *sim)
+{
+    // Write B bytes from memory at A to file C; A = count, D = ior
+    SimFile *file = lookup_file(sim, sim->c);
+    Cell addr = sim->a & MEMMASK;
+    unsigned int len = sim_clamp_length(addr, sim->b);
+    unsigned int done = 0;
+
+    sim->a = 0;
+    if (file == NULL)
+    {
+        sim->d = EBADF;
+        return;
+    }
+
+    while (done < len)
+    {
+        ssize_t n = pwrite(file->fd, sim->memory + addr + done, len - done, file->pos + done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            sim->d = errno;
+            file->pos += done;
+            sim->a = done;
+            return;
+        }
+        done += n;
+    }
+
+    file->pos += done;
+    sim->a = done;
+    sim->d = 0;
+}
+
+
+void service_fsize(Simulator *sim)
+{
+    // A:B = size of file C; D = ior
+    SimFile *file = lookup_file(sim, sim->c);
+    struct stat st;
+
+    set_double(sim, 0);
+    if (file == NULL)
+    {
+        sim->d = EBADF;
+        return;
+    }
+
+    if (fstat(file->fd, &st) < 0)
+    {
+        sim->d = errno;
+        return;
+    }
+
+    set_double(sim, st.st_size);
+    sim->d = 0;
+}
+
+
+void service_ftell(Simulator *sim)
+{
+    // A:B = position in file C; D = ior
+    SimFile *file = lookup_file(sim, sim->c);
+
+    set_double(sim, 0);
+    if (file == NULL)
+    {
+        sim->d = EBADF;
+        return;
+    }
+
+    set_double(sim, file->pos);
+    sim->d = 0;
+}
+
+
+void service_fseek(Simulator *sim)
+{
+    // Move the position in file C to A:B; D = ior
+    SimFile *file = lookup_file(sim, sim->c);
+    if (file == NULL)
+    {
+        sim->d = EBADF;
+        return;
+    }
+
+    file->pos = ((DCell)sim->a << CELL_BITS) | sim->b;
+    sim->d = 0;
+}
+
+
+void register_file_services(Simulator *sim)
+{
+    sim_register_service(sim, SYS_OPEN, service_open);
+    sim_register_service(sim, SYS_CREATE, service_create);
+    sim_register_service(sim, SYS_CLOSE, service_close);
+    sim_register_service(sim, SYS_FREAD, service_fread);
+    sim_register_service(sim, SYS_FWRITE, service_fwrite);
+    sim_register_service(sim, SYS_FSIZE, service_fsize);
+    sim_register_service(sim, SYS_FTELL, service_ftell);
+    sim_register_service(sim, SYS_FSEEK, service_fseek);
+}
@@ -0,0 +1,11 @@
+#ifndef SIMFILES_H
+#define SIMFILES_H
+
+#include "simulator.h"
+
+// File services for SYS; the simulator calls these to set up and tear down
+
+void register_file_services(Simulator *sim);
+void close_files(Simulator *sim);
+
+#endif
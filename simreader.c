@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "simulator.h"
+#include "simreader.h"
+#include "simchannels.h"
+
+#define RING_SIZE 4096      // must be a power of two
+#define RING_MASK (RING_SIZE - 1)
+
+
+// Input is read into a single-producer/single-consumer ring by a background
+// thread. The data path is lock-free: the reader thread only advances head and
+// the VM only advances tail. The mutex and condition are just for sleeping
+// when the ring is full (reader) or does not have enough input (host).
+struct SimReader
+{
+    int fd;
+    int stop_fds[2];            // pipe closed by sim_stop_reader to end the thread
+    int stopping;
+    pthread_t thread;
+    unsigned char data[RING_SIZE];
+    size_t head;                // total bytes written; only the reader thread changes it
+    size_t tail;                // total bytes consumed; only the VM changes it
+    int eof;                    // set by the reader thread once the input has ended
+    int reader_waiting;         // the reader thread is asleep waiting for space
+    size_t wait_head;           // head when the VM last ran short of input
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // head, tail or eof moved
+};
+
+
+void wake(SimReader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+
+void wait_for_space(SimReader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    __atomic_store_n(&reader->reader_waiting, 1, __ATOMIC_SEQ_CST);
+    while (reader->head - __atomic_load_n(&reader->tail, __ATOMIC_SEQ_CST) == RING_SIZE &&
+           !__atomic_load_n(&reader->stopping, __ATOMIC_SEQ_CST))
+    {
+        pthread_cond_wait(&reader->changed, &reader->lock);
+    }
+    __atomic_store_n(&reader->reader_waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+
+void *reader_thread(void *arg)
+{
+    SimReader *reader = arg;
+
+    while (!__atomic_load_n(&reader->stopping, __ATOMIC_SEQ_CST))
+    {
+        size_t head = reader->head;
+        size_t used = head - __atomic_load_n(&reader->tail, __ATOMIC_ACQUIRE);
+        if (used == RING_SIZE)
+        {
+            wait_for_space(reader);
+            continue;
+        }
+
+        // Wait for input, or for sim_stop_reader
+        struct pollfd fds[2] = { { reader->fd, POLLIN, 0 }, { reader->stop_fds[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if (fds[1].revents != 0 || fds[0].revents == 0)
+        {
+            continue;
+        }
+
+        // Read straight into the free part of the ring, up to where it wraps
+        size_t offset = head & RING_MASK;
+        size_t len = RING_SIZE - used;
+        if (len > RING_SIZE - offset)
+        {
+            len = RING_SIZE - offset;
+        }
+
+        ssize_t n = read(reader->fd, reader->data + offset, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+
+        __atomic_store_n(&reader->head, head + n, __ATOMIC_RELEASE);
+        wake(reader);
+    }
+
+    __atomic_store_n(&reader->eof, 1, __ATOMIC_RELEASE);
+    wake(reader);
+    return NULL;
+}
+
+
+bool sim_start_reader(Simulator *sim, int fd)
+{
+    // Read fd in the background from now on, rather than stdin as it is needed
+    if (sim->reader != NULL)
+    {
+        return FALSE;
+    }
+
+    SimReader *reader = calloc(1, sizeof(SimReader));
+    reader->fd = fd;
+    if (pipe(reader->stop_fds) < 0)
+    {
+        free(reader);
+        return FALSE;
+    }
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+
+    if (pthread_create(&reader->thread, NULL, reader_thread, reader) != 0)
+    {
+        close(reader->stop_fds[0]);
+        close(reader->stop_fds[1]);
+        free(reader);
+        return FALSE;
+    }
+
+    sim->reader = reader;
+    return TRUE;
+}
+
+
+void sim_stop_reader(Simulator *sim)
+{
+    // End the reader thread, which only ever sleeps in poll() or waiting for
+    // space, and free the ring; sim_free does this
+    SimReader *reader = sim->reader;
+    if (reader == NULL)
+    {
+        return;
+    }
+
+    // Closing the pipe wakes poll() up
+    __atomic_store_n(&reader->stopping, 1, __ATOMIC_SEQ_CST);
+    close(reader->stop_fds[1]);
+    wake(reader);
+    pthread_join(reader->thread, NULL);
+
+    close(reader->stop_fds[0]);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->changed);
+    free(reader);
+    sim->reader = NULL;
+}
+
+
+size_t reader_available(SimReader *reader)
+{
+    return __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE) - reader->tail;
+}
+
+
+bool reader_at_end(SimReader *reader)
+{
+    // Input has ended and everything has been consumed
+    return __atomic_load_n(&reader->eof, __ATOMIC_ACQUIRE) && reader_available(reader) == 0;
+}
+
+
+int reader_getc(SimReader *reader)
+{
+    if (reader_available(reader) == 0)
+    {
+        return reader_at_end(reader) ? EOF : NO_INPUT;
+    }
+
+    size_t tail = reader->tail;
+    int c = reader->data[tail & RING_MASK];
+    __atomic_store_n(&reader->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&reader->reader_waiting, __ATOMIC_SEQ_CST))
+    {
+        wake(reader);
+    }
+
+    return c;
+}
+
+
+bool reader_line_ready(SimReader *reader, size_t size)
+{
+    // Is there a whole line (or size bytes, or the end of the input) to read?
+    if (__atomic_load_n(&reader->eof, __ATOMIC_ACQUIRE))
+    {
+        return TRUE;
+    }
+
+    size_t available = reader_available(reader);
+    if (available >= size || available == RING_SIZE)
+    {
+        return TRUE;
+    }
+
+    for (size_t i = 0; i < available; i++)
+    {
+        if (reader->data[(reader->tail + i) & RING_MASK] == '\n')
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+void reader_note_wait(SimReader *reader)
+{
+    // The VM could not go on with the input it had; sim_await_input sleeps
+    // until there is more than this
+    reader->wait_head = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE);
+}
+
+
+bool reader_has_more(SimReader *reader)
+{
+    // Has more input arrived, or the input ended, since the VM had to wait?
+    return __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE) != reader->wait_head ||
+           __atomic_load_n(&reader->eof, __ATOMIC_ACQUIRE);
+}
+
+
+void sim_await_input(Simulator *sim)
+{
+    // Sleep until the reader thread has more input than when the VM last
+    // had to wait, or the input has ended; or until the channel the VM is
+    // waiting on is ready
+    if (sim->wait_channel != NULL)
+    {
+        await_channel(sim);
+        return;
+    }
+
+    SimReader *reader = sim->reader;
+    if (reader == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    while (__atomic_load_n(&reader->head, __ATOMIC_ACQUIRE) == reader->wait_head &&
+           !__atomic_load_n(&reader->eof, __ATOMIC_ACQUIRE))
+    {
+        pthread_cond_wait(&reader->changed, &reader->lock);
+    }
+    pthread_mutex_unlock(&reader->lock);
+}
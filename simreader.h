@@ -0,0 +1,18 @@
+#ifndef SIMREADER_H
+#define SIMREADER_H
+
+#include "simulator.h"
+
+#define NO_INPUT (-2)       // no input yet: the VM has to wait for more
+
+// Background input reader; the simulator takes its input from here once
+// sim_start_reader has been called
+
+size_t reader_available(SimReader *reader);
+bool reader_at_end(SimReader *reader);
+int reader_getc(SimReader *reader);
+bool reader_line_ready(SimReader *reader, size_t size);
+void reader_note_wait(SimReader *reader);
+bool reader_has_more(SimReader *reader);
+
+#endif
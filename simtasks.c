@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "simulator.h"
+#include "simtasks.h"
+#include "simreader.h"
+
+
+// Tasks share the VM's memory, and each has its own registers and stacks. The
+// running task's are live in the Simulator; the rest are saved in their
+// SimTask. Ready tasks form a ring that PAUSE walks round, so switching is a
+// save and a load whatever the number of tasks. Tasks waiting for input are
+// kept off the ring until more input arrives.
+
+
+void free_stack(StackNode *node)
+{
+    while (node != NULL)
+    {
+        StackNode *next = node->next;
+        free(node);
+        node = next;
+    }
+}
+
+
+void save_task(Simulator *sim, SimTask *task)
+{
+    task->pc = sim->pc;
+    task->ip = sim->ip;
+    task->ca = sim->ca;
+    task->a = sim->a;
+    task->b = sim->b;
+    task->c = sim->c;
+    task->d = sim->d;
+    task->i = sim->i;
+    task->j = sim->j;
+    task->m = sim->m;
+    task->n = sim->n;
+    task->x = sim->x;
+    task->y = sim->y;
+    task->z = sim->z;
+    task->t = sim->t;
+    task->flag_kind = sim->flag_kind;
+    task->flag_val1 = sim->flag_val1;
+    task->flag_val2 = sim->flag_val2;
+    task->in_interrupt = sim->in_interrupt;
+    task->data_depth = sim->data_depth;
+    task->data_stack = sim->data_stack;
+    task->return_stack = sim->return_stack;
+    task->call_stack = sim->call_stack;
+}
+
+
+void load_task(Simulator *sim, SimTask *task)
+{
+    sim->pc = task->pc;
+    sim->ip = task->ip;
+    sim->ca = task->ca;
+    sim->a = task->a;
+    sim->b = task->b;
+    sim->c = task->c;
+    sim->d = task->d;
+    sim->i = task->i;
+    sim->j = task->j;
+    sim->m = task->m;
+    sim->n = task->n;
+    sim->x = task->x;
+    sim->y = task->y;
+    sim->z = task->z;
+    sim->t = task->t;
+    sim->flag_kind = task->flag_kind;
+    sim->flag_val1 = task->flag_val1;
+    sim->flag_val2 = task->flag_val2;
+    sim->in_interrupt = task->in_interrupt;
+    sim->data_depth = task->data_depth;
+    sim->data_stack = task->data_stack;
+    sim->return_stack = task->return_stack;
+    sim->call_stack = task->call_stack;
+}
+
+
+void switch_task(Simulator *sim, SimTask *task)
+{
+    save_task(sim, sim->task);
+    load_task(sim, task);
+    sim->task = task;
+}
+
+
+void link_task(Simulator *sim, SimTask *task)
+{
+    // Add a task to the ready ring, just before the running task so it gets
+    // its turn at the end of the round
+    SimTask *current = sim->task;
+    task->next = current;
+    task->prev = current->prev;
+    current->prev->next = task;
+    current->prev = task;
+    task->state = TASK_READY;
+}
+
+
+void unlink_task(SimTask *task)
+{
+    task->prev->next = task->next;
+    task->next->prev = task->prev;
+    task->next = task;
+    task->prev = task;
+}
+
+
+void remove_blocked(Simulator *sim, SimTask *task)
+{
+    for (SimTask **link = &sim->blocked; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == task)
+        {
+            *link = task->next;
+            break;
+        }
+    }
+    task->next = task;
+    task->prev = task;
+}
+
+
+void clear_task(SimTask *task)
+{
+    // Empty the saved stacks and registers of a task that is not running
+    free_stack(task->data_stack);
+    free_stack(task->return_stack);
+    free_stack(task->call_stack);
+
+    memset(task, 0, sizeof(SimTask));
+    task->next = task;
+    task->prev = task;
+}
+
+
+void reset_tasks(Simulator *sim)
+{
+    // Back to just the one task, which is running. The running task's live
+    // stacks belong to the Simulator, which clears them itself.
+    for (int i = 0; i < SIM_MAX_TASKS; i++)
+    {
+        SimTask *task = &sim->tasks[i];
+        if (task != sim->task)
+        {
+            clear_task(task);
+        }
+        else
+        {
+            memset(task, 0, sizeof(SimTask));
+        }
+    }
+
+    sim->task = &sim->tasks[0];
+    sim->task->state = TASK_READY;
+    sim->task->next = sim->task;
+    sim->task->prev = sim->task;
+    sim->blocked = NULL;
+}
+
+
+bool input_arrived(Simulator *sim)
+{
+    // Has there been more input since the blocked tasks had to wait?
+    if (sim->host_input)
+    {
+        return sim->input_pos < sim->input_len;
+    }
+
+    if (sim->io.read != NULL)
+    {
+        return TRUE;    // the tasks try the callback again
+    }
+
+    if (sim->reader != NULL)
+    {
+        return reader_has_more(sim->reader);
+    }
+
+    return TRUE;
+}
+
+
+void wake_tasks(Simulator *sim)
+{
+    // Put the tasks waiting for input back on the ring once there is some
+    if (sim->blocked == NULL || !input_arrived(sim))
+    {
+        return;
+    }
+
+    while (sim->blocked != NULL)
+    {
+        SimTask *task = sim->blocked;
+        sim->blocked = task->next;
+        link_task(sim, task);
+    }
+}
+
+
+bool block_task(Simulator *sim)
+{
+    // The running task has to wait for input; switch to another task if one
+    // is ready, or return FALSE to have the whole VM wait
+    SimTask *task = sim->task;
+    SimTask *next = task->next;
+    if (next == task)
+    {
+        return FALSE;
+    }
+
+    unlink_task(task);
+    task->state = TASK_BLOCKED;
+    task->next = sim->blocked;
+    sim->blocked = task;
+
+    switch_task(sim, next);
+    return TRUE;
+}
+
+
+void execute_pause(Simulator *sim)
+{
+    // Let the next ready task run
+    wake_tasks(sim);
+
+    SimTask *next = sim->task->next;
+    if (next != sim->task)
+    {
+        switch_task(sim, next);
+    }
+}
+
+
+SimTask *lookup_task(Simulator *sim, Cell id)
+{
+    // Task ids are 1 + the slot, so that 0 is never a valid id
+    if (id < 1 || id > SIM_MAX_TASKS || sim->tasks[id - 1].state == TASK_FREE)
+    {
+        return NULL;
+    }
+
+    return &sim->tasks[id - 1];
+}
+
+
+void service_task(Simulator *sim)
+{
+    // A = id of a new task, which stays stopped until it is activated
+    for (int i = 0; i < SIM_MAX_TASKS; i++)
+    {
+        SimTask *task = &sim->tasks[i];
+        if (task->state == TASK_FREE)
+        {
+            clear_task(task);
+            task->state = TASK_STOPPED;
+            sim->a = i + 1;
+            return;
+        }
+    }
+
+    sim_error(sim, SIM_ERR_LIMIT, "Too many tasks.");
+}
+
+
+void service_activate(Simulator *sim)
+{
+    // Start task A afresh, running machine code at D with IP = B and C on
+    // its return stack, so the thread at C runs once the task's code returns
+    SimTask *task = lookup_task(sim, sim->a);
+    if (task == NULL || task == sim->task)
+    {
+        sim_error(sim, SIM_ERR_ID, "Cannot activate task " CELL_FMT ".", sim->a);
+        return;
+    }
+
+    if (task->state == TASK_READY)
+    {
+        unlink_task(task);
+    }
+    else if (task->state == TASK_BLOCKED)
+    {
+        remove_blocked(sim, task);
+    }
+
+    clear_task(task);
+    task->pc = sim->d;
+    task->ip = sim->b;
+    task->return_stack = malloc(sizeof(StackNode));
+    task->return_stack->value = sim->c;
+    task->return_stack->next = NULL;
+
+    link_task(sim, task);
+}
+
+
+void service_stop(Simulator *sim)
+{
+    // Stop the running task, and go on with another
+    SimTask *task = sim->task;
+    SimTask *next = task->next;
+
+    if (next == task && sim->blocked != NULL)
+    {
+        // Nothing else is ready, so go back to a task that is waiting for
+        // input; it will have the whole VM wait if there is still none
+        next = sim->blocked;
+        sim->blocked = next->next;
+        link_task(sim, next);
+    }
+
+    if (next == task)
+    {
+        sim_error(sim, SIM_ERR_TASKS, "All tasks have stopped.");
+        return;
+    }
+
+    unlink_task(task);
+    task->state = TASK_STOPPED;
+    switch_task(sim, next);
+}
+
+
+void register_task_services(Simulator *sim)
+{
+    sim_register_service(sim, SYS_TASK, service_task);
+    sim_register_service(sim, SYS_ACTIVATE, service_activate);
+    sim_register_service(sim, SYS_STOP, service_stop);
+}
@@ -0,0 +1,13 @@
+#ifndef SIMTASKS_H
+#define SIMTASKS_H
+
+#include "simulator.h"
+
+// Tasks; the simulator calls these to switch tasks and to set up and tear down
+
+void register_task_services(Simulator *sim);
+void reset_tasks(Simulator *sim);
+void execute_pause(Simulator *sim);
+bool block_task(Simulator *sim);
+
+#endif
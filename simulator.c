@@ -1,39 +1,329 @@
+#define _GNU_SOURCE     // for memmem
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 
 #include "simulator.h"
 #include "opcodes.h"
+#include "objfile.h"
 #include "util.h"
+#include "simfiles.h"
+#include "simblocks.h"
+#include "simreader.h"
+#include "simtasks.h"
+#include "simcores.h"
+#include "simchannels.h"
 
+void register_standard_services(Simulator *sim);
 
-Simulator *sim_init(char *objfile)
+
+unsigned int read_be16(unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+unsigned int read_be32(unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+int compare_sim_symbols(const void *a, const void *b)
 {
-    FILE *file = fopen(objfile, "rb");
-    if (file == NULL)
+    const SimSymbol *sa = a;
+    const SimSymbol *sb = b;
+
+    if (sa->location != sb->location)
     {
-        printf("Could not open object file: %s\n", objfile);
-        return NULL;
+        return sa->location < sb->location ? -1 : 1;
+    }
+
+    return strcmp(sa->name, sb->name);
+}
+
+
+bool load_object_v1(Simulator *sim, unsigned char *data, size_t size)
+{
+    if (CELL_BYTES != 2)
+    {
+        sim_error(sim, SIM_ERR_LOAD, "Version 1 object files only hold 16-bit images.");
+        return FALSE;
+    }
+
+    unsigned short len;
+    if (size < sizeof(len))
+    {
+        sim_error(sim, SIM_ERR_LOAD, "Object file is truncated.");
+        return FALSE;
+    }
+
+    memcpy(&len, data, sizeof(len));
+    if (len > size - sizeof(len))
+    {
+        sim_error(sim, SIM_ERR_LOAD, "Object file is truncated.");
+        return FALSE;
+    }
+
+    memcpy(sim->memory, data + sizeof(len), len);
+    return TRUE;
+}
+
+
+bool load_object_v2(Simulator *sim, unsigned char *data, size_t size)
+{
+    if (size < OBJ_HEADER_SIZE || data[4] != OBJ_VERSION)
+    {
+        sim_error(sim, SIM_ERR_LOAD, "Unsupported object file version.");
+        return FALSE;
+    }
+
+    if (data[5] != OBJ_ENDIAN_BIG || data[6] != CELL_BYTES)
+    {
+        sim_error(sim, SIM_ERR_LOAD, "Unsupported object file byte order or cell size.");
+        return FALSE;
+    }
+
+    int num_sections = data[7];
+    if (OBJ_HEADER_SIZE + num_sections * OBJ_SECTION_SIZE > size)
+    {
+        sim_error(sim, SIM_ERR_LOAD, "Object file is truncated.");
+        return FALSE;
+    }
+
+    unsigned char *symbols = NULL;
+    unsigned char *strings = NULL;
+    unsigned int strings_size = 0;
+    int num_symbols = 0;
+
+    for (int i = 0; i < num_sections; i++)
+    {
+        unsigned char *entry = data + OBJ_HEADER_SIZE + i * OBJ_SECTION_SIZE;
+        unsigned int type = read_be16(entry);
+        unsigned int offset = read_be32(entry + 4);
+        unsigned int len = read_be32(entry + 8);
+        unsigned int count = read_be32(entry + 12);
+
+        if (offset > size || len > size - offset)
+        {
+            sim_error(sim, SIM_ERR_LOAD, "Object file section %d is out of bounds.", i);
+            return FALSE;
+        }
+
+        switch (type)
+        {
+            case OBJ_SECT_IMAGE:
+                if (len > MEMSIZE)
+                {
+                    sim_error(sim, SIM_ERR_LOAD, "Object file image is too large.");
+                    return FALSE;
+                }
+                memcpy(sim->memory, data + offset, len);
+                break;
+
+            case OBJ_SECT_SYMBOLS:
+                symbols = data + offset;
+                num_symbols = len / OBJ_SYMBOL_SIZE;
+                break;
+
+            case OBJ_SECT_STRINGS:
+                strings = data + offset;
+                strings_size = len;
+                break;
+
+            case OBJ_SECT_DICT:
+                sim->dict = data + offset;
+                sim->num_dict = (count < len / OBJ_DICT_SIZE) ? count : len / OBJ_DICT_SIZE;
+                break;
+
+            case OBJ_SECT_LINES:
+                sim->lines = data + offset;
+                sim->num_lines = (count < len / OBJ_LINE_SIZE) ? count : len / OBJ_LINE_SIZE;
+                break;
+
+            default:
+                // Unknown sections are skipped, so newer files still load
+                break;
+        }
+    }
+
+    if (num_symbols == 0 || strings == NULL || strings_size == 0 || strings[strings_size - 1] != 0)
+    {
+        return TRUE;
+    }
+
+    // The records are big-endian, so they are converted into a SimSymbol
+    // table; the names are not copied, and point into the mapping
+    sim->symbols = malloc(num_symbols * sizeof(SimSymbol));
+    for (int i = 0; i < num_symbols; i++)
+    {
+        unsigned char *entry = symbols + i * OBJ_SYMBOL_SIZE;
+        unsigned int name = read_be32(entry + 4);
+        if (name >= strings_size)
+        {
+            continue;
+        }
+        sim->symbols[sim->num_symbols].location = read_be32(entry);
+        sim->symbols[sim->num_symbols].name = (char *)(strings + name);
+        sim->num_symbols++;
     }
 
+    return TRUE;
+}
+
+
+Simulator *new_simulator(void)
+{
+    // A VM with nothing loaded, reset and ready to run from address 0
     Simulator *sim = malloc(sizeof(Simulator));
-    sim->memory = malloc(MEMSIZE);
+    sim->memory = calloc(MEMSIZE, 1);
     sim->num_symbols = 0;
     sim->symbols = NULL;
+    sim->num_dict = 0;
+    sim->dict = NULL;
+    sim->num_lines = 0;
+    sim->lines = NULL;
+    sim->mapping = NULL;
+    sim->mapping_size = 0;
+    sim->mapping_copied = FALSE;
+    sim->shared_image = FALSE;
     sim->breakpoints = NULL;
+    sim->data_depth = 0;
     sim->data_stack = NULL;
     sim->return_stack = NULL;
     sim->call_stack = NULL;
+    sim->print_errors = FALSE;
+    sim->host_input = FALSE;
+    sim->input = NULL;
+    sim->input_len = 0;
+    sim->input_pos = 0;
+    sim->output = NULL;
+    memset(&sim->io, 0, sizeof(sim->io));
+    sim->io_len = 0;
+    sim->io_pos = 0;
+    sim->io_eof = FALSE;
+    sim->file_root = -1;
+    sim->blocks = NULL;
+    sim->reader = NULL;
+    memset(sim->tasks, 0, sizeof(sim->tasks));
+    sim->task = NULL;
+    sim->budget = SIM_NO_LIMIT;
+    sim->cores = NULL;
+    init_channels(sim);
+    sim->wait_channel = NULL;
+    for (int i = 0; i < SIM_MAX_FILES; i++)
+    {
+        sim->files[i].fd = -1;
+    }
+    register_standard_services(sim);
 
     sim_reset(sim);
+    return sim;
+}
 
-    unsigned short len;
-    fread(&len, sizeof(len), 1, file);
-    fread(sim->memory, sizeof(char), len, file);
 
-    fclose(file);
+bool load_object(Simulator *sim, unsigned char *data, size_t size)
+{
+    // Load a version 1 or 2 object; a version 2 object's symbol names,
+    // dictionary index and line map are used in place, so sim keeps data
+    bool ok;
+    if (size >= 4 && !memcmp(data, OBJ_MAGIC, 4))
+    {
+        ok = load_object_v2(sim, data, size);
+        sim->mapping = data;
+        sim->mapping_size = size;
+    }
+    else
+    {
+        ok = load_object_v1(sim, data, size);
+    }
+
+    return ok;
+}
+
+
+Simulator *sim_init(char *objfile)
+{
+    int fd = open(objfile, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Could not open object file: %s\n", objfile);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        printf("Could not read object file: %s\n", objfile);
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        printf("Could not map object file: %s\n", objfile);
+        return NULL;
+    }
+
+    Simulator *sim = new_simulator();
+    sim->print_errors = TRUE;
+
+    bool ok = load_object(sim, data, size);
+    if (sim->mapping == NULL)
+    {
+        munmap(data, size);
+    }
+
+    if (!ok)
+    {
+        printf("Could not load object file: %s\n", objfile);
+        sim_free(sim);
+        return NULL;
+    }
+
+    return sim;
+}
+
+
+Simulator *sim_load(const void *image, size_t size, int *error)
+{
+    // A VM loaded from an object file already in memory, which is copied, so
+    // the caller can let go of it. Errors are not printed; they are left in
+    // sim->error. Returns NULL with *error set if the image does not load.
+    unsigned char *data = malloc(size);
+    memcpy(data, image, size);
+
+    Simulator *sim = new_simulator();
+    bool ok = load_object(sim, data, size);
+    if (sim->mapping == NULL)
+    {
+        free(data);
+    }
+    else
+    {
+        sim->mapping_copied = TRUE;
+    }
+
+    if (!ok)
+    {
+        *error = SIM_ERR_LOAD;
+        sim_free(sim);
+        return NULL;
+    }
 
+    *error = SIM_OK;
     return sim;
 }
 
@@ -47,27 +337,54 @@ void sim_load_symbols(Simulator *sim, char *symname)
         return;
     }
 
-    int num = atoi(fgets(str, MAXCHAR, symfile));
-    sim->symbols = malloc(num * sizeof(SimSymbol));
-    while (fgets(str, MAXCHAR, symfile) != NULL)
+    if (fgets(str, MAXCHAR, symfile) == NULL)
     {
-        str[4] = '\0';
-        unsigned short loc = strtol(str, NULL, 16);
-        char *sym = str + 5;
-        char *pos = strchr(sym, '\n');
-        *pos = 0;
+        fclose(symfile);
+        return;
+    }
+
+    int num = atoi(str);
+    if (num <= 0)
+    {
+        fclose(symfile);
+        return;
+    }
+
+    sim->symbols = realloc(sim->symbols, (sim->num_symbols + num) * sizeof(SimSymbol));
+    while (num > 0 && fgets(str, MAXCHAR, symfile) != NULL)
+    {
+        char *pos = strchr(str, '\n');
+        if (pos != NULL)
+        {
+            *pos = 0;
+        }
+        else
+        {
+            // Name was too long for the buffer; keep what fit and skip the rest
+            int c;
+            while ((c = fgetc(symfile)) != '\n' && c != EOF)
+            {
+            }
+        }
 
-        SimSymbol *entry = malloc(sizeof(SimSymbol));
-        entry->name = my_strdup(sym);
-        entry->location = loc;
+        if (strlen(str) < 6)
+        {
+            continue;
+        }
 
-        sim->symbols[sim->num_symbols++] = entry;
+        str[4] = '\0';
+        SimSymbol *entry = &(sim->symbols[sim->num_symbols++]);
+        entry->location = strtol(str, NULL, 16);
+        entry->name = my_strdup(str + 5);
+        num -= 1;
     }
     fclose(symfile);
+
+    qsort(sim->symbols, sim->num_symbols, sizeof(SimSymbol), compare_sim_symbols);
 }
 
 
-bool sim_is_breakpoint(Simulator *sim, unsigned short addr)
+bool sim_is_breakpoint(Simulator *sim, Cell addr)
 {
     for (Breakpoint *bp = sim->breakpoints; bp != NULL; bp = bp->next)
     {
@@ -81,10 +398,33 @@ bool sim_is_breakpoint(Simulator *sim, unsigned short addr)
 }
 
 
+void timer_interrupt(Simulator *sim);
+
+
 void sim_run(Simulator *sim)
 {
+    sim->preempted = FALSE;
+
     while (!sim->halted)
     {
+        // The budget and the timer count down one per instruction, but not
+        // while they are SIM_NO_LIMIT (unused); a long enough run would
+        // otherwise count them down to zero
+        if (sim->budget != SIM_NO_LIMIT)
+        {
+            if (sim->budget == 0)
+            {
+                sim->preempted = TRUE;
+                return;
+            }
+            sim->budget--;
+        }
+
+        if (sim->timer_count != SIM_NO_LIMIT && --sim->timer_count == 0)
+        {
+            timer_interrupt(sim);
+        }
+
         sim_step_into(sim);
 
         if (sim->stopped)
@@ -93,17 +433,216 @@ void sim_run(Simulator *sim)
             return;
         }
 
+        if (sim->waiting)
+        {
+            return;
+        }
+
         if (sim_is_breakpoint(sim, sim->pc))
         {
             // TODO - add a "silent" flag (or temporary flag) so step-over doesn't print this message
-            printf("-> BREAK at 0x%04X.\n", sim->pc);
+            printf("-> BREAK at 0x" CELL_FMT ".\n", sim->pc);
             return;
         }
     }
 }
 
 
-unsigned short get_register(Simulator *sim, unsigned char reg)
+void sim_output(Simulator *sim, const char *str, size_t len)
+{
+    SimBuffer *out = sim->output;
+    if (out == NULL && sim->io.write != NULL)
+    {
+        sim->io.write(sim->io.context, str, len);
+        return;
+    }
+    if (out == NULL)
+    {
+        fwrite(str, 1, len, stdout);
+        return;
+    }
+
+    if (out->len + len + 1 > out->size)
+    {
+        out->size = (out->size == 0) ? 256 : out->size;
+        while (out->len + len + 1 > out->size)
+        {
+            out->size *= 2;
+        }
+        out->data = realloc(out->data, out->size);
+    }
+
+    memcpy(out->data + out->len, str, len);
+    out->len += len;
+    out->data[out->len] = 0;
+}
+
+
+bool fill_io_buffer(Simulator *sim, int *status)
+{
+    // Make sure there is input from the read callback to take; if there is
+    // none, *status is EOF or NO_INPUT
+    if (sim->io_pos < sim->io_len)
+    {
+        return TRUE;
+    }
+
+    long n = sim->io_eof ? 0 : sim->io.read(sim->io.context, sim->io_buffer, SIM_IO_BUFSIZE);
+    if (n <= 0)
+    {
+        sim->io_eof = (n == 0);
+        *status = (n == 0) ? EOF : NO_INPUT;
+        return FALSE;
+    }
+
+    sim->io_len = (n > SIM_IO_BUFSIZE) ? SIM_IO_BUFSIZE : n;
+    sim->io_pos = 0;
+    return TRUE;
+}
+
+
+bool io_line_ready(Simulator *sim, size_t size)
+{
+    // Is there a whole line (or size bytes, or the end of the input) from
+    // the read callback? If not, read more onto what is buffered until there
+    // is, or the callback has no more yet.
+    while (TRUE)
+    {
+        size_t available = sim->io_len - sim->io_pos;
+        if (sim->io_eof || available >= size || available == SIM_IO_BUFSIZE ||
+            memchr(sim->io_buffer + sim->io_pos, '\n', available) != NULL)
+        {
+            return TRUE;
+        }
+
+        memmove(sim->io_buffer, sim->io_buffer + sim->io_pos, available);
+        sim->io_len = available;
+        sim->io_pos = 0;
+
+        size_t space = SIM_IO_BUFSIZE - available;
+        long n = sim->io.read(sim->io.context, sim->io_buffer + available, space);
+        if (n < 0)
+        {
+            return FALSE;
+        }
+
+        sim->io_eof = (n == 0);
+        sim->io_len += ((size_t)n > space) ? space : (size_t)n;
+    }
+}
+
+
+void sim_set_io(Simulator *sim, const SimIO *io)
+{
+    // Use io's callbacks for output and (unless sim_eval is providing it)
+    // input; NULL callbacks fall back to stdio
+    sim->io = *io;
+    sim->io_len = 0;
+    sim->io_pos = 0;
+    sim->io_eof = FALSE;
+    sim->host_input = FALSE;
+}
+
+
+void sim_error(Simulator *sim, int code, const char *fmt, ...)
+{
+    // Halt with error code and its message, which the tools also print
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(sim->error_message, sizeof(sim->error_message), fmt, args);
+    va_end(args);
+
+    sim->error = code;
+    sim->halted = TRUE;
+
+    if (sim->print_errors)
+    {
+        printf("%s\n", sim->error_message);
+    }
+}
+
+
+int sim_getc(Simulator *sim)
+{
+    if (!sim->host_input)
+    {
+        if (sim->io.read != NULL)
+        {
+            int status;
+            if (!fill_io_buffer(sim, &status))
+            {
+                return status;
+            }
+            return (unsigned char)sim->io_buffer[sim->io_pos++];
+        }
+        if (sim->reader != NULL)
+        {
+            return reader_getc(sim->reader);
+        }
+        return getc(stdin);
+    }
+
+    if (sim->input_pos < sim->input_len)
+    {
+        return (unsigned char)sim->input[sim->input_pos++];
+    }
+
+    return NO_INPUT;
+}
+
+
+bool sim_key_ready(Simulator *sim)
+{
+    // Would reading a character go ahead without waiting?
+    if (sim->host_input)
+    {
+        return sim->input_pos < sim->input_len;
+    }
+
+    if (sim->io.read != NULL)
+    {
+        int status;
+        return fill_io_buffer(sim, &status) || status == EOF;
+    }
+
+    if (sim->reader != NULL)
+    {
+        return reader_available(sim->reader) > 0;
+    }
+
+    return TRUE;    // no way to tell with stdio, so just read
+}
+
+
+void wait_for_input(Simulator *sim)
+{
+    // Back up so the instruction runs again once there is more input
+    sim->pc = sim->last_pc;
+
+    if (!sim->host_input && sim->reader != NULL)
+    {
+        reader_note_wait(sim->reader);
+    }
+
+    // Let another task run meanwhile if there is one
+    if (!block_task(sim))
+    {
+        sim->waiting = TRUE;
+    }
+}
+
+
+void check_tos(Simulator *sim)
+{
+    // T only holds a value while the data stack is not empty
+    if (sim->data_depth == 0 && !sim->halted)
+    {
+        sim_error(sim, SIM_ERR_STACK, "Data stack underflow.");
+    }
+}
+
+
+Cell get_register(Simulator *sim, unsigned char reg)
 {
     switch (reg)
     {
@@ -149,15 +688,18 @@ unsigned short get_register(Simulator *sim, unsigned char reg)
         case REG_Z:
             return sim->z;
 
+        case REG_T:
+            check_tos(sim);
+            return sim->t;
+
         default:
-            printf("Illegal/unhandled register 0x%02X\n", reg);
-            sim->halted = TRUE;
+            sim_error(sim, SIM_ERR_ILLEGAL, "Illegal/unhandled register 0x%02X", reg);
             return 0;
     }
 }
 
 
-void set_register(Simulator *sim, unsigned char reg, unsigned short value)
+void set_register(Simulator *sim, unsigned char reg, Cell value)
 {
     switch (reg)
     {
@@ -217,66 +759,133 @@ void set_register(Simulator *sim, unsigned char reg, unsigned short value)
             sim->z = value;
             break;
 
+        case REG_T:
+            check_tos(sim);
+            sim->t = value;
+            break;
+
         default:
-            printf("Illegal/unhandled register 0x%02X\n", reg);
-            sim->halted = TRUE;
+            sim_error(sim, SIM_ERR_ILLEGAL, "Illegal/unhandled register 0x%02X", reg);
             break;
     }
 }
 
 
-unsigned short pop_data(Simulator *sim)
+Cell pop_data(Simulator *sim)
 {
-    if (sim->data_stack == NULL)
+    if (sim->data_depth == 0)
     {
-        printf("Data stack underflow.\n");
-        sim->halted = TRUE;
+        sim_error(sim, SIM_ERR_STACK, "Data stack underflow.");
         return 0;
     }
 
-    StackNode *node = sim->data_stack;
-    sim->data_stack = node->next;
-    unsigned short value = node->value;
-    free(node);
+    // The top is in T; refill T from the rest of the stack
+    Cell value = sim->t;
+    sim->data_depth -= 1;
+    if (sim->data_stack != NULL)
+    {
+        StackNode *node = sim->data_stack;
+        sim->data_stack = node->next;
+        sim->t = node->value;
+        free(node);
+    }
     return value;
 }
 
 
-unsigned short pop_return(Simulator *sim)
+void push_data(Simulator *sim, Cell value)
 {
-    if (sim->return_stack == NULL)
+    // Spill the old top (if any) and keep the new one in T
+    if (sim->data_depth > 0)
     {
-        printf("Return stack underflow.\n");
-        sim->halted = TRUE;
-        return 0;
+        StackNode *node = malloc(sizeof(StackNode));
+        node->value = sim->t;
+        node->next = sim->data_stack;
+        sim->data_stack = node;
+    }
+    sim->t = value;
+    sim->data_depth += 1;
+}
+
+
+void clear_data(Simulator *sim)
+{
+    while (sim->data_stack != NULL)
+    {
+        StackNode *node = sim->data_stack;
+        sim->data_stack = node->next;
+        free(node);
+    }
+    sim->data_depth = 0;
+}
+
+
+StackNode *sim_data_stack(Simulator *sim, StackNode *top)
+{
+    // Returns the whole logical data stack, using top to hold the cached T
+    if (sim->data_depth == 0)
+    {
+        return NULL;
+    }
+
+    top->value = sim->t;
+    top->next = sim->data_stack;
+    return top;
+}
+
+
+void sim_push(Simulator *sim, Cell value)
+{
+    push_data(sim, value);
+}
+
+
+bool sim_pop(Simulator *sim, Cell *value)
+{
+    // Take the top of the data stack, or return FALSE if it is empty
+    if (sim->data_depth == 0)
+    {
+        return FALSE;
+    }
+
+    *value = pop_data(sim);
+    return TRUE;
+}
+
+
+Cell pop_return(Simulator *sim)
+{
+    if (sim->return_stack == NULL)
+    {
+        sim_error(sim, SIM_ERR_STACK, "Return stack underflow.");
+        return 0;
     }
 
     StackNode *node = sim->return_stack;
     sim->return_stack = node->next;
-    unsigned short value = node->value;
+    Cell value = node->value;
     free(node);
     return value;
 }
 
 
-unsigned short pop_call(Simulator *sim)
+Cell pop_call(Simulator *sim)
 {
     if (sim->call_stack == NULL)
     {
-        printf("Call stack underflow.\n");
-        sim->halted = TRUE;
+        sim_error(sim, SIM_ERR_STACK, "Call stack underflow.");
         return 0;
     }
 
     StackNode *node = sim->call_stack;
     sim->call_stack = node->next;
-    unsigned short value = node->value;
+    Cell value = node->value;
     free(node);
     return value;
 }
 
 
-StackNode *push_value(Simulator *sim, unsigned short value, StackNode *next)
+StackNode *push_value(Simulator *sim, Cell value, StackNode *next)
 {
     StackNode *node = malloc(sizeof(StackNode));
     node->value = value;
@@ -292,48 +901,56 @@ StackNode *push_register(Simulator *sim, unsigned char reg, StackNode *next)
 }
 
 
-void sim_write_byte(Simulator *sim, unsigned short addr, unsigned short value)
+void sim_write_byte(Simulator *sim, Cell addr, Cell value)
 {
-    sim->memory[addr] = value & 0xFF;
+    sim->memory[addr & MEMMASK] = value & 0xFF;
 }
 
 
-void sim_write_word(Simulator *sim, unsigned short addr, unsigned short value)
+void sim_write_word(Simulator *sim, Cell addr, Cell value)
 {
-    sim->memory[addr] = value >> 8;         // hi byte
-    sim->memory[addr + 1] = value & 0xFF;   // lo byte
+    // Big-endian, high byte first
+    for (int i = CELL_BYTES - 1; i >= 0; i--)
+    {
+        sim->memory[(addr + i) & MEMMASK] = value & 0xFF;
+        value >>= 8;
+    }
 }
 
 
-unsigned short sim_read_byte(Simulator *sim, unsigned short addr)
+Cell sim_read_byte(Simulator *sim, Cell addr)
 {
-    return sim->memory[addr];
+    return sim->memory[addr & MEMMASK];
 }
 
 
-unsigned short sim_read_word(Simulator *sim, unsigned short addr)
+Cell sim_read_word(Simulator *sim, Cell addr)
 {
-    unsigned char hi_byte = sim->memory[addr];
-    unsigned char lo_byte = sim->memory[addr + 1];
+    Cell value = 0;
+    for (int i = 0; i < CELL_BYTES; i++)
+    {
+        value = (value << 8) | sim->memory[(addr + i) & MEMMASK];
+    }
 
-    return (hi_byte << 8) + lo_byte;
+    return value;
 }
 
 
-unsigned short consume_byte(Simulator *sim)
+Cell consume_byte(Simulator *sim)
 {
-    unsigned char byte = sim->memory[sim->pc++];
+    unsigned char byte = sim->memory[sim->pc & MEMMASK];
+    sim->pc += 1;
 
     return byte;
 }
 
 
-unsigned short consume_word(Simulator *sim)
+Cell consume_word(Simulator *sim)
 {
-    unsigned char hi_byte = sim->memory[sim->pc++];
-    unsigned char lo_byte = sim->memory[sim->pc++];
+    Cell value = sim_read_word(sim, sim->pc);
+    sim->pc += CELL_BYTES;
 
-    return (hi_byte << 8) + lo_byte;
+    return value;
 }
 
 
@@ -345,14 +962,14 @@ void execute_load(Simulator *sim, unsigned char mode, unsigned char code)
     switch (mode)
     {
         case ADDR_MODE0:    // LOAD a, b
-            reg1 = sim->memory[sim->pc++];
-            reg2 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
+            reg2 = consume_byte(sim);
             // TODO - disallow for byte opcode?
             set_register(sim, reg1, get_register(sim, reg2));
             break;
 
         case ADDR_MODE1:    // LOAD a, val
-            reg1 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
             if (code == OP_LDB)
             {
                 set_register(sim, reg1, consume_byte(sim));
@@ -364,8 +981,8 @@ void execute_load(Simulator *sim, unsigned char mode, unsigned char code)
             break;
 
         case ADDR_MODE2:    // LOAD a, (b)
-            reg1 = sim->memory[sim->pc++];
-            reg2 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
+            reg2 = consume_byte(sim);
             if (code == OP_LDB)
             {
                 set_register(sim, reg1, sim_read_byte(sim, get_register(sim, reg2)));
@@ -377,7 +994,7 @@ void execute_load(Simulator *sim, unsigned char mode, unsigned char code)
             break;
 
         case ADDR_MODE3:    // LOAD a, (addr)
-            reg1 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
             if (code == OP_LDB)
             {
                 set_register(sim, reg1, sim_read_byte(sim, consume_word(sim)));
@@ -399,20 +1016,19 @@ void execute_store(Simulator *sim, unsigned char mode, unsigned char code)
     switch (mode)
     {
         case ADDR_MODE0:    // STORE a, b
-            reg1 = sim->memory[sim->pc++];
-            reg2 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
+            reg2 = consume_byte(sim);
             // TODO - disallow for byte opcode?
             set_register(sim, reg2, get_register(sim, reg1));
             break;
 
         case ADDR_MODE1:    // STORE a, $N - invalid
-            printf("Unhandled STORE address mode: %d\n", mode);
-            sim->halted = TRUE;
+            sim_error(sim, SIM_ERR_ILLEGAL, "Unhandled STORE address mode: %d", mode);
             break;
 
         case ADDR_MODE2:    // STORE a, (b)
-            reg1 = sim->memory[sim->pc++];
-            reg2 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
+            reg2 = consume_byte(sim);
             if (code == OP_STB)
             {
                 sim_write_byte(sim, get_register(sim, reg2), get_register(sim, reg1));
@@ -424,10 +1040,10 @@ void execute_store(Simulator *sim, unsigned char mode, unsigned char code)
             break;
 
         case ADDR_MODE3:    // STORE a, (addr)
-            reg1 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
             if (code == OP_STB)
             {
-                sim_write_byte(sim, consume_byte(sim), get_register(sim, reg1));
+                sim_write_byte(sim, consume_word(sim), get_register(sim, reg1));
             }
             else
             {
@@ -438,279 +1054,1273 @@ void execute_store(Simulator *sim, unsigned char mode, unsigned char code)
 }
 
 
-unsigned short mul_operation(unsigned short a, unsigned short b)
+Cell mul_operation(Cell a, Cell b)
 {
     return a * b;
 }
 
 
-unsigned short add_operation(unsigned short a, unsigned short b)
+Cell add_operation(Cell a, Cell b)
 {
     return a + b;
 }
 
 
-unsigned short xor_operation(unsigned short a, unsigned short b)
+Cell xor_operation(Cell a, Cell b)
 {
     return a ^ b;
 }
 
 
-unsigned short or_operation(unsigned short a, unsigned short b)
+Cell or_operation(Cell a, Cell b)
 {
     return a | b;
 }
 
 
-unsigned short and_operation(unsigned short a, unsigned short b)
+Cell and_operation(Cell a, Cell b)
 {
     return a & b;
 }
 
 
-unsigned short sub_operation(unsigned short a, unsigned short b)
+Cell sub_operation(Cell a, Cell b)
 {
     return a - b;
 }
 
 
-void execute_arithmetic(Simulator *sim, unsigned char mode, unsigned short (*operation)(unsigned short a, unsigned short b))
+void execute_arithmetic(Simulator *sim, unsigned char mode, Cell (*operation)(Cell a, Cell b))
 {
     unsigned char reg1;
     unsigned char reg2;
-    unsigned short result;
+    Cell result;
 
     switch (mode)
     {
         case ADDR_MODE0:    // ADD a, b
-            reg1 = sim->memory[sim->pc++];
-            reg2 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
+            reg2 = consume_byte(sim);
             result = operation(get_register(sim, reg1), get_register(sim, reg2));
             break;
 
         case ADDR_MODE1:    // ADD a, val 
-            reg1 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
             result = operation(get_register(sim, reg1), consume_word(sim));
             break;
 
         case ADDR_MODE2:    // ADD a, (b)
-            reg1 = sim->memory[sim->pc++];
-            reg2 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
+            reg2 = consume_byte(sim);
             result = operation(get_register(sim, reg1), sim_read_word(sim, get_register(sim, reg2)));
             break;
 
         case ADDR_MODE3:    // ADD a, (addr)
-            reg1 = sim->memory[sim->pc++];
+            reg1 = consume_byte(sim);
             result = operation(get_register(sim, reg1), sim_read_word(sim, consume_word(sim)));
             break;
     }
 
-    set_register(sim, reg1, result);
+    set_register(sim, reg1, result);
+}
+
+
+void execute_div(Simulator *sim)
+{
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+    
+    Cell a = get_register(sim, reg1);
+    Cell b = get_register(sim, reg2);
+    if (b == 0)
+    {
+        sim_error(sim, SIM_ERR_DIVIDE, "Division by zero.");
+        return;
+    }
+
+    Cell quo = a / b;
+    Cell rem = a % b;
+
+    set_register(sim, reg1, quo);
+    set_register(sim, reg2, rem);
+}
+
+
+void execute_multiply_double(Simulator *sim, bool is_signed)
+{
+    // a * b as a double cell, with the high word in a and the low word in b
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+
+    Cell a = get_register(sim, reg1);
+    Cell b = get_register(sim, reg2);
+
+    DCell product;
+    if (is_signed)
+    {
+        product = (SDCell)(SCell)a * (SCell)b;
+    }
+    else
+    {
+        product = (DCell)a * b;
+    }
+
+    set_register(sim, reg1, product >> CELL_BITS);
+    set_register(sim, reg2, product & CELL_MASK);
+}
+
+
+void execute_divide_double(Simulator *sim, bool is_signed)
+{
+    // Divide the double cell a:b (high word in a) by c; the quotient goes in
+    // a and the remainder in b. Signed division rounds toward zero.
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+    unsigned char reg3 = consume_byte(sim);
+
+    DCell dividend = ((DCell)get_register(sim, reg1) << CELL_BITS) | get_register(sim, reg2);
+    Cell divisor = get_register(sim, reg3);
+
+    if (divisor == 0)
+    {
+        sim_error(sim, SIM_ERR_DIVIDE, "Division by zero.");
+        return;
+    }
+
+    Cell quo;
+    Cell rem;
+    if (is_signed && (SCell)divisor == -1)
+    {
+        // Done by hand, as the most negative double divided by -1 traps
+        quo = 0 - dividend;
+        rem = 0;
+    }
+    else if (is_signed)
+    {
+        quo = (SDCell)dividend / (SCell)divisor;
+        rem = (SDCell)dividend % (SCell)divisor;
+    }
+    else
+    {
+        quo = dividend / divisor;
+        rem = dividend % divisor;
+    }
+
+    set_register(sim, reg1, quo);
+    set_register(sim, reg2, rem);
+}
+
+
+void execute_dadd(Simulator *sim)
+{
+    // a:b += c:d, with the high words in a and c
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+    unsigned char reg3 = consume_byte(sim);
+    unsigned char reg4 = consume_byte(sim);
+
+    DCell a = ((DCell)get_register(sim, reg1) << CELL_BITS) | get_register(sim, reg2);
+    DCell b = ((DCell)get_register(sim, reg3) << CELL_BITS) | get_register(sim, reg4);
+    DCell sum = a + b;
+
+    set_register(sim, reg1, sum >> CELL_BITS);
+    set_register(sim, reg2, sum & CELL_MASK);
+}
+
+
+void do_compare(Simulator *sim, Cell val1, Cell val2)
+{
+    sim->flag_kind = FLAGS_COMPARE;
+    sim->flag_val1 = val1;
+    sim->flag_val2 = val2;
+}
+
+
+void set_result_flags(Simulator *sim, SCell result)
+{
+    sim->flag_kind = FLAGS_RESULT;
+    sim->flag_val1 = result;
+}
+
+
+Cell sim_flags(Simulator *sim)
+{
+    Cell val1 = sim->flag_val1;
+    Cell val2 = sim->flag_val2;
+
+    switch (sim->flag_kind)
+    {
+        case FLAGS_COMPARE:
+            break;
+
+        case FLAGS_RESULT:
+            // Flip the sign bit so the unsigned compare below orders signed values
+            val1 ^= CELL_SIGN;
+            val2 = CELL_SIGN;
+            break;
+
+        default:
+            return 0;
+    }
+
+    if (val1 == val2)
+    {
+        return FLAG_EQUAL;
+    }
+    return (val1 > val2) ? FLAG_GT : FLAG_LT;
+}
+
+
+unsigned int sim_clamp_length(Cell addr, Cell len)
+{
+    // Keep block operations inside the address space
+    unsigned int max = MEMSIZE - addr;
+    return (len > max) ? max : len;
+}
+
+
+void execute_cmps(Simulator *sim)
+{
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+    unsigned char reg3 = consume_byte(sim);
+
+    Cell addr1 = get_register(sim, reg1) & MEMMASK;
+    Cell addr2 = get_register(sim, reg2) & MEMMASK;
+    unsigned int len = get_register(sim, reg3);
+    len = sim_clamp_length(addr1, len);
+    len = sim_clamp_length(addr2, len);
+
+    int result = memcmp(sim->memory + addr1, sim->memory + addr2, len);
+
+    // Set the flags as if comparing the first differing bytes
+    set_result_flags(sim, (result > 0) - (result < 0));
+}
+
+
+void execute_scas(Simulator *sim)
+{
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+    unsigned char reg3 = consume_byte(sim);
+    unsigned char reg4 = consume_byte(sim);
+
+    Cell addr = get_register(sim, reg1) & MEMMASK;
+    unsigned int len = sim_clamp_length(addr, get_register(sim, reg2));
+    Cell needle = get_register(sim, reg3) & MEMMASK;
+    unsigned int needle_len = sim_clamp_length(needle, get_register(sim, reg4));
+
+    unsigned char *found = memmem(sim->memory + addr, len, sim->memory + needle, needle_len);
+    if (found == NULL)
+    {
+        set_result_flags(sim, -1);
+        return;
+    }
+
+    // Found - return the address of the match and the length remaining
+    Cell offset = found - (sim->memory + addr);
+    set_register(sim, reg1, addr + offset);
+    set_register(sim, reg2, len - offset);
+    set_result_flags(sim, 0);
+}
+
+
+// Cells in VM memory are big-endian; the atomic operations work on them in
+// place as host words, converting to and from memory order
+#ifdef CELL32
+typedef uint32_t AtomicCell;
+#define TO_MEMORY_ORDER(v)      htonl(v)
+#define FROM_MEMORY_ORDER(v)    ntohl(v)
+#else
+typedef uint16_t AtomicCell;
+#define TO_MEMORY_ORDER(v)      htons(v)
+#define FROM_MEMORY_ORDER(v)    ntohs(v)
+#endif
+
+
+AtomicCell *atomic_cell(Simulator *sim, Cell addr)
+{
+    // Atomic operations need an aligned cell, so the host can update it whole
+    if (addr % CELL_BYTES != 0)
+    {
+        sim_error(sim, SIM_ERR_ALIGN, "Unaligned atomic access to 0x" CELL_FMT " at 0x" CELL_FMT ".", addr, sim->last_pc);
+        return NULL;
+    }
+
+    return (AtomicCell *)(sim->memory + (addr & MEMMASK));
+}
+
+
+void execute_cas(Simulator *sim)
+{
+    // CAS addr, expected, new: if the cell at addr holds expected, store new.
+    // Either way expected gets the cell's old value, and the flags compare
+    // it with what was expected, so EQUAL means the store happened.
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+    unsigned char reg3 = consume_byte(sim);
+
+    AtomicCell *cell = atomic_cell(sim, get_register(sim, reg1));
+    if (cell == NULL)
+    {
+        return;
+    }
+
+    Cell expected = get_register(sim, reg2);
+    AtomicCell old = TO_MEMORY_ORDER(expected);
+    __atomic_compare_exchange_n(cell, &old, TO_MEMORY_ORDER(get_register(sim, reg3)), FALSE,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    Cell value = FROM_MEMORY_ORDER(old);
+    set_register(sim, reg2, value);
+    do_compare(sim, value, expected);
+}
+
+
+void execute_xadd(Simulator *sim)
+{
+    // XADD addr, n: add n to the cell at addr, leaving its old value in n.
+    // The cell is big-endian, so this is a compare-and-swap loop rather than
+    // a host fetch-and-add.
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+
+    AtomicCell *cell = atomic_cell(sim, get_register(sim, reg1));
+    if (cell == NULL)
+    {
+        return;
+    }
+
+    Cell n = get_register(sim, reg2);
+    AtomicCell old = __atomic_load_n(cell, __ATOMIC_RELAXED);
+    AtomicCell new;
+    do
+    {
+        new = TO_MEMORY_ORDER((Cell)(FROM_MEMORY_ORDER(old) + n));
+    } while (!__atomic_compare_exchange_n(cell, &old, new, TRUE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    set_register(sim, reg2, FROM_MEMORY_ORDER(old));
+}
+
+
+void execute_movs(Simulator *sim)
+{
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+    unsigned char reg3 = consume_byte(sim);
+
+    Cell src = get_register(sim, reg1) & MEMMASK;
+    Cell dst = get_register(sim, reg2) & MEMMASK;
+    unsigned int len = get_register(sim, reg3);
+    len = sim_clamp_length(src, len);
+    len = sim_clamp_length(dst, len);
+
+    // Overlapping ranges are copied as if through a temporary buffer
+    memmove(sim->memory + dst, sim->memory + src, len);
+}
+
+
+void execute_fils(Simulator *sim)
+{
+    unsigned char reg1 = consume_byte(sim);
+    unsigned char reg2 = consume_byte(sim);
+    unsigned char reg3 = consume_byte(sim);
+
+    Cell addr = get_register(sim, reg1) & MEMMASK;
+    unsigned int len = sim_clamp_length(addr, get_register(sim, reg2));
+
+    memset(sim->memory + addr, get_register(sim, reg3) & 0xFF, len);
+}
+
+
+void execute_token(Simulator *sim)
+{
+    // Parse the next blank-delimited token from an input source, skipping
+    // backslash comments. The source is described in memory by three cells:
+    // address, length and offset of the next character (>IN), which is updated.
+    unsigned char reg1 = consume_byte(sim);    // source address in, token address out
+    unsigned char reg2 = consume_byte(sim);    // token length out (0 = source exhausted)
+
+    Cell desc = get_register(sim, reg1);
+    Cell src = sim_read_word(sim, desc) & MEMMASK;
+    unsigned int len = sim_clamp_length(src, sim_read_word(sim, desc + CELL_BYTES));
+    unsigned int in = sim_read_word(sim, desc + 2 * CELL_BYTES);
+    unsigned char *mem = sim->memory + src;
+
+    while (in < len)
+    {
+        if (mem[in] == '\\')
+        {
+            while (in < len && mem[in] != '\n')
+            {
+                in++;
+            }
+        }
+        else if (mem[in] <= ' ')
+        {
+            in++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    unsigned int start = in;
+    while (in < len && mem[in] > ' ')
+    {
+        in++;
+    }
+    unsigned int end = in;
+
+    // Step over the delimiter
+    if (in < len)
+    {
+        in++;
+    }
+
+    sim_write_word(sim, desc + 2 * CELL_BYTES, in);
+    set_register(sim, reg1, src + start);
+    set_register(sim, reg2, end - start);
+}
+
+
+void execute_getl(Simulator *sim)
+{
+    // Read a line (without its newline) from the input into a buffer
+    unsigned char reg1 = consume_byte(sim);    // buffer address
+    unsigned char reg2 = consume_byte(sim);    // buffer size in, count out (-1 at end of input)
+
+    Cell addr = get_register(sim, reg1) & MEMMASK;
+    unsigned int size = sim_clamp_length(addr, get_register(sim, reg2));
+    unsigned char *mem = sim->memory + addr;
+    unsigned int len = 0;
+    int c = 0;
+
+    // Only take a line from the reader thread or the read callback once all
+    // of it has arrived
+    if (!sim->host_input && sim->io.read != NULL && !io_line_ready(sim, size))
+    {
+        wait_for_input(sim);
+        return;
+    }
+    if (!sim->host_input && sim->io.read == NULL && sim->reader != NULL && !reader_line_ready(sim->reader, size))
+    {
+        wait_for_input(sim);
+        return;
+    }
+
+    while (len < size)
+    {
+        c = sim_getc(sim);
+        if (c == EOF || c == NO_INPUT || c == '\n')
+        {
+            break;
+        }
+        mem[len++] = c;
+    }
+
+    // A partial line at the end of host-provided input counts as a line
+    if (c == NO_INPUT && len == 0)
+    {
+        wait_for_input(sim);
+        return;
+    }
+
+    if (c == EOF && len == 0)
+    {
+        set_register(sim, reg2, CELL_MASK);
+        return;
+    }
+
+    set_register(sim, reg2, len);
+}
+
+
+void execute_tonum(Simulator *sim)
+{
+    // Convert a string to a number in the given base. Returns the number and
+    // the count of unconverted characters (0 = success).
+    unsigned char reg1 = consume_byte(sim);    // string address in, number out
+    unsigned char reg2 = consume_byte(sim);    // length in, unconverted count out
+    unsigned char reg3 = consume_byte(sim);    // base
+
+    Cell addr = get_register(sim, reg1) & MEMMASK;
+    unsigned int len = sim_clamp_length(addr, get_register(sim, reg2));
+    Cell base = get_register(sim, reg3);
+    unsigned char *c = sim->memory + addr;
+    Cell value = 0;
+    bool negative = FALSE;
+
+    if (len > 0 && *c == '-')
+    {
+        negative = TRUE;
+        c++;
+        len--;
+        if (len == 0)
+        {
+            // Just a '-' is an error
+            set_register(sim, reg1, 0);
+            set_register(sim, reg2, 1);
+            return;
+        }
+    }
+
+    while (len > 0)
+    {
+        Cell digit;
+        if (*c >= '0' && *c <= '9')
+        {
+            digit = *c - '0';
+        }
+        else if (*c >= 'A' && *c <= 'Z')
+        {
+            digit = *c - 'A' + 10;
+        }
+        else
+        {
+            break;
+        }
+
+        if (digit >= base)
+        {
+            break;
+        }
+
+        value = value * base + digit;
+        c++;
+        len--;
+    }
+
+    set_register(sim, reg1, negative ? -value : value);
+    set_register(sim, reg2, len);
+}
+
+
+void execute_not(Simulator *sim)
+{
+    // TODO - support additional modes for unary opcodes?
+
+    unsigned char reg = consume_byte(sim);
+    Cell result = get_register(sim, reg);
+
+    result = ~result;
+
+    set_register(sim, reg, result);
+}
+
+
+void execute_cmp(Simulator *sim, unsigned char mode)
+{
+    unsigned char reg1;
+    unsigned char reg2;
+
+    switch (mode)
+    {
+        case ADDR_MODE0:    // CMP a, b
+            reg1 = consume_byte(sim);
+            reg2 = consume_byte(sim);
+            do_compare(sim, get_register(sim, reg1), get_register(sim, reg2));
+            break;
+
+        case ADDR_MODE1:    // CMP a, val 
+            reg1 = consume_byte(sim);
+            do_compare(sim, get_register(sim, reg1), consume_word(sim));
+            break;
+
+        case ADDR_MODE2:    // CMP a, (b)
+            reg1 = consume_byte(sim);
+            reg2 = consume_byte(sim);
+            do_compare(sim, get_register(sim, reg1), sim_read_word(sim, get_register(sim, reg2)));
+            break;
+
+        case ADDR_MODE3:    // CMP a, (addr)
+            reg1 = consume_byte(sim);
+            do_compare(sim, get_register(sim, reg1), sim_read_word(sim, consume_word(sim)));
+            break;
+    }
+}
+
+
+bool condition_always(Simulator *sim)
+{
+    return TRUE;
+}
+
+
+bool condition_equal(Simulator *sim)
+{
+    return (sim_flags(sim) & FLAG_EQUAL) == FLAG_EQUAL;
+}
+
+
+bool condition_not_equal(Simulator *sim)
+{
+    return (sim_flags(sim) & FLAG_EQUAL) == 0;
+}
+
+
+bool condition_gt(Simulator *sim)
+{
+    return (sim_flags(sim) & FLAG_GT) == FLAG_GT;
+}
+
+
+bool condition_lt(Simulator *sim)
+{
+    return (sim_flags(sim) & FLAG_LT) == FLAG_LT;
+}
+
+
+bool condition_ge(Simulator *sim)
+{
+    return (sim_flags(sim) & (FLAG_GT | FLAG_EQUAL)) != 0;
+}
+
+
+bool condition_le(Simulator *sim)
+{
+    return (sim_flags(sim) & (FLAG_LT | FLAG_EQUAL)) != 0;
+}
+
+
+void execute_jump(Simulator *sim, unsigned char mode, bool (*condition)(Simulator *sim))
+{
+    unsigned char reg;
+    Cell addr;
+    Cell newpc;
+
+    switch (mode)
+    {
+        case ADDR_MODE0:    // JMP a
+            reg = consume_byte(sim);
+            newpc = get_register(sim, reg);
+            break;
+
+        case ADDR_MODE1:    // JMP addr
+            newpc = consume_word(sim);
+            break;
+
+        case ADDR_MODE2:    // JMP (a)
+            reg = consume_byte(sim);
+            newpc = sim_read_word(sim, get_register(sim, reg));
+            break;
+
+        case ADDR_MODE3:    // JMP (addr)
+            addr = consume_word(sim);
+            newpc = sim_read_word(sim, addr);
+            break;
+    }
+
+    // Only jump if the condition has been met; can't do this up top, need to
+    // update the PC by parsing the modes if we don't jump
+    if (condition(sim))
+    {
+        sim->pc = newpc;
+    }
+}
+
+
+bool test_equal(Cell val1, Cell val2)
+{
+    return val1 == val2;
+}
+
+
+bool test_not_equal(Cell val1, Cell val2)
+{
+    return val1 != val2;
+}
+
+
+bool test_gt(Cell val1, Cell val2)
+{
+    return val1 > val2;
+}
+
+
+bool test_lt(Cell val1, Cell val2)
+{
+    return val1 < val2;
+}
+
+
+bool test_ge(Cell val1, Cell val2)
+{
+    return val1 >= val2;
+}
+
+
+bool test_le(Cell val1, Cell val2)
+{
+    return val1 <= val2;
+}
+
+
+void execute_branch(Simulator *sim, unsigned char mode, bool (*test)(Cell val1, Cell val2))
+{
+    // Compare and jump in one go; the flags are left alone
+    unsigned char reg1 = consume_byte(sim);
+    Cell val1 = get_register(sim, reg1);
+    Cell val2;
+
+    if (mode == ADDR_MODE1)     // Bcc a, val, addr
+    {
+        val2 = consume_word(sim);
+    }
+    else                        // Bcc a, b, addr
+    {
+        unsigned char reg2 = consume_byte(sim);
+        val2 = get_register(sim, reg2);
+    }
+
+    Cell newpc = consume_word(sim);
+    if (test(val1, val2))
+    {
+        sim->pc = newpc;
+    }
+}
+
+
+void execute_brz(Simulator *sim)
+{
+    // Pop the data stack; if it was zero, add the offset the register
+    // points at to the register, otherwise just step it past the offset
+    unsigned char reg = consume_byte(sim);
+    Cell ptr = get_register(sim, reg);
+
+    if (pop_data(sim) == 0)
+    {
+        set_register(sim, reg, ptr + sim_read_word(sim, ptr));
+    }
+    else
+    {
+        set_register(sim, reg, ptr + CELL_BYTES);
+    }
+}
+
+
+void execute_rpick(Simulator *sim, unsigned char mode)
+{
+    // Copy item n of the return stack (0 is the top) into a register
+    unsigned char reg1 = consume_byte(sim);
+    Cell n;
+
+    if (mode == ADDR_MODE1)     // RPICK a, val
+    {
+        n = consume_word(sim);
+    }
+    else                        // RPICK a, b
+    {
+        unsigned char reg2 = consume_byte(sim);
+        n = get_register(sim, reg2);
+    }
+
+    StackNode *node = sim->return_stack;
+    while (node != NULL && n > 0)
+    {
+        node = node->next;
+        n -= 1;
+    }
+
+    if (node == NULL)
+    {
+        sim_error(sim, SIM_ERR_STACK, "Return stack underflow.");
+        return;
+    }
+
+    set_register(sim, reg1, node->value);
+}
+
+
+void execute_rloop(Simulator *sim, unsigned char mode)
+{
+    // Step the loop frame on top of the return stack (index, limit, leave
+    // address) and either branch back by the offset the pointer register
+    // points at, or drop the frame and step the pointer past the offset
+    unsigned char reg1 = consume_byte(sim);
+    Cell step;
+
+    if (mode == ADDR_MODE1)     // RLOOP a, val
+    {
+        step = consume_word(sim);
+    }
+    else                        // RLOOP a, b
+    {
+        unsigned char reg2 = consume_byte(sim);
+        step = get_register(sim, reg2);
+    }
+
+    StackNode *index = sim->return_stack;
+    if (index == NULL || index->next == NULL || index->next->next == NULL)
+    {
+        sim_error(sim, SIM_ERR_STACK, "Return stack underflow.");
+        return;
+    }
+
+    // The loop ends when the index crosses the boundary between limit-1 and
+    // limit, which is when index-limit overflows as a signed number
+    SCell diff = index->value - index->next->value;
+    SCell next = diff + step;
+    index->value += step;
+
+    Cell ptr = get_register(sim, reg1);
+    if (((diff ^ next) & (diff ^ (SCell)step)) < 0)
+    {
+        pop_return(sim);
+        pop_return(sim);
+        pop_return(sim);
+        set_register(sim, reg1, ptr + CELL_BYTES);
+    }
+    else
+    {
+        set_register(sim, reg1, ptr + sim_read_word(sim, ptr));
+    }
+}
+
+
+void print_stack_minion(Simulator *sim, char *buf, StackNode *node, Cell base)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+
+    print_stack_minion(sim, buf, node->next, base);
+
+    my_itoa((SCell)node->value, buf, base);
+    strcat(buf, " ");
+
+    sim_output(sim, buf, strlen(buf));
+}
+
+
+void print_stack(Simulator *sim, StackNode *top, Cell base)
+{
+    // Print the stack
+    char buf[MAXCHAR];
+
+    if (top == NULL)
+    {
+        sim_output(sim, "[empty]\n", 8);
+        return;
+    }
+
+    print_stack_minion(sim, buf, top, base);
+
+    sim_output(sim, "\n", 1);
+}
+
+
+void print_number(Simulator *sim, SCell num, Cell base)
+{
+    char buf[MAXCHAR];
+    my_itoa(num, buf, base);
+    sim_output(sim, buf, strlen(buf));
+}
+
+
+void service_emit(Simulator *sim)
+{
+    // Print the character in A
+    char ch = sim->a;
+    sim_output(sim, &ch, 1);
+}
+
+
+void service_key(Simulator *sim)
+{
+    // Read a character into A (-1 at end of input)
+    int c = sim_getc(sim);
+    if (c == NO_INPUT)
+    {
+        wait_for_input(sim);
+        return;
+    }
+    sim->a = c;
+}
+
+
+void service_key_ready(Simulator *sim)
+{
+    // A = non-zero if a character can be read without waiting
+    sim->a = sim_key_ready(sim);
+}
+
+
+void service_write(Simulator *sim)
+{
+    // Write B bytes starting at A; A = the number written
+    Cell addr = sim->a & MEMMASK;
+    unsigned int len = sim_clamp_length(addr, sim->b);
+    sim_output(sim, (char *)(sim->memory + addr), len);
+    sim->a = len;
+}
+
+
+void service_read(Simulator *sim)
+{
+    // Read up to B bytes into A, stopping after a newline; A = the number
+    // read, or -1 at end of input
+    Cell addr = sim->a & MEMMASK;
+    unsigned int size = sim_clamp_length(addr, sim->b);
+    unsigned char *mem = sim->memory + addr;
+    unsigned int len = 0;
+    int c = 0;
+
+    while (len < size)
+    {
+        c = sim_getc(sim);
+        if (c == EOF || c == NO_INPUT)
+        {
+            break;
+        }
+        mem[len++] = c;
+        if (c == '\n')
+        {
+            break;
+        }
+    }
+
+    if (c == NO_INPUT && len == 0)
+    {
+        wait_for_input(sim);
+        return;
+    }
+
+    sim->a = (c == EOF && len == 0) ? CELL_MASK : len;
 }
 
 
-void execute_div(Simulator *sim)
+void service_putn(Simulator *sim)
 {
-    unsigned char reg1 = sim->memory[sim->pc++];
-    unsigned char reg2 = sim->memory[sim->pc++];
-    
-    unsigned short a = get_register(sim, reg1);
-    unsigned short b = get_register(sim, reg2);
+    // Print the number in A using the base in B
+    print_number(sim, sim->a, sim->b);
+}
 
-    unsigned short quo = a / b;
-    unsigned short rem = a % b;
 
-    set_register(sim, reg1, quo);
-    set_register(sim, reg2, rem);
+void service_pstack(Simulator *sim)
+{
+    // Print the data stack using the base in A
+    StackNode top;
+    print_stack(sim, sim_data_stack(sim, &top), sim->a);
 }
 
 
-void do_compare(Simulator *sim, unsigned short val1, unsigned short val2)
+void service_prstack(Simulator *sim)
 {
-    unsigned char equal = (val1 == val2) ? FLAG_EQUAL : 0;
-    unsigned char gt = (val1 > val2) ? FLAG_GT : 0;
-    unsigned char lt = (val1 < val2) ? FLAG_LT : 0;
+    // Print the return stack using the base in A
+    print_stack(sim, sim->return_stack, sim->a);
+}
+
 
-    sim->flags = equal | gt | lt;
+void service_clock(Simulator *sim)
+{
+    // A:B = milliseconds since an arbitrary starting point, as a double
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    DCell ms = (DCell)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    sim->a = ms >> CELL_BITS;
+    sim->b = ms & CELL_MASK;
 }
 
 
-void execute_not(Simulator *sim)
+void service_exit(Simulator *sim)
 {
-    // TODO - support additional modes for unary opcodes?
+    // Halt, leaving the exit code in A for the host
+    sim->exit_code = (SCell)sim->a;
+    sim->halted = TRUE;
+}
 
-    unsigned char reg = sim->memory[sim->pc++];
-    unsigned short result = get_register(sim, reg);
 
-    result = ~result;
+void service_return(Simulator *sim)
+{
+    // The word sim_call ran has returned; give control back to the host
+    sim->returned = TRUE;
+    sim->stopped = TRUE;
+}
 
-    set_register(sim, reg, result);
+
+#define NUM_INTERRUPT_REGISTERS 16
+
+void interrupt_registers(Simulator *sim, Cell *regs[])
+{
+    // The registers an interrupt saves; T and the stacks are left to the
+    // handler, which must leave them as it found them
+    Cell *all[] = { &sim->pc, &sim->ip, &sim->ca, &sim->a, &sim->b, &sim->c, &sim->d,
+                    &sim->i, &sim->j, &sim->m, &sim->n, &sim->x, &sim->y, &sim->z,
+                    &sim->flag_val1, &sim->flag_val2 };
+    memcpy(regs, all, sizeof(all));
 }
 
 
-void execute_cmp(Simulator *sim, unsigned char mode)
+void timer_interrupt(Simulator *sim)
 {
-    unsigned char reg1;
-    unsigned char reg2;
+    // Save the registers and flags on the call stack and enter the handler
+    sim->timer_count = sim->timer_period;
+    if (sim->in_interrupt)
+    {
+        return;
+    }
 
-    switch (mode)
+    Cell *regs[NUM_INTERRUPT_REGISTERS];
+    interrupt_registers(sim, regs);
+    for (int i = 0; i < NUM_INTERRUPT_REGISTERS; i++)
     {
-        case ADDR_MODE0:    // CMP a, b
-            reg1 = sim->memory[sim->pc++];
-            reg2 = sim->memory[sim->pc++];
-            do_compare(sim, get_register(sim, reg1), get_register(sim, reg2));
-            break;
+        sim->call_stack = push_value(sim, *regs[i], sim->call_stack);
+    }
+    sim->call_stack = push_value(sim, sim->flag_kind, sim->call_stack);
 
-        case ADDR_MODE1:    // CMP a, val 
-            reg1 = sim->memory[sim->pc++];
-            do_compare(sim, get_register(sim, reg1), consume_word(sim));
-            break;
+    sim->in_interrupt = TRUE;
+    sim->pc = sim->timer_vector;
+}
 
-        case ADDR_MODE2:    // CMP a, (b)
-            reg1 = sim->memory[sim->pc++];
-            reg2 = sim->memory[sim->pc++];
-            do_compare(sim, get_register(sim, reg1), sim_read_word(sim, get_register(sim, reg2)));
-            break;
 
-        case ADDR_MODE3:    // CMP a, (addr)
-            reg1 = sim->memory[sim->pc++];
-            do_compare(sim, get_register(sim, reg1), sim_read_word(sim, consume_word(sim)));
-            break;
+void execute_reti(Simulator *sim)
+{
+    // Return from the handler to where the interrupt came
+    if (!sim->in_interrupt)
+    {
+        sim_error(sim, SIM_ERR_ILLEGAL, "RETI outside an interrupt at 0x" CELL_FMT ".", sim->last_pc);
+        return;
     }
-}
 
+    sim->flag_kind = pop_call(sim);
 
-bool condition_always(Simulator *sim)
-{
-    return TRUE;
+    Cell *regs[NUM_INTERRUPT_REGISTERS];
+    interrupt_registers(sim, regs);
+    for (int i = NUM_INTERRUPT_REGISTERS - 1; i >= 0; i--)
+    {
+        *regs[i] = pop_call(sim);
+    }
+
+    sim->in_interrupt = FALSE;
 }
 
 
-bool condition_equal(Simulator *sim)
+void service_timer(Simulator *sim)
 {
-    return (sim->flags & FLAG_EQUAL) == FLAG_EQUAL;
+    // Interrupt to A every B instructions, or turn the timer off if B is 0
+    sim->timer_vector = sim->a;
+    sim->timer_period = sim->b;
+    sim->timer_count = (sim->b == 0) ? SIM_NO_LIMIT : sim->b;
 }
 
 
-bool condition_not_equal(Simulator *sim)
+void register_standard_services(Simulator *sim)
 {
-    return (sim->flags & FLAG_EQUAL) == 0;
+    for (int i = 0; i < SIM_MAX_SERVICES; i++)
+    {
+        sim->services[i] = NULL;
+    }
+
+    sim_register_service(sim, SYS_EMIT, service_emit);
+    sim_register_service(sim, SYS_KEY, service_key);
+    sim_register_service(sim, SYS_KEYQ, service_key_ready);
+    sim_register_service(sim, SYS_WRITE, service_write);
+    sim_register_service(sim, SYS_READ, service_read);
+    sim_register_service(sim, SYS_PUTN, service_putn);
+    sim_register_service(sim, SYS_PSTACK, service_pstack);
+    sim_register_service(sim, SYS_PRSTACK, service_prstack);
+    sim_register_service(sim, SYS_CLOCK, service_clock);
+    sim_register_service(sim, SYS_EXIT, service_exit);
+    sim_register_service(sim, SYS_TIMER, service_timer);
+    sim_register_service(sim, SYS_RETURN, service_return);
+    register_file_services(sim);
+    register_block_services(sim);
+    register_task_services(sim);
+    register_core_services(sim);
+    register_channel_services(sim);
 }
 
 
-bool condition_gt(Simulator *sim)
+Simulator *sim_init_core(Simulator *sim)
 {
-    return (sim->flags & FLAG_GT) == FLAG_GT;
+    // A VM sharing sim's memory, loaded image and services, with registers,
+    // stacks and tasks of its own. It cannot read input and has no block file.
+    Simulator *core = malloc(sizeof(Simulator));
+    *core = *sim;
+
+    core->breakpoints = NULL;
+    core->data_depth = 0;
+    core->data_stack = NULL;
+    core->return_stack = NULL;
+    core->call_stack = NULL;
+    core->host_input = TRUE;
+    core->input = NULL;
+    core->input_len = 0;
+    core->input_pos = 0;
+    core->output = NULL;
+    core->io_len = 0;
+    core->io_pos = 0;
+    core->io_eof = FALSE;
+    core->file_root = (sim->file_root < 0) ? -1 : dup(sim->file_root);
+    core->blocks = NULL;
+    core->reader = NULL;
+    memset(core->tasks, 0, sizeof(core->tasks));
+    core->task = NULL;
+    core->budget = SIM_NO_LIMIT;
+    core->shared_image = TRUE;
+    retain_channels(core);
+    for (int i = 0; i < SIM_MAX_FILES; i++)
+    {
+        core->files[i].fd = -1;
+    }
+
+    sim_reset(core);
+    return core;
 }
 
 
-bool condition_lt(Simulator *sim)
+void sim_free_core(Simulator *core)
 {
-    return (sim->flags & FLAG_LT) == FLAG_LT;
+    // Free a core from sim_init_core; the memory and image stay with the VM
+    sim_reset(core);
+    if (core->file_root >= 0)
+    {
+        close(core->file_root);
+    }
+    release_channels(core);
+    free(core);
 }
 
 
-bool condition_ge(Simulator *sim)
+StackNode *copy_stack(StackNode *node)
 {
-    return ((sim->flags & FLAG_GT) == FLAG_GT) || ((sim->flags & FLAG_EQUAL) == FLAG_EQUAL);
+    StackNode *top = NULL;
+    StackNode **link = &top;
+    for (; node != NULL; node = node->next)
+    {
+        *link = malloc(sizeof(StackNode));
+        (*link)->value = node->value;
+        link = &(*link)->next;
+    }
+    *link = NULL;
+    return top;
 }
 
 
-bool condition_le(Simulator *sim)
+Simulator *sim_clone(Simulator *sim)
 {
-    return ((sim->flags & FLAG_LT) == FLAG_LT) || ((sim->flags & FLAG_EQUAL) == FLAG_EQUAL);
+    // An independent VM starting from where sim is now: a copy of its memory
+    // and of the running task's registers and stacks. It shares the loaded
+    // image, so sim must outlive it, and has no files, blocks, cores or
+    // channels of its own yet.
+    Simulator *clone = malloc(sizeof(Simulator));
+    *clone = *sim;
+
+    clone->memory = malloc(MEMSIZE);
+    memcpy(clone->memory, sim->memory, MEMSIZE);
+    clone->shared_image = TRUE;
+    clone->breakpoints = NULL;
+    clone->data_stack = copy_stack(sim->data_stack);
+    clone->return_stack = copy_stack(sim->return_stack);
+    clone->call_stack = copy_stack(sim->call_stack);
+    clone->input = NULL;
+    clone->input_len = 0;
+    clone->input_pos = 0;
+    clone->output = NULL;
+    clone->io_len = 0;
+    clone->io_pos = 0;
+    clone->io_eof = FALSE;
+    clone->file_root = (sim->file_root < 0) ? -1 : dup(sim->file_root);
+    for (int i = 0; i < SIM_MAX_FILES; i++)
+    {
+        clone->files[i].fd = -1;
+    }
+    clone->blocks = NULL;
+    clone->reader = NULL;
+    clone->cores = NULL;
+    init_channels(clone);
+    clone->wait_channel = NULL;
+
+    // Only the running task comes along
+    memset(clone->tasks, 0, sizeof(clone->tasks));
+    clone->task = NULL;
+    reset_tasks(clone);
+
+    return clone;
 }
 
 
-void execute_jump(Simulator *sim, unsigned char mode, bool (*condition)(Simulator *sim))
+void sim_free(Simulator *sim)
 {
-    unsigned char reg;
-    unsigned short addr;
-    unsigned short newpc;
-
-    switch (mode)
+    // Free a VM from sim_init, sim_load or sim_clone, once any cores it spawned
+    // are joined. Its reader thread, if any, is stopped.
+    sim_reset(sim);
+    sim_stop_reader(sim);
+    sim_close_blocks(sim);
+    if (sim->file_root >= 0)
     {
-        case ADDR_MODE0:    // JMP a
-            reg = sim->memory[sim->pc++];
-            newpc = get_register(sim, reg);
-            break;
-
-        case ADDR_MODE1:    // JMP addr
-            newpc = consume_word(sim);
-            break;
-
-        case ADDR_MODE2:    // JMP (a)
-            reg = sim->memory[sim->pc++];
-            newpc = sim_read_word(sim, get_register(sim, reg));
-            break;
+        close(sim->file_root);
+    }
+    release_channels(sim);
+    free(sim->cores);
 
-        case ADDR_MODE3:    // JMP (addr)
-            addr = consume_word(sim);
-            newpc = sim_read_word(sim, addr);
-            break;
+    while (sim->breakpoints != NULL)
+    {
+        Breakpoint *bp = sim->breakpoints;
+        sim->breakpoints = bp->next;
+        free(bp);
     }
 
-    // Only jump if the condition has been met; can't do this up top, need to
-    // update the PC by parsing the modes if we don't jump
-    if (condition(sim))
+    if (!sim->shared_image)
     {
-        sim->pc = newpc;
+        free(sim->symbols);
+        if (sim->mapping_copied)
+        {
+            free(sim->mapping);
+        }
+        else if (sim->mapping != NULL)
+        {
+            munmap(sim->mapping, sim->mapping_size);
+        }
     }
+
+    free(sim->memory);
+    free(sim);
 }
 
 
-void print_stack_minion(char *buf, StackNode *node, unsigned short base)
+bool sim_register_service(Simulator *sim, Cell num, SimService service)
 {
-    if (node == NULL)
+    // Install (or, with NULL, remove) the handler for SYS num
+    if (num >= SIM_MAX_SERVICES)
     {
-        return;
+        return FALSE;
     }
 
-    print_stack_minion(buf, node->next, base);
-
-    my_itoa((short)node->value, buf, base);
-
-    fputs(buf, stdout);
-    fputc(' ', stdout);
+    sim->services[num] = service;
+    return TRUE;
 }
 
 
-void print_stack(StackNode *top, unsigned short base)
+void execute_sys(Simulator *sim)
 {
-    // Print the stack
-    char buf[MAXCHAR];
-
-    if (top == NULL)
+    // Call a host service; it takes its arguments and leaves its results in registers
+    Cell num = consume_word(sim);
+    SimService service = (num < SIM_MAX_SERVICES) ? sim->services[num] : NULL;
+    if (service == NULL)
     {
-        fputs("[empty]\n", stdout);
+        sim_error(sim, SIM_ERR_SERVICE, "Unknown system service 0x" CELL_FMT " at 0x" CELL_FMT ".", num, sim->last_pc);
         return;
     }
 
-    print_stack_minion(buf, top, base);
-
-    fputs("\n", stdout);
-}
-
-
-void print_number(Simulator *sim, short num, unsigned short base)
-{
-    char buf[MAXCHAR];
-    my_itoa(num, buf, base);
-    fputs(buf, stdout);
+    service(sim);
 }
 
 
 void sim_step_over(Simulator *sim)
 {
     // If the current statement is not a call, just step into
-    if (sim->memory[sim->pc] != OP_CALL)
+    if (sim_read_byte(sim, sim->pc) != OP_CALL)
     {
         sim_step_into(sim);
         return;
     }
 
     // It is a call; set a breakpoint on the next statement
-    unsigned short addr = sim->pc + 3;
+    Cell addr = sim->pc + 1 + CELL_BYTES;
     bool exists = sim_is_breakpoint(sim, addr);
     if (!exists)
     {
@@ -730,17 +2340,18 @@ void sim_step_into(Simulator *sim)
 {
     if (sim->halted)
     {
-        printf("CPU is in halt state.\n");
+        if (sim->print_errors)
+        {
+            printf("CPU is in halt state.\n");
+        }
         return;
     }
 
     sim->last_pc = sim->pc;
 
-    unsigned char opcode = sim->memory[sim->pc++];
+    unsigned char opcode = consume_byte(sim);
     unsigned char reg;
-    unsigned char reg1;
-    unsigned char reg2;
-    unsigned short addr;
+    Cell addr;
 
     unsigned char code = opcode & ~0x03;
     unsigned char mode = opcode & 0x03;
@@ -751,8 +2362,7 @@ void sim_step_into(Simulator *sim)
             break;
 
         case OP_HLT:
-            printf("HLT at 0x%04X\n", sim->last_pc);
-            sim->halted = TRUE;
+            sim_error(sim, SIM_ERR_HLT, "HLT at 0x" CELL_FMT, sim->last_pc);
             sim->pc--;
             break;
 
@@ -784,6 +2394,34 @@ void sim_step_into(Simulator *sim)
             execute_jump(sim, mode, condition_le);
             break;
 
+        case OP_BEQ:
+            execute_branch(sim, mode, test_equal);
+            break;
+
+        case OP_BRZ:
+            execute_brz(sim);
+            break;
+
+        case OP_BNE:
+            execute_branch(sim, mode, test_not_equal);
+            break;
+
+        case OP_BGT:
+            execute_branch(sim, mode, test_gt);
+            break;
+
+        case OP_BLT:
+            execute_branch(sim, mode, test_lt);
+            break;
+
+        case OP_BGE:
+            execute_branch(sim, mode, test_ge);
+            break;
+
+        case OP_BLE:
+            execute_branch(sim, mode, test_le);
+            break;
+
         case OP_LDW:
         case OP_LDB:
             execute_load(sim, mode, code);
@@ -821,80 +2459,129 @@ void sim_step_into(Simulator *sim)
             execute_div(sim);
             break;
 
+        case OP_UMUL:
+            execute_multiply_double(sim, FALSE);
+            break;
+
+        case OP_MMUL:
+            execute_multiply_double(sim, TRUE);
+            break;
+
+        case OP_UDIV:
+            execute_divide_double(sim, FALSE);
+            break;
+
+        case OP_SDIV:
+            execute_divide_double(sim, TRUE);
+            break;
+
+        case OP_DADD:
+            execute_dadd(sim);
+            break;
+
         case OP_CMP:
             execute_cmp(sim, mode);
             break;
 
+        case OP_CMPS:
+            execute_cmps(sim);
+            break;
+
+        case OP_SCAS:
+            execute_scas(sim);
+            break;
+
+        case OP_MOVS:
+            execute_movs(sim);
+            break;
+
+        case OP_FILS:
+            execute_fils(sim);
+            break;
+
+        case OP_TOKEN:
+            execute_token(sim);
+            break;
+
+        case OP_TONUM:
+            execute_tonum(sim);
+            break;
+
+        case OP_GETL:
+            execute_getl(sim);
+            break;
+
         case OP_STW:
         case OP_STB:
             execute_store(sim, mode, code);
             break;
 
         case OP_DPUSH:
-            reg = sim->memory[sim->pc++];
-            sim->data_stack = push_register(sim, reg, sim->data_stack);
+            reg = consume_byte(sim);
+            push_data(sim, get_register(sim, reg));
             break;
 
         case OP_RPUSH:
-            reg = sim->memory[sim->pc++];
+            reg = consume_byte(sim);
             sim->return_stack = push_register(sim, reg, sim->return_stack);
             break;
 
         case OP_DPOP:
-            reg = sim->memory[sim->pc++];
+            reg = consume_byte(sim);
             set_register(sim, reg, pop_data(sim));
             break;
 
         case OP_RPOP:
-            reg = sim->memory[sim->pc++];
+            reg = consume_byte(sim);
             set_register(sim, reg, pop_return(sim));
             break;
 
+        case OP_RPICK:
+            execute_rpick(sim, mode);
+            break;
+
+        case OP_RLOOP:
+            execute_rloop(sim, mode);
+            break;
+
         case OP_INC:
-            reg = sim->memory[sim->pc++];
+            reg = consume_byte(sim);
             set_register(sim, reg, get_register(sim, reg) + 1);
             break;
 
         case OP_DEC:
-            reg = sim->memory[sim->pc++];
+            reg = consume_byte(sim);
             set_register(sim, reg, get_register(sim, reg) - 1);
             break;
 
         case OP_NEG:
-            reg = sim->memory[sim->pc++];
+            reg = consume_byte(sim);
             set_register(sim, reg, - get_register(sim, reg));
             break;
 
-        case OP_GETC:
-            reg = sim->memory[sim->pc++];
-            set_register(sim, reg, fgetc(stdin));
+        case OP_SYS:
+            execute_sys(sim);
             break;
 
-        case OP_PUTC:
-            reg = sim->memory[sim->pc++];
-            fputc(get_register(sim, reg), stdout);
+        case OP_PAUSE:
+            execute_pause(sim);
             break;
 
-        case OP_PUTS:
-            reg = sim->memory[sim->pc++];
-            addr = get_register(sim, reg);
-            fputs((char *)(sim->memory + addr), stdout);
+        case OP_RETI:
+            execute_reti(sim);
             break;
 
-        case OP_PUTN:       // TODO - a bit of a hack
-            reg1 = sim->memory[sim->pc++];  // number
-            reg2 = sim->memory[sim->pc++];  // base
-            print_number(sim, get_register(sim, reg1), get_register(sim, reg2));
+        case OP_CAS:
+            execute_cas(sim);
             break;
 
-        case OP_PSTACK:     // TODO - a hack to quickly implement .S
-            reg = sim->memory[sim->pc++];
-            print_stack(sim->data_stack, get_register(sim, reg));
+        case OP_XADD:
+            execute_xadd(sim);
             break;
 
-        case OP_PRSTACK:    // TODO - a hack to quickly implement .R
-            reg = sim->memory[sim->pc++];
-            print_stack(sim->return_stack, get_register(sim, reg));
+        case OP_FENCE:
+            // Full barrier: no memory access moves across it in either direction
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
             break;
 
         case OP_CALL:
@@ -908,10 +2595,7 @@ void sim_step_into(Simulator *sim)
             break;
 
         case OP_DCLR:
-            while (sim->data_stack != NULL)
-            {
-                pop_data(sim);
-            }
+            clear_data(sim);
             break;
 
         case OP_RCLR:
@@ -922,32 +2606,31 @@ void sim_step_into(Simulator *sim)
             break;
 
         case OP_BRK:
-            printf("BRK at 0x%04X\n", sim->last_pc);
             if (sim->debugging)
             {
+                printf("BRK at 0x" CELL_FMT "\n", sim->last_pc);
                 sim->stopped = TRUE;
             }
             else
             {
-                sim->halted = TRUE;
+                sim_error(sim, SIM_ERR_BRK, "BRK at 0x" CELL_FMT, sim->last_pc);
             }
             break;
 
         default:
-            printf("Illegal opcode 0x%02X at 0x%04X (code 0x%02X, mode 0x%02X)\n", opcode, sim->last_pc, code, mode);
-            sim->halted = TRUE;
+            sim_error(sim, SIM_ERR_ILLEGAL, "Illegal opcode 0x%02X at 0x" CELL_FMT " (code 0x%02X, mode 0x%02X)", opcode, sim->last_pc, code, mode);
             break;
     }
 }
 
 
-bool sim_lookup_symbol(Simulator *sim, char *name, unsigned short *addr)
+bool sim_lookup_symbol(Simulator *sim, char *name, Cell *addr)
 {
     for (int i = 0; i < sim->num_symbols; i++)
     {
-        if (!strcmp(sim->symbols[i]->name, name))
+        if (!strcmp(sim->symbols[i].name, name))
         {
-            *addr = sim->symbols[i]->location;
+            *addr = sim->symbols[i].location;
             return TRUE;
         }
     }
@@ -956,23 +2639,77 @@ bool sim_lookup_symbol(Simulator *sim, char *name, unsigned short *addr)
 }
 
 
-char *sim_reverse_lookup_symbol(Simulator *sim, unsigned short addr)
+char *sim_reverse_lookup_symbol(Simulator *sim, Cell addr)
 {
-    for (int i = 0; i < sim->num_symbols; i++)
+    // Symbols are sorted by location; find the first one at addr
+    int lo = 0;
+    int hi = sim->num_symbols;
+    while (lo < hi)
     {
-        if (sim->symbols[i]->location == addr)
+        int mid = (lo + hi) / 2;
+        if (sim->symbols[mid].location < addr)
+        {
+            lo = mid + 1;
+        }
+        else
         {
-            return sim->symbols[i]->name;
+            hi = mid;
         }
     }
 
+    if (lo < sim->num_symbols && sim->symbols[lo].location == addr)
+    {
+        return sim->symbols[lo].name;
+    }
+
     return NULL;
 }
 
 
-void disassemble_register(Simulator *sim, char *buf, unsigned short *addr)
+bool sim_lookup_line(Simulator *sim, Cell addr, SimLine *line)
+{
+    // Find the last line map entry at or before addr
+    int lo = 0;
+    int hi = sim->num_lines;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (read_be32(sim->lines + mid * OBJ_LINE_SIZE) <= addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0)
+    {
+        return FALSE;
+    }
+
+    unsigned char *entry = sim->lines + (lo - 1) * OBJ_LINE_SIZE;
+    line->location = read_be32(entry);
+    line->line_number = read_be32(entry + 4);
+    return TRUE;
+}
+
+
+Cell sim_dict_entry(Simulator *sim, int idx)
+{
+    if (idx < 0 || idx >= sim->num_dict)
+    {
+        return 0;
+    }
+
+    return read_be32(sim->dict + idx * OBJ_DICT_SIZE);
+}
+
+
+void disassemble_register(Simulator *sim, char *buf, Cell *addr)
 {
-    unsigned char code = sim->memory[(*addr)++];
+    unsigned char code = sim_read_byte(sim, (*addr)++);
 
     char *name = op_register_to_name(code);
 
@@ -987,28 +2724,17 @@ void disassemble_register(Simulator *sim, char *buf, unsigned short *addr)
 }
 
 
-char *format_word(unsigned short addr)
-{
-    static char scratch[7];
-    sprintf(scratch, "0x%04X", addr);
-    return scratch;
-}
-
-
-char *format_byte(unsigned char b)
+void append_word(char *buf, Cell value)
 {
-    static char scratch[3];
-    sprintf(scratch, "%02X", b);
-    return scratch;
+    sprintf(buf + strlen(buf), "0x" CELL_FMT, value);
 }
 
 
-void disassemble_address(Simulator *sim, char *buf, unsigned short *addr)
+void disassemble_address(Simulator *sim, char *buf, Cell *addr)
 {
-    unsigned char hi_byte = sim->memory[(*addr)++];
-    unsigned char lo_byte = sim->memory[(*addr)++];
-    unsigned short val = (hi_byte << 8) + lo_byte;
-    strcat(buf, format_word(val));
+    Cell val = sim_read_word(sim, *addr);
+    *addr += CELL_BYTES;
+    append_word(buf, val);
 
     char *sym = sim_reverse_lookup_symbol(sim, val);
     if (sym != NULL)
@@ -1020,25 +2746,23 @@ void disassemble_address(Simulator *sim, char *buf, unsigned short *addr)
 }
 
 
-char *format_bytes(Simulator *sim, unsigned short start, unsigned short end)
+void format_bytes(Simulator *sim, char *buf, Cell start, Cell end)
 {
-    static char scratch[MAXCHAR];
-    strcpy(scratch, "");
+    strcpy(buf, "");
     while (start < end)
     {
-        strcat(scratch, format_byte(sim->memory[start]));
+        sprintf(buf + strlen(buf), "%02X", sim_read_byte(sim, start));
         start += 1;
     }
-    return scratch;
 }
 
 
-void disassemble_one(Simulator *sim, unsigned short *addr)
+void disassemble_one(Simulator *sim, Cell *addr)
 {
-    unsigned short start = *addr;
+    Cell start = *addr;
     char buf[MAXCHAR];
     strcpy(buf, "");
-    unsigned char opcode = sim->memory[(*addr)++];
+    unsigned char opcode = sim_read_byte(sim, (*addr)++);
 
     unsigned char code = opcode & ~0x03;
     unsigned char mode = opcode & 0x03;
@@ -1089,14 +2813,12 @@ void disassemble_one(Simulator *sim, unsigned short *addr)
         case OP_RPUSH:
         case OP_DPOP:
         case OP_RPOP:
-        case OP_PSTACK:
-        case OP_PRSTACK:
+        case OP_RPICK:
+        case OP_RLOOP:
+        case OP_BRZ:
         case OP_INC:
         case OP_DEC:
         case OP_NEG:
-        case OP_PUTC:
-        case OP_PUTS:
-        case OP_PUTN:
         case OP_ADD:
         case OP_AND:
         case OP_NOT:
@@ -1104,8 +2826,28 @@ void disassemble_one(Simulator *sim, unsigned short *addr)
         case OP_XOR:
         case OP_MUL:
         case OP_DIV:
+        case OP_UMUL:
+        case OP_MMUL:
+        case OP_UDIV:
+        case OP_SDIV:
+        case OP_DADD:
         case OP_SUB:
         case OP_CMP:
+        case OP_CMPS:
+        case OP_SCAS:
+        case OP_MOVS:
+        case OP_FILS:
+        case OP_TOKEN:
+        case OP_TONUM:
+        case OP_GETL:
+        case OP_CAS:
+        case OP_XADD:
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BGT:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLE:
             strcat(buf, " ");
             disassemble_register(sim, buf, addr);
             break;
@@ -1114,12 +2856,32 @@ void disassemble_one(Simulator *sim, unsigned short *addr)
             strcat(buf, " ");
             disassemble_address(sim, buf, addr);
             break;
+
+        case OP_SYS:
+            // A service number, not an address, so no symbol
+            strcat(buf, " ");
+            append_word(buf, sim_read_word(sim, *addr));
+            *addr += CELL_BYTES;
+            break;
     }
 
     // Handle the second argument
     switch (code)
     {
-        case OP_PUTN:
+        case OP_UMUL:
+        case OP_MMUL:
+        case OP_UDIV:
+        case OP_SDIV:
+        case OP_DADD:
+        case OP_CMPS:
+        case OP_SCAS:
+        case OP_MOVS:
+        case OP_FILS:
+        case OP_TOKEN:
+        case OP_TONUM:
+        case OP_GETL:
+        case OP_CAS:
+        case OP_XADD:
             strcat(buf, ", ");
             disassemble_register(sim, buf, addr);
             break;
@@ -1136,6 +2898,14 @@ void disassemble_one(Simulator *sim, unsigned short *addr)
         case OP_DIV:
         case OP_SUB:
         case OP_CMP:
+        case OP_RPICK:
+        case OP_RLOOP:
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BGT:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLE:
             switch (mode)
             {
                 case ADDR_MODE0:
@@ -1163,7 +2933,46 @@ void disassemble_one(Simulator *sim, unsigned short *addr)
             break;
     }
 
-    unsigned short end = *addr;
+    // Handle any further (register) arguments
+    int extra = 0;
+    switch (code)
+    {
+        case OP_CMPS:
+        case OP_MOVS:
+        case OP_FILS:
+        case OP_TONUM:
+        case OP_UDIV:
+        case OP_SDIV:
+        case OP_CAS:
+            extra = 1;
+            break;
+
+        case OP_SCAS:
+        case OP_DADD:
+            extra = 2;
+            break;
+    }
+    for (int i = 0; i < extra; i++)
+    {
+        strcat(buf, ", ");
+        disassemble_register(sim, buf, addr);
+    }
+
+    // Branch target
+    switch (code)
+    {
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BGT:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLE:
+            strcat(buf, ", ");
+            disassemble_address(sim, buf, addr);
+            break;
+    }
+
+    Cell end = *addr;
 
     char *sym = sim_reverse_lookup_symbol(sim, start);
     char buf2[MAXCHAR];
@@ -1188,11 +2997,13 @@ void disassemble_one(Simulator *sim, unsigned short *addr)
         bp = "*B*";
     }
 
-    printf(" %-2s %-3s 0x%04X %-12.12s %-8s %s\n", indi, bp, start, buf2, format_bytes(sim, start, end), buf);
+    char bytes[MAXCHAR];
+    format_bytes(sim, bytes, start, end);
+    printf(" %-2s %-3s 0x" CELL_FMT " %-12.12s %-8s %s\n", indi, bp, start, buf2, bytes, buf);
 }
 
 
-void sim_disassemble(Simulator *sim, unsigned short addr, int num)
+void sim_disassemble(Simulator *sim, Cell addr, int num)
 {
     while (num > 0)
     {
@@ -1203,7 +3014,7 @@ void sim_disassemble(Simulator *sim, unsigned short addr, int num)
 
 
 // TODO - add temporary flag
-void sim_toggle_breakpoint(Simulator *sim, unsigned short addr)
+void sim_toggle_breakpoint(Simulator *sim, Cell addr)
 {
     // If the breakpoint already exists, remove it from the list...
     for (Breakpoint *bp = sim->breakpoints, *prev = NULL; bp != NULL; prev = bp, bp = bp->next)
@@ -1219,7 +3030,7 @@ void sim_toggle_breakpoint(Simulator *sim, unsigned short addr)
                 prev->next = bp->next;
             }
             free(bp);
-            printf("Breakpoint at 0x%04X cleared.\n", addr);
+            printf("Breakpoint at 0x" CELL_FMT " cleared.\n", addr);
             return;
         }
     }
@@ -1232,7 +3043,7 @@ void sim_toggle_breakpoint(Simulator *sim, unsigned short addr)
 
     sim->breakpoints = bp;
 
-    printf("Breakpoint at 0x%04X set.\n", addr);
+    printf("Breakpoint at 0x" CELL_FMT " set.\n", addr);
 }
 
 
@@ -1253,15 +3064,31 @@ void sim_reset(Simulator *sim)
     sim->x = 0x0000;
     sim->y = 0x0000;
     sim->z = 0x0000;
-    sim->flags = 0x0000;
+    sim->t = 0x0000;
+    sim->flag_kind = FLAGS_NONE;
     sim->halted = FALSE;
     sim->stopped = FALSE;
     sim->debugging = FALSE;
-
-    while (sim->data_stack != NULL)
-    {
-        pop_data(sim);
-    }
+    sim->waiting = FALSE;
+    sim->wait_channel = NULL;
+    sim->preempted = FALSE;
+    sim->returned = FALSE;
+    sim->error = SIM_OK;
+    strcpy(sim->error_message, "");
+    sim->exit_code = 0;
+    sim->timer_period = 0;
+    sim->timer_count = SIM_NO_LIMIT;
+    sim->timer_vector = 0x0000;
+    sim->in_interrupt = FALSE;
+
+    // Discard any pending input
+    sim->input_pos = sim->input_len;
+    sim->io_pos = sim->io_len;
+
+    clear_data(sim);
+    close_files(sim);
+    reset_blocks(sim);
+    reset_tasks(sim);
 
     while (sim->return_stack != NULL)
     {
@@ -1272,7 +3099,95 @@ void sim_reset(Simulator *sim)
     {
         pop_call(sim);
     }
+}
+
+
+bool sim_eval(Simulator *sim, const char *src, size_t len, SimBuffer *out)
+{
+    // Feed src to the VM as input, capturing its output, and run until it has
+    // all been consumed and the VM is waiting for more. A fresh VM boots first.
+    // Returns FALSE if the VM halted.
+    sim->host_input = TRUE;
+    sim->input = src;
+    sim->input_len = len;
+    sim->input_pos = 0;
+    sim->waiting = FALSE;
+    sim->wait_channel = NULL;
+
+    sim->output = out;
+    if (out != NULL)
+    {
+        out->len = 0;
+        sim_output(sim, "", 0);     // make sure there is a terminated buffer
+    }
 
-    // TODO - clear input buffers
+    sim_run(sim);
+
+    // The caller owns src and out
+    sim->input = NULL;
+    sim->input_len = 0;
+    sim->input_pos = 0;
+    sim->output = NULL;
+
+    return !sim->halted;
 }
 
+
+bool sim_call(Simulator *sim, Cell xt, const Cell *args, int nargs, Cell *results, int nresults)
+{
+    // Run the word xt in the running task, with args on the data stack
+    // (args[0] deepest), and take nresults results off it (results[0]
+    // deepest). The registers are put back afterwards, so the VM goes on as
+    // before. The image has to provide call_entry, which runs the word with
+    // CA = xt and then does SYS_RETURN. Returns FALSE if the word did not
+    // return, because it halted, used up the budget or waited for input;
+    // the VM is then left in the middle of the word.
+    Cell entry;
+    if (sim->halted || !sim_lookup_symbol(sim, "call_entry", &entry))
+    {
+        return FALSE;
+    }
+
+    Cell *regs[NUM_INTERRUPT_REGISTERS];
+    Cell saved[NUM_INTERRUPT_REGISTERS];
+    interrupt_registers(sim, regs);
+    for (int i = 0; i < NUM_INTERRUPT_REGISTERS; i++)
+    {
+        saved[i] = *regs[i];
+    }
+    unsigned char flag_kind = sim->flag_kind;
+    bool waiting = sim->waiting;
+
+    for (int i = 0; i < nargs; i++)
+    {
+        push_data(sim, args[i]);
+    }
+
+    sim->pc = entry;
+    sim->ca = xt;
+    sim->returned = FALSE;
+    sim->waiting = FALSE;
+    sim_run(sim);
+    if (!sim->returned)
+    {
+        return FALSE;
+    }
+    sim->returned = FALSE;
+
+    for (int i = nresults - 1; i >= 0; i--)
+    {
+        results[i] = pop_data(sim);
+    }
+    if (sim->halted)
+    {
+        return FALSE;
+    }
+
+    for (int i = 0; i < NUM_INTERRUPT_REGISTERS; i++)
+    {
+        *regs[i] = saved[i];
+    }
+    sim->flag_kind = flag_kind;
+    sim->waiting = waiting;
+    return TRUE;
+}
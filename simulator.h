@@ -1,55 +1,264 @@
 #ifndef SIMULATOR_H
 #define SIMULATOR_H
 
+#include <stddef.h>
+#include <limits.h>
+#include <sys/types.h>
+
 #include "common.h"
 
-#define MEMSIZE 1<<16
+// Size of the simulated memory, which must be a power of two; addresses
+// wrap around at the end. Override with -DMEMSIZE=n.
+#ifndef MEMSIZE
+#ifdef CELL32
+#define MEMSIZE (1<<20)
+#else
+#define MEMSIZE (1<<16)
+#endif
+#endif
+
+#if (MEMSIZE & (MEMSIZE - 1)) != 0
+#error MEMSIZE must be a power of two
+#endif
+
+#define MEMMASK (MEMSIZE - 1)
+
+// Host services, called by SYS n. Arguments and results are passed in registers.
+#define SIM_MAX_SERVICES 64
+
+#define SYS_EMIT        1   // print the character in A
+#define SYS_KEY         2   // read a character into A (-1 at end of input)
+#define SYS_WRITE       3   // write B bytes from address A; A = count written
+#define SYS_READ        4   // read up to B bytes (up to a newline) into A; A = count, or -1 at end of input
+#define SYS_PUTN        5   // print the number in A in base B
+#define SYS_PSTACK      6   // print the data stack in base A
+#define SYS_PRSTACK     7   // print the return stack in base A
+#define SYS_CLOCK       8   // A:B = milliseconds since an arbitrary point
+#define SYS_EXIT        9   // halt with exit code A
+#define SYS_OPEN        10  // open file named by A (length B) with access method C; C = file id, D = ior
+#define SYS_CREATE      11  // as SYS_OPEN, but create or truncate the file
+#define SYS_CLOSE       12  // close file C; D = ior
+#define SYS_FREAD       13  // read up to B bytes from file C into A; A = count (0 at end of file), D = ior
+#define SYS_FWRITE      14  // write B bytes from A to file C; A = count, D = ior
+#define SYS_FSIZE       15  // A:B = size of file C; D = ior
+#define SYS_FTELL       16  // A:B = position in file C; D = ior
+#define SYS_FSEEK       17  // move the position in file C to A:B; D = ior
+#define SYS_BLOCK       18  // A = address of a buffer holding block A
+#define SYS_BUFFER      19  // A = address of a buffer assigned to block A, not read from the file
+#define SYS_UPDATE      20  // mark the last buffer returned as changed
+#define SYS_SAVEBUFS    21  // write changed buffers back to the block file
+#define SYS_EMPTYBUFS   22  // unassign every buffer, dropping any changes
+#define SYS_BLKPOOL     23  // A = address of the block buffers (the end of memory without a block file)
+#define SYS_KEYQ        24  // A = non-zero if a character can be read without waiting
+#define SYS_TASK        25  // A = id of a new, stopped task
+#define SYS_ACTIVATE    26  // start task A at machine code D, with IP = B and C on its return stack
+#define SYS_STOP        27  // stop the running task and switch to the next
+#define SYS_TIMER       28  // interrupt to machine code A every B instructions (B = 0 for never)
+#define SYS_SPAWN       29  // A = id of a new core running machine code D, with CA = B and A on its stack
+#define SYS_JOIN        30  // wait for core A to finish; A = its top of stack
+#define SYS_CHANNEL     31  // A = id of a new channel holding A cells
+#define SYS_SEND        32  // send A on channel B, waiting if C != 0; D = sent?
+#define SYS_RECEIVE     33  // A = a cell from channel B, waiting if C != 0; D = received?
+#define SYS_CLOSECHAN   34  // close channel B
+#define SYS_RETURN      35  // end a sim_call and go back to the host
+
+// Value of the instruction budget and timer count when they are not in use
+#define SIM_NO_LIMIT    ULONG_MAX
+
+// Why the VM halted, in sim->error; SIM_OK when it was not an error (SYS_EXIT)
+#define SIM_OK          0
+#define SIM_ERR_LOAD    1   // the object image could not be loaded
+#define SIM_ERR_STACK   2   // stack underflow
+#define SIM_ERR_ILLEGAL 3   // illegal opcode, register or address mode, or RETI outside an interrupt
+#define SIM_ERR_DIVIDE  4   // division by zero
+#define SIM_ERR_ALIGN   5   // unaligned atomic access
+#define SIM_ERR_SERVICE 6   // SYS with no service installed
+#define SIM_ERR_LIMIT   7   // out of tasks, cores or channels
+#define SIM_ERR_ID      8   // no such task, core or channel
+#define SIM_ERR_IO      9   // block file or input error
+#define SIM_ERR_TASKS   10  // every task has stopped
+#define SIM_ERR_HLT     11  // executed HLT
+#define SIM_ERR_BRK     12  // executed BRK outside the debugger
+
+// File access methods, for SYS_OPEN and SYS_CREATE
+#define FAM_RO          0
+#define FAM_WO          1
+#define FAM_RW          2
+
+#define SIM_MAX_FILES   16
 
 
 typedef struct SimSymbol
 {
     char *name;
-    unsigned short location;
+    Cell location;
 } SimSymbol;
 
 
+typedef struct SimLine
+{
+    Cell location;
+    int line_number;
+} SimLine;
+
+
 typedef struct StackNode
 {
-    unsigned short value;
+    Cell value;
     struct StackNode *next;
 } StackNode;
 
 
 typedef struct Breakpoint
 {
-    unsigned short addr;
+    Cell addr;
     bool temporary;             // used to implement step-over
     struct Breakpoint *next;
 } Breakpoint;
 
 
+typedef struct SimFile
+{
+    int fd;                 // -1 when the slot is free
+    off_t pos;              // where the next read or write starts
+} SimFile;
+
+
+#define BLOCK_SIZE      1024
+#define NO_BLOCK        (-1)
+
+
+typedef struct SimBlockBuffer
+{
+    Cell addr;              // where the buffer is in VM memory
+    long block;             // block it holds, or NO_BLOCK
+    bool dirty;             // changed since it was read (UPDATE)
+    unsigned long last_used;    // SimBlocks clock when last used, for LRU replacement
+} SimBlockBuffer;
+
+
+typedef struct SimBlocks
+{
+    int fd;                 // block file, mapped from the start
+    unsigned char *map;
+    size_t num_blocks;      // blocks in the file and the mapping
+    Cell pool;              // start of the buffers in VM memory
+    int num_buffers;
+    SimBlockBuffer *buffers;
+    SimBlockBuffer *current;    // last buffer returned; UPDATE marks this one
+    unsigned long clock;
+
+    // Counters
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long writebacks;
+} SimBlocks;
+
+
+#define SIM_MAX_TASKS   16
+#define SIM_MAX_CORES   16
+#define SIM_MAX_CHANNELS 64
+
+#define TASK_FREE       0   // slot not in use
+#define TASK_READY      1   // running, or waiting for its turn
+#define TASK_BLOCKED    2   // waiting for input
+#define TASK_STOPPED    3   // not activated yet, or stopped
+
+
+typedef struct SimTask
+{
+    int state;              // TASK_xx
+
+    // Registers and stacks, saved while another task is running
+    Cell pc;
+    Cell ip;
+    Cell ca;
+    Cell a;
+    Cell b;
+    Cell c;
+    Cell d;
+    Cell i;
+    Cell j;
+    Cell m;
+    Cell n;
+    Cell x;
+    Cell y;
+    Cell z;
+    Cell t;
+    unsigned char flag_kind;
+    Cell flag_val1;
+    Cell flag_val2;
+    bool in_interrupt;
+    int data_depth;
+    StackNode *data_stack;
+    StackNode *return_stack;
+    StackNode *call_stack;
+
+    struct SimTask *next;   // ring of ready tasks, or list of blocked ones
+    struct SimTask *prev;
+} SimTask;
+
+
+typedef struct SimBuffer
+{
+    char *data;             // NUL-terminated, grown as needed
+    size_t len;
+    size_t size;
+} SimBuffer;
+
+
+struct Simulator;
+typedef void (*SimService)(struct Simulator *sim);
+
+
+// Host I/O in place of stdio (see sim_set_io). read returns the number of
+// bytes read, 0 at end of input, or -1 if there is none yet, and the VM then
+// waits as it does for sim_eval. write may be called from core threads.
+typedef struct SimIO
+{
+    void (*write)(void *context, const char *str, size_t len);
+    long (*read)(void *context, char *buf, size_t size);
+    void *context;
+} SimIO;
+
+#define SIM_IO_BUFSIZE  256
+
+typedef struct SimReader SimReader;     // background input reader (simreader.c)
+typedef struct SimCores SimCores;       // cores sharing one memory (simcores.c)
+typedef struct SimChannel SimChannel;   // queue of cells between VMs (simchannels.c)
+typedef struct SimChannels SimChannels; // channels a group of VMs share
+
+
 typedef struct Simulator
 {
     unsigned char *memory;
 
     // Registers
-    unsigned short pc;      // program counter
-    unsigned short ip;      // instruction pointer
-    unsigned short ca;      // code address pointer
-    unsigned short a;       // scratch registers
-    unsigned short b;
-    unsigned short c;
-    unsigned short d;
-    unsigned short i;
-    unsigned short j;
-    unsigned short m;
-    unsigned short n;
-    unsigned short x;
-    unsigned short y;
-    unsigned short z;
-    unsigned short flags;   // flags register (bits) - uses FLAG_xx macros in opcodes.h
-
-    // Stacks
+    Cell pc;                // program counter
+    Cell ip;                // instruction pointer
+    Cell ca;                // code address pointer
+    Cell a;                 // scratch registers
+    Cell b;
+    Cell c;
+    Cell d;
+    Cell i;
+    Cell j;
+    Cell m;
+    Cell n;
+    Cell x;
+    Cell y;
+    Cell z;
+    Cell t;                 // top of the data stack, when data_depth > 0
+
+    // The flags are not stored; the last compare is recorded here and
+    // sim_flags works out the FLAG_xx bits when something asks for them
+    unsigned char flag_kind;    // FLAGS_xx
+    Cell flag_val1;
+    Cell flag_val2;
+
+    // Stacks; the top item of the data stack is cached in t, and data_stack
+    // holds the rest
+    int data_depth;
     StackNode *data_stack;
     StackNode *return_stack;
     StackNode *call_stack;
@@ -58,32 +267,140 @@ typedef struct Simulator
     bool halted;    // hit HLT or error
     bool stopped;   // hit BRK
     bool debugging; // TRUE if running in debugger
+    bool waiting;   // stopped until the host provides more input
+    bool preempted; // sim_run used up its instruction budget
+    bool returned;  // hit SYS_RETURN, ending a sim_call
+
+    // Why the VM halted (SIM_ERR_xx) and what went wrong, kept until
+    // sim_reset; the tools also have the message printed
+    int error;
+    char error_message[MAXCHAR];
+    bool print_errors;
+
+    // Instructions sim_run may still execute before it returns to the host;
+    // SIM_NO_LIMIT for no limit. The host sets it before each sim_run.
+    unsigned long budget;
+
+    // Timer interrupt: every timer_period instructions the registers are
+    // saved on the call stack and the VM jumps to timer_vector, until RETI.
+    // Ticks that come while the handler runs are dropped.
+    unsigned long timer_period;     // 0 when the timer is off
+    unsigned long timer_count;      // instructions to the next tick
+    Cell timer_vector;
+    bool in_interrupt;              // running the handler, for the current task
+
+    // Input provided by the host (see sim_eval); until then the reader thread
+    // is used if one was started, or stdin
+    SimReader *reader;
+    bool host_input;
+    const char *input;
+    size_t input_len;
+    size_t input_pos;
+
+    // Captured output; the write callback or stdout is used when this is NULL
+    SimBuffer *output;
+
+    // Host I/O callbacks, and input read from the read callback that the VM
+    // has not consumed yet
+    SimIO io;
+    char io_buffer[SIM_IO_BUFSIZE];
+    size_t io_len;
+    size_t io_pos;
+    bool io_eof;            // the read callback has reported the end of input
+
+    // Handlers for SYS n, and the code passed to SYS_EXIT
+    SimService services[SIM_MAX_SERVICES];
+    int exit_code;
+
+    // Files opened by the file services; the file id is 1 + the slot. Names
+    // are resolved under the file_root directory, and nothing can be opened
+    // while it is -1 (see sim_set_file_root).
+    int file_root;
+    SimFile files[SIM_MAX_FILES];
+
+    // Block file and buffers, or NULL (see sim_open_blocks)
+    SimBlocks *blocks;
+
+    // Tasks; the registers and stacks above belong to the running one
+    SimTask tasks[SIM_MAX_TASKS];
+    SimTask *task;          // running task, which is on the ready ring
+    SimTask *blocked;       // tasks waiting for input
+
+    // Cores running on other threads against this memory, shared by all of
+    // them; NULL until the first is spawned
+    SimCores *cores;
+
+    // Channels this VM can use, shared with its cores and any VM it was
+    // joined to by sim_share_channels; and the one it is waiting on, if any
+    SimChannels *channels;
+    SimChannel *wait_channel;
+    bool wait_to_send;
 
     // Set of addresses that have breakpoints set
     Breakpoint *breakpoints;
 
     // Debugging helpers
-    unsigned short last_pc;
+    Cell last_pc;
 
-    // Symbols
+    // Symbols, sorted by location
     int num_symbols;
-    SimSymbol **symbols;
+    SimSymbol *symbols;
+
+    // Dictionary index and line map, used in place from the mapped object file
+    int num_dict;
+    unsigned char *dict;
+    int num_lines;
+    unsigned char *lines;
+
+    // Mapped object file (version 2 objects only), or a copy of the image
+    // when it was loaded from memory
+    void *mapping;
+    size_t mapping_size;
+    bool mapping_copied;    // malloc'd by sim_load rather than mapped
+    bool shared_image;      // the symbols and mapping belong to another VM (clones and cores)
 } Simulator;
 
 
 Simulator *sim_init(char *objfile);
+Simulator *sim_load(const void *image, size_t size, int *error);
 void sim_load_symbols(Simulator *sim, char *symfile);
 void sim_run(Simulator *sim);
 void sim_step_into(Simulator *sim);
 void sim_step_over(Simulator *sim);
-void sim_disassemble(Simulator *sim, unsigned short addr, int num);
-char *sim_reverse_lookup_symbol(Simulator *sim, unsigned short addr);
-bool sim_lookup_symbol(Simulator *sim, char *name, unsigned short *addr);
-unsigned short sim_read_word(Simulator *sim, unsigned short addr);
-unsigned short sim_read_byte(Simulator *sim, unsigned short addr);
-void sim_toggle_breakpoint(Simulator *sim, unsigned short addr);
+void sim_disassemble(Simulator *sim, Cell addr, int num);
+char *sim_reverse_lookup_symbol(Simulator *sim, Cell addr);
+bool sim_lookup_symbol(Simulator *sim, char *name, Cell *addr);
+bool sim_lookup_line(Simulator *sim, Cell addr, SimLine *line);
+Cell sim_dict_entry(Simulator *sim, int idx);
+StackNode *sim_data_stack(Simulator *sim, StackNode *top);
+Cell sim_flags(Simulator *sim);
+Cell sim_read_word(Simulator *sim, Cell addr);
+Cell sim_read_byte(Simulator *sim, Cell addr);
+void sim_toggle_breakpoint(Simulator *sim, Cell addr);
 void sim_reset(Simulator *sim);
+bool sim_eval(Simulator *sim, const char *src, size_t len, SimBuffer *out);
+bool sim_register_service(Simulator *sim, Cell num, SimService service);
+void sim_output(Simulator *sim, const char *str, size_t len);
+unsigned int sim_clamp_length(Cell addr, Cell len);
+bool sim_set_file_root(Simulator *sim, const char *dir);
+bool sim_open_blocks(Simulator *sim, const char *path, int num_buffers);
+void sim_close_blocks(Simulator *sim);
+bool sim_start_reader(Simulator *sim, int fd);
+void sim_stop_reader(Simulator *sim);
+void sim_await_input(Simulator *sim);
+Simulator *sim_init_core(Simulator *sim);
+void sim_free_core(Simulator *core);
+void sim_share_channels(Simulator *sim, Simulator *other);
+Simulator *sim_clone(Simulator *sim);
+void sim_free(Simulator *sim);
+void sim_error(Simulator *sim, int code, const char *fmt, ...);
+void sim_set_io(Simulator *sim, const SimIO *io);
+bool sim_call(Simulator *sim, Cell xt, const Cell *args, int nargs, Cell *results, int nresults);
+void sim_write_byte(Simulator *sim, Cell addr, Cell value);
+void sim_write_word(Simulator *sim, Cell addr, Cell value);
+void sim_push(Simulator *sim, Cell value);
+bool sim_pop(Simulator *sim, Cell *value);
 
-char *format_word(unsigned short addr);
+void append_word(char *buf, Cell value);
 
 #endif